@@ -0,0 +1,59 @@
+#
+# Locate liburing package
+#
+# This script defines the following variables
+#  LIBURING_FOUND - System has liburing
+#  LIBURING_INCLUDE_DIRS - The liburing include directories
+#  LIBURING_LIBRARIES - The libraries needed to use liburing
+#
+# Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+
+find_package(PkgConfig)
+pkg_check_modules(PC_LIBURING QUIET liburing)
+
+find_path(LIBURING_INCLUDE_DIR
+    liburing.h
+    HINTS
+    ${PC_LIBURING_INCLUDEDIR}
+    ${PC_LIBURING_INCLUDE_DIRS}
+    )
+
+find_library(LIBURING_LIBRARY
+    NAMES uring
+    HINTS
+    ${PC_LIBURING_LIBDIR}
+    ${PC_LIBURING_LIBRARY_DIRS}
+    )
+
+set(LIBURING_LIBRARIES    ${LIBURING_LIBRARY})
+set(LIBURING_INCLUDE_DIRS ${LIBURING_INCLUDE_DIR})
+
+include(FindPackageHandleStandardArgs)
+
+find_package_handle_standard_args(liburing DEFAULT_MSG
+    LIBURING_LIBRARY LIBURING_INCLUDE_DIR)
+
+mark_as_advanced(
+    LIBURING_INCLUDE_DIR
+    LIBURING_INCLUDE_DIRS
+    LIBURING_LIBRARY
+    LIBURING_LIBRARIES
+    )
@@ -31,7 +31,9 @@
  * Includes
  ******************************************************************************/
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <linux/can.h>
 
 /*******************************************************************************
@@ -51,6 +53,35 @@
 #define CAN2UDP_PACKET_VERSION 2
 #define CAN2UDP_TIMEOUT (1 << 0)
 
+/* .. version 3 packet carries compact records instead of can2udp_record_t */
+#define CAN2UDP_COMPACT (1 << 1)
+
+/* .. version 4 packet: the kernel dropped frames since the previous packet of the interface */
+#define CAN2UDP_KERNEL_DROPS (1 << 2)
+
+/* .. flag of the frame marking CAN FD frames. Older kernel headers lack it */
+#ifndef CANFD_FDF
+#define CANFD_FDF 0x04
+#endif
+
+/* .. versions of the data packet structure */
+#define CAN2UDP_PACKET_VERSION_1 1
+#define CAN2UDP_PACKET_VERSION_2 2
+#define CAN2UDP_PACKET_VERSION_3 3
+#define CAN2UDP_PACKET_VERSION_4 4
+
+/* .. default size of version 3 packets, fits into Ethernet MTU with IPv4 and UDP headers */
+#define CAN2UDP_DEFAULT_MTU 1472
+
+/* .. capture segment files */
+#define CAN2UDP_SEGMENT_MAGIC "C2USEG\0\0"
+#define CAN2UDP_SEGMENT_VERSION 1
+
+/* .. clocks of timestamps in capture segments, older segments leave it unknown */
+#define CAN2UDP_SEGMENT_CLOCK_UNKNOWN 0
+#define CAN2UDP_SEGMENT_CLOCK_REALTIME 1
+#define CAN2UDP_SEGMENT_CLOCK_HARDWARE 2
+
 /*******************************************************************************
  * Type declarations
  ******************************************************************************/
@@ -98,4 +129,236 @@ struct can2udp_packet
 
 COMPILE_TIME_ASSERT( sizeof(can2udp_packet_t) == 84 )
 
+/* .. header of the data packet aggregating several frames of one interface.
+ *    It is followed by 'count' records of can2udp_record_t.
+ */
+typedef
+struct can2udp_packet_ver3
+{
+    /* .. version of the data packet structure */
+    uint8_t version;
+
+    /* .. miscellaneous flags */
+    uint8_t flags;
+
+    /* .. id of the can interface the host */
+    uint16_t interface_id;
+
+    /* .. number of frame records following the header */
+    uint16_t count;
+
+    /* .. reserved, zero */
+    uint16_t reserved;
+
+} __attribute__ ((packed)) can2udp_packet_ver3_t;
+
+COMPILE_TIME_ASSERT( sizeof(can2udp_packet_ver3_t) == 8 )
+
+/* .. header of the version 4 data packet. It is the version 3 header extended with
+ *    loss detection and followed by records the same way.
+ */
+typedef
+struct can2udp_packet_ver4
+{
+    /* .. version of the data packet structure */
+    uint8_t version;
+
+    /* .. miscellaneous flags */
+    uint8_t flags;
+
+    /* .. id of the can interface the host */
+    uint16_t interface_id;
+
+    /* .. number of frame records following the header */
+    uint16_t count;
+
+    /* .. reserved, zero */
+    uint16_t reserved;
+
+    /* .. sequence number of the packet, incremented by one for every packet of the interface */
+    uint32_t sequence;
+
+    /* .. total number of frames the kernel dropped before they were read, wraps around */
+    uint32_t drops;
+
+} __attribute__ ((packed)) can2udp_packet_ver4_t;
+
+COMPILE_TIME_ASSERT( sizeof(can2udp_packet_ver4_t) == 16 )
+
+/* .. frame record of the version 3 and 4 data packets */
+typedef
+struct can2udp_record
+{
+    /* .. SocketCAN frame */
+    struct canfd_frame raw_frame;
+
+    /*.. timestamp in nanoseconds. Zero if not available. */
+    uint64_t timestamp;
+
+} __attribute__ ((packed)) can2udp_record_t;
+
+COMPILE_TIME_ASSERT( sizeof(can2udp_record_t) == 80 )
+
+/* .. compact frame record of the version 3 data packet with CAN2UDP_COMPACT flag.
+ *    Only 'len' bytes of payload follow the record header.
+ */
+typedef
+struct can2udp_compact_record
+{
+    /*.. timestamp in nanoseconds. Zero if not available. */
+    uint64_t timestamp;
+
+    /* .. 32 bit CAN_ID + EFF/RTR/ERR flags */
+    canid_t can_id;
+
+    /* .. frame payload length in byte */
+    uint8_t len;
+
+    /* .. CAN FD flags of the frame, CANFD_FDF is set for CAN FD frames */
+    uint8_t flags;
+
+    /* .. payload */
+    uint8_t data[];
+
+} __attribute__ ((packed)) can2udp_compact_record_t;
+
+COMPILE_TIME_ASSERT( sizeof(can2udp_compact_record_t) == 14 )
+COMPILE_TIME_ASSERT( sizeof(can2udp_compact_record_t) + CAN_MAX_DLEN == 22 )
+COMPILE_TIME_ASSERT( sizeof(can2udp_compact_record_t) + CANFD_MAX_DLEN == 78 )
+
+/* .. header of a capture segment file. It is followed by the time index at 'index_offset',
+ *    the first timestamp of every block, and by 'block_count' blocks of 'block_size' bytes
+ *    at 'data_offset'. Every block is a version 3 packet with compact records, padded up to
+ *    'block_size', so blocks are decoded like UDP packets.
+ */
+typedef
+struct can2udp_segment_header
+{
+    /* .. CAN2UDP_SEGMENT_MAGIC */
+    uint8_t magic[8];
+
+    /* .. CAN2UDP_SEGMENT_VERSION */
+    uint32_t version;
+
+    /* .. size of a block */
+    uint32_t block_size;
+
+    /* .. number of the segment, incremented on every rotation */
+    uint64_t sequence;
+
+    /* .. size of the file */
+    uint64_t size;
+
+    /* .. offsets of the time index and of the first block */
+    uint64_t index_offset;
+    uint64_t data_offset;
+
+    /* .. capacity of the segment and number of blocks written, the last one may still grow */
+    uint32_t block_count;
+    uint32_t blocks;
+
+    /* .. number of frames and timestamps of the first and the last one in nanoseconds.
+     *    All timestamps of a segment come from one clock and never decrease */
+    uint64_t frames;
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+
+    /* .. id of the interface in UDP packets */
+    uint16_t interface_id;
+
+    /* .. the recorder moved on to the next segment */
+    uint8_t closed;
+
+    /* .. CAN2UDP_SEGMENT_CLOCK_* of all timestamps */
+    uint8_t clock;
+
+    /* .. reserved, zero */
+    uint8_t reserved[4];
+
+    /* .. SocketCAN interface name */
+    char interface_name[16];
+
+} __attribute__ ((packed)) can2udp_segment_header_t;
+
+COMPILE_TIME_ASSERT( sizeof(can2udp_segment_header_t) == 104 )
+
+/*******************************************************************************
+ * Helpers
+ ******************************************************************************/
+
+/* .. size of the compact record carrying 'len' bytes of payload */
+static inline size_t can2udp_compact_record_size(uint8_t len)
+{
+    return sizeof(can2udp_compact_record_t) + len;
+}
+
+/* .. encode the frame as compact record to 'dst'. Returns the size of the record */
+static inline size_t can2udp_compact_record_encode(void *dst, const struct canfd_frame *frame, uint64_t timestamp)
+{
+    can2udp_compact_record_t *record = (can2udp_compact_record_t *)dst;
+    uint8_t len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+
+    record->timestamp = timestamp;
+    record->can_id = frame->can_id;
+    record->len = len;
+    record->flags = frame->flags;
+    memcpy(record->data, frame->data, len);
+
+    return can2udp_compact_record_size(len);
+}
+
+/* .. decode the compact record at 'src' holding at most 'length' bytes.
+ *    Returns the size of the record or 0 if the record is malformed.
+ */
+static inline size_t can2udp_compact_record_decode(const void *src, size_t length, struct canfd_frame *frame, uint64_t *timestamp)
+{
+    const can2udp_compact_record_t *record = (const can2udp_compact_record_t *)src;
+
+    if (length < sizeof(*record) || record->len > CANFD_MAX_DLEN ||
+        length < can2udp_compact_record_size(record->len))
+        return 0;
+
+    memset(frame, 0, sizeof(*frame));
+    frame->can_id = record->can_id;
+    frame->len = record->len;
+    frame->flags = record->flags;
+    memcpy(frame->data, record->data, record->len);
+
+    if (timestamp)
+        *timestamp = record->timestamp;
+
+    return can2udp_compact_record_size(record->len);
+}
+
+/* .. i-th block of the mapped segment */
+static inline const can2udp_packet_ver3_t *can2udp_segment_block(const void *segment, uint32_t i)
+{
+    const can2udp_segment_header_t *header = (const can2udp_segment_header_t *)segment;
+
+    return (const can2udp_packet_ver3_t *)((const uint8_t *)segment + header->data_offset + (size_t)i * header->block_size);
+}
+
+/* .. the block holding the first frame at or after 'timestamp': the last block starting
+ *    at or before it, or the first block. Frames are stored in order of reception.
+ */
+static inline uint32_t can2udp_segment_seek(const void *segment, uint64_t timestamp)
+{
+    const can2udp_segment_header_t *header = (const can2udp_segment_header_t *)segment;
+    const uint64_t *index = (const uint64_t *)((const uint8_t *)segment + header->index_offset);
+    uint32_t low = 0, high = header->blocks;
+
+    /* .. binary search of the first block starting after the timestamp */
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (index[middle] <= timestamp)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low ? low - 1 : 0;
+}
+
 #endif    /*  __CAN_2_UDP_H */
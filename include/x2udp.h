@@ -0,0 +1,245 @@
+/*******************************************************************************
+ * x2udp.h
+ *
+ * Receiver library for UDP packets of can2udp and iio2udp.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+#ifndef __X_2_UDP_H
+#define __X_2_UDP_H
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "can2udp.h"
+#include "iio2udp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************
+ * Settings
+ ******************************************************************************/
+
+/* .. default number of datagrams read by one x2udp_receive() call */
+#define X2UDP_DEFAULT_BATCH_SIZE 64
+
+/* .. default maximal size of a datagram, larger ones are counted as truncated */
+#define X2UDP_DEFAULT_MTU 1472
+
+/* .. default number of senders tracked for loss statistics */
+#define X2UDP_DEFAULT_MAX_SOURCES 256
+
+/* .. a version 4 packet behind the sequence is taken for a restart of the sender if it is further
+ *    back than the window, carries sequence number 0 or follows a silence of the sender this long */
+#define X2UDP_SEQUENCE_WINDOW 4096
+#define X2UDP_RESTART_SILENCE_NS 500000000ull
+
+/*******************************************************************************
+ * Type declarations
+ ******************************************************************************/
+
+/* .. protocol of the packets on the port, the versions of both overlap */
+typedef
+enum x2udp_protocol
+{
+    X2UDP_CAN = 0,
+    X2UDP_IIO
+} x2udp_protocol_t;
+
+/* .. settings of a receiver, see x2udp_options_init() for defaults */
+typedef
+struct x2udp_options
+{
+    /* .. kind of packets */
+    x2udp_protocol_t protocol;
+
+    /* .. local IPv4 or IPv6 address, a multicast group is joined. NULL listens on any address */
+    const char *address;
+
+    /* .. UDP port number */
+    int port;
+
+    /* .. network interface to receive on, NULL for any */
+    const char *interface;
+
+    /* .. size of the socket receive buffer, 0 keeps the system default */
+    int receive_buffer;
+
+    /* .. datagrams read at once */
+    unsigned int batch_size;
+
+    /* .. maximal size of a datagram */
+    size_t mtu;
+
+    /* .. senders tracked for loss statistics */
+    unsigned int max_sources;
+} x2udp_options_t;
+
+/* .. counters of one sender. A sender is an address, port and interface or device id */
+typedef
+struct x2udp_source
+{
+    /* .. address of the sender */
+    struct sockaddr_storage address;
+
+    /* .. interface id of can2udp packets, device id of iio2udp packets, in host byte order */
+    uint16_t id;
+
+    /* .. version of the last packet */
+    uint8_t version;
+
+    /* .. packets and frames or samples received */
+    uint64_t packets;
+    uint64_t frames;
+
+    /* .. packets missing in the sequence of version 4 packets */
+    uint64_t lost;
+
+    /* .. version 4 packets received late or twice. Late packets were counted as lost before */
+    uint64_t reordered;
+
+    /* .. the sequence started over, e.g. the sender was restarted */
+    uint64_t restarts;
+
+    /* .. frames the kernel of the sender dropped, reported by version 4 packets */
+    uint32_t kernel_drops;
+
+    /* .. next expected sequence number, valid once a version 4 packet arrived */
+    uint32_t sequence;
+    int sequenced;
+
+    /* .. CLOCK_MONOTONIC time of the last version 4 packet in nanoseconds */
+    uint64_t seen;
+} x2udp_source_t;
+
+/* .. counters of the receiver */
+typedef
+struct x2udp_stats
+{
+    /* .. datagrams read */
+    uint64_t datagrams;
+
+    /* .. datagrams of unknown version or size */
+    uint64_t invalid;
+
+    /* .. datagrams larger than the mtu */
+    uint64_t truncated;
+
+    /* .. datagrams dropped by the local kernel, the socket buffer was full */
+    uint64_t socket_drops;
+
+    /* .. datagrams of senders exceeding max_sources, they are decoded without statistics */
+    uint64_t untracked;
+} x2udp_stats_t;
+
+/* .. frame of a can2udp packet. The payload points into the receive buffer and is valid until the next x2udp_receive() */
+typedef
+struct x2udp_can_frame
+{
+    /* .. sender of the packet, NULL if it is not tracked */
+    const x2udp_source_t *source;
+
+    /* .. timestamp in nanoseconds. Zero if not available */
+    uint64_t timestamp;
+
+    /* .. 32 bit CAN_ID + EFF/RTR/ERR flags */
+    canid_t can_id;
+
+    /* .. payload length in byte */
+    uint8_t len;
+
+    /* .. CAN FD flags, CANFD_FDF is set for CAN FD frames of packets of version 2 and up */
+    uint8_t flags;
+
+    /* .. version and flags of the packet */
+    uint8_t version;
+    uint8_t packet_flags;
+
+    /* .. id of the CAN interface on the sending host */
+    uint16_t interface_id;
+
+    /* .. payload, not aligned */
+    const uint8_t *data;
+} x2udp_can_frame_t;
+
+/* .. sample of an iio2udp packet, it points into the receive buffer and is valid until the next x2udp_receive() */
+typedef
+struct x2udp_iio_sample
+{
+    /* .. sender of the packet, NULL if it is not tracked */
+    const x2udp_source_t *source;
+
+    /* .. short packet, not aligned */
+    const iio2udp_packet_short_t *packet;
+
+    /* .. names of long packets, NULL for short packets */
+    const iio2udp_packet_long_t *details;
+} x2udp_iio_sample_t;
+
+typedef
+struct x2udp_receiver x2udp_receiver_t;
+
+/*******************************************************************************
+ * Functions
+ ******************************************************************************/
+
+/* .. fill the options with defaults for the protocol */
+void x2udp_options_init(x2udp_options_t *options, x2udp_protocol_t protocol);
+
+/* .. open a receiver. Returns NULL and sets errno on failure */
+x2udp_receiver_t *x2udp_receiver_open(const x2udp_options_t *options);
+
+void x2udp_receiver_close(x2udp_receiver_t *rx);
+
+/* .. socket of the receiver for poll() or epoll */
+int x2udp_receiver_fd(const x2udp_receiver_t *rx);
+
+/* .. read a batch of datagrams, waiting at most 'timeout' ms (-1 forever, 0 not at all).
+ *    Returns the number of datagrams, 0 on timeout or -errno. Frames of the previous batch become invalid.
+ */
+int x2udp_receive(x2udp_receiver_t *rx, int timeout);
+
+/* .. next frame of the batch of a X2UDP_CAN receiver. Returns 1 or 0 at the end of the batch */
+int x2udp_next_can(x2udp_receiver_t *rx, x2udp_can_frame_t *frame);
+
+/* .. next sample of the batch of a X2UDP_IIO receiver. Returns 1 or 0 at the end of the batch */
+int x2udp_next_iio(x2udp_receiver_t *rx, x2udp_iio_sample_t *sample);
+
+/* .. counters of the receiver */
+void x2udp_receiver_stats(const x2udp_receiver_t *rx, x2udp_stats_t *stats);
+
+/* .. number of tracked senders and the sender at 'index' */
+unsigned int x2udp_source_count(const x2udp_receiver_t *rx);
+const x2udp_source_t *x2udp_source_get(const x2udp_receiver_t *rx, unsigned int index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif    /*  __X_2_UDP_H */
@@ -27,6 +27,7 @@
 /*
  * Includes
  */
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,16 +35,41 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
 #include <net/if.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_xdp.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 
 #include <libdaemon/daemon.h>
 #include <libconfig.h>
+#ifdef CAN2UDP_IO_URING
+#include <poll.h>
+#include <liburing.h>
+#endif
 
 #include "can2udp.h"
+#include "common.h"
 #include <linux/can.h>
 #include <linux/can/raw.h>
 
@@ -53,425 +79,4686 @@
 
 #define CAN2UDP_DEFAULT_CONFIG_FILENAME "/etc/can2udp"
 
+/* .. maximal number of events handled by one epoll_wait() call */
+#define CAN2UDP_MAX_EVENTS 64
+
+/* .. default and maximal number of frames fetched by one recvmmsg() call */
+#define CAN2UDP_DEFAULT_BATCH_SIZE 16
+#define CAN2UDP_MAX_BATCH_SIZE 1024
+
+/* .. default number of frames of the AF_XDP umem, power of 2 */
+#define CAN2UDP_DEFAULT_XDP_FRAMES 4096
+
+/* .. size of a frame of the AF_XDP umem */
+#define CAN2UDP_XDP_FRAME_SIZE 2048
+
+/* .. size of the fill ring, it is required but never used for transmission */
+#define CAN2UDP_XDP_FILL_SIZE 64
+
+/* .. kicks of a full transmission ring before a packet is dropped */
+#define CAN2UDP_XDP_SEND_RETRIES 8
+
+/* .. link, network and transport headers put in front of packets sent with AF_XDP */
+#define CAN2UDP_XDP_HEADERS (sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr))
+
+/* .. default number of packets sent by one sendmmsg() call */
+#define CAN2UDP_DEFAULT_SEND_BATCH_SIZE 64
+
+/* .. maximal payload of a UDP datagram */
+#define CAN2UDP_MAX_MTU 65507
+
+/* .. default geometry of the memory mapped receive ring */
+#define CAN2UDP_DEFAULT_RING_BLOCK_SIZE (1 << 16)
+#define CAN2UDP_DEFAULT_RING_BLOCKS 16
+#define CAN2UDP_DEFAULT_RING_TIMEOUT 1 /* ms */
+
+/* .. limits of the receive ring geometry */
+#define CAN2UDP_MAX_RING_SIZE (1024 * 1024 * 1024)
+#define CAN2UDP_MAX_RING_TIMEOUT 60000 /* ms */
+
+/* .. default and maximal number of IDs in the snapshot table */
+#define CAN2UDP_DEFAULT_SNAPSHOT_SIZE 4096
+#define CAN2UDP_MAX_SNAPSHOT_SIZE (1024 * 1024)
+
+/* .. default number of extended IDs tracked by send-on-change, power of 2 */
+#define CAN2UDP_DEFAULT_CHANGE_CACHE_SIZE 4096
+
+/* .. filter sets with more kernel rules than this are matched in userspace */
+#define CAN2UDP_DEFAULT_KERNEL_FILTER_LIMIT 32
+
+/* .. default geometry of capture segment files */
+#define CAN2UDP_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define CAN2UDP_DEFAULT_SEGMENTS 8
+#define CAN2UDP_DEFAULT_SEGMENT_BLOCK_SIZE 4096
+
+/* .. the segment header is padded to this, the time index and blocks start page aligned */
+#define CAN2UDP_SEGMENT_ALIGN 4096
+
+/* .. default number of frames in the queue between ingest and egress stages, power of 2 */
+#define CAN2UDP_DEFAULT_QUEUE_DEPTH 4096
+
+/* .. space reserved for control messages of a single received frame: timestamp and drop counter */
+#define CAN2UDP_RX_CONTROL_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/* .. counters written by different threads live on different cache lines */
+#define CAN2UDP_CACHE_LINE 64
+
+/* .. debug messages of the hot path are compiled in only if CAN2UDP_DEBUG_LOG is defined */
+#ifdef CAN2UDP_DEBUG_LOG
+#define debug_log(...) daemon_log(LOG_DEBUG, __VA_ARGS__)
+#else
+#define debug_log(...) do { } while (0)
+#endif
+
+/*
+ * Type declarations
+ */
+
+/* .. source of receive timestamps */
+typedef
+enum timestamp_source
+{
+    /* .. no timestamps */
+    TIMESTAMP_NONE,
+
+    /* .. kernel software timestamps taken on reception */
+    TIMESTAMP_SOFTWARE,
+
+    /* .. raw timestamps of the CAN controller, software ones as fallback */
+    TIMESTAMP_HARDWARE,
+} timestamp_source_t;
+
+/* .. the way frames are received from the CAN interface */
+typedef
+enum channel_backend
+{
+    /* .. CAN_RAW socket read with recvmmsg() */
+    BACKEND_RAW,
+
+    /* .. AF_PACKET socket with memory mapped TPACKET_V3 ring */
+    BACKEND_MMAP,
+} channel_backend_t;
+
+/* .. memory mapped TPACKET_V3 receive ring */
+typedef
+struct rx_ring
+{
+    /* .. size of a block in bytes, multiple of the page size */
+    unsigned int block_size;
+
+    /* .. number of blocks in the ring */
+    unsigned int block_count;
+
+    /* .. time in ms after which a partially filled block is passed to us */
+    unsigned int timeout;
+
+    /* .. mapping of the ring */
+    uint8_t *map;
+
+    /* .. index of the next block to be read */
+    unsigned int block;
+} rx_ring_t;
+
+/* .. preallocated buffers for batched reception with recvmmsg() */
+typedef
+struct rx_batch
+{
+    /* .. number of frames in the batch */
+    unsigned int size;
+
+    /* .. received frames */
+    struct canfd_frame *frames;
+
+    /* .. message headers passed to recvmmsg() */
+    struct mmsghdr *msgs;
+
+    /* .. one io vector per frame */
+    struct iovec *iovs;
+
+    /* .. control message buffers, CAN2UDP_RX_CONTROL_SIZE bytes per frame */
+    uint8_t *controls;
+
+    /* .. source addresses of frames */
+    struct sockaddr_can *names;
+} rx_batch_t;
+
+/* .. producer/consumer ring shared with the kernel */
+typedef
+struct xdp_ring
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+
+    /* .. ring entries */
+    void *descs;
+    uint32_t mask;
+
+    /* .. mapping of the ring */
+    void *map;
+    size_t map_size;
+} xdp_ring_t;
+
+/* .. AF_XDP socket transmitting on a single queue of the interface */
+typedef
+struct xdp_socket
+{
+    int fd;
+
+    /* .. queue of the interface */
+    int queue;
+
+    /* .. frames of packets */
+    uint8_t *umem;
+    size_t umem_size;
+
+    /* .. transmission and completion rings */
+    xdp_ring_t tx;
+    xdp_ring_t cq;
+
+    /* .. addresses of frames owned by userspace */
+    uint64_t *free;
+    uint32_t free_count;
+
+    /* .. source of packets */
+    uint8_t mac[ETH_ALEN];
+    struct in_addr addr;
+    uint16_t port;
+    uint16_t ip_id;
+
+    /* .. per-queue statistics, read by the statistics thread */
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t dropped;
+
+    /* .. failed kicks waiting to be logged */
+    log_limit_t kick_log;
+} xdp_socket_t;
+
+#ifdef CAN2UDP_IO_URING
+/* .. tags of io_uring requests that are not receptions, stored in the low bits of user data */
+#define URING_SLOT_SEND 0xfffe
+#define URING_SLOT_POLL 0xffff
+
+/* .. completions copied off the queue at once */
+#define CAN2UDP_URING_CQE_BATCH 64
+
+/* .. io_uring engine of a worker */
+typedef
+struct uring
+{
+    struct io_uring ring;
+
+    /* .. sends waiting for completion */
+    unsigned int sends;
+
+    /* .. channels receiving through the ring, user data of their requests holds the index */
+    struct channel **channels;
+    unsigned int channels_count;
+
+    /* .. completions of receptions reaped while waiting for sends, pending from head to count.
+     *    One entry for every reception slot and the epoll poll, a request completes once until reposted */
+    struct io_uring_cqe *deferred;
+    unsigned int deferred_head;
+    unsigned int deferred_count;
+    unsigned int deferred_size;
+
+    /* .. the ring is set up */
+    int initialized;
+} uring_t;
+#endif
+
+/* .. kind of a filter rule */
+typedef
+enum filter_type
+{
+    FILTER_MASK = 0,
+    FILTER_RANGE
+} filter_type_t;
+
+/* .. single filter rule. IDs of extended frames carry CAN_EFF_FLAG */
+typedef
+struct id_filter
+{
+    filter_type_t type;
+
+    /* .. ID and mask, or the first ID of the range */
+    canid_t id;
+    canid_t mask;
+
+    /* .. the last ID of the range */
+    canid_t last;
+
+    /* .. the rule rejects matching frames */
+    int invert;
+} id_filter_t;
+
+/* .. filter rules of a channel compiled for fast lookup */
+typedef
+struct id_filter_set
+{
+    /* .. rules as configured */
+    id_filter_t *rules;
+    size_t length;
+
+    /* .. number of rules accepting frames. Without them everything not rejected is accepted */
+    size_t positive;
+
+    /* .. accepted standard IDs */
+    uint64_t sff[(CAN_SFF_MASK + 1) / 64];
+
+    /* .. open addressing hash set of accepted extended IDs, 0 marks an empty slot */
+    canid_t *eff_set;
+    size_t eff_set_mask;
+
+    /* .. extended rules that are not single IDs */
+    id_filter_t **eff_rules;
+    size_t eff_rules_length;
+
+    /* .. extended rules rejecting frames */
+    id_filter_t **eff_inverted;
+    size_t eff_inverted_length;
+
+    /* .. equivalent kernel filters, NULL if the rules cannot be expressed or are too many */
+    struct can_filter *kernel;
+    size_t kernel_length;
+
+    /* .. kernel filters are installed on the socket of the channel */
+    int in_kernel;
+} id_filter_set_t;
+
+/* .. kind of an object watched by epoll, the first member of such objects */
+typedef
+enum event_source
+{
+    SOURCE_CHANNEL = 0,
+    SOURCE_SNAPSHOT,
+    SOURCE_HEARTBEAT,
+    SOURCE_LOG
+} event_source_t;
+
+typedef
+struct channel channel_t;
+
+/* .. the last forwarded payload of a CAN ID */
+typedef
+struct change_entry
+{
+    /* .. payload, zero padded */
+    uint8_t data[CANFD_MAX_DLEN] __attribute__ ((aligned(16)));
+
+    /* .. CLOCK_MONOTONIC time the payload was forwarded in nanoseconds */
+    uint64_t sent;
+
+    /* .. timestamp of the last frame suppressed since then */
+    uint64_t received;
+
+    /* .. normalized ID, 0 for an unused entry of extended IDs */
+    canid_t can_id;
+
+    uint8_t len;
+    uint8_t flags;
+
+    /* .. the entry holds a payload */
+    uint8_t valid;
+
+    /* .. unchanged frames arrived since the payload was forwarded, the heartbeat repeats it */
+    uint8_t pending;
+} change_entry_t;
+
+/* .. payload cache of the send-on-change mode */
+typedef
+struct change_cache
+{
+    /* .. SOURCE_HEARTBEAT */
+    event_source_t source;
+
+    /* .. channel the cache belongs to */
+    channel_t *chc;
+
+    /* .. timer of heartbeats, -1 without them */
+    int timer_fd;
+
+    /* .. entries of standard IDs, indexed by ID */
+    change_entry_t sff[CAN_SFF_MASK + 1];
+
+    /* .. open addressing hash table of extended IDs */
+    change_entry_t *eff;
+    size_t eff_mask;
+    size_t eff_used;
+
+    /* .. repeat unchanged payloads after this time in nanoseconds, 0 never */
+    uint64_t heartbeat;
+
+    /* .. number of frames suppressed */
+    unsigned long suppressed;
+} change_cache_t;
+
+/* .. counters of a channel. Every block has a single writer, the stats server only reads them */
+typedef
+struct channel_stats
+{
+    /* .. written by the thread receiving frames of the channel */
+    struct
+    {
+        /* .. frames passed on by filters */
+        uint64_t frames;
+
+        /* .. frames dropped by userspace filters */
+        uint64_t filtered;
+
+        /* .. frames suppressed by send on change */
+        uint64_t unchanged;
+
+        /* .. frames dropped by the kernel on a full receive queue or packet ring */
+        uint64_t overflows;
+
+        /* .. frames stored in capture segments and frames lost because no segment could be mapped */
+        uint64_t recorded;
+        uint64_t record_drops;
+    } rx __attribute__((aligned(CAN2UDP_CACHE_LINE)));
+
+    /* .. written by the thread building packets of the channel */
+    struct
+    {
+        uint64_t packets;
+        uint64_t bytes;
+    } tx __attribute__((aligned(CAN2UDP_CACHE_LINE)));
+
+} channel_stats_t;
+
+/* .. timer reporting aggregated warnings */
+typedef
+struct log_timer
+{
+    /* .. SOURCE_LOG */
+    event_source_t source;
+
+    int fd;
+} log_timer_t;
+
+/* .. settings of capture recording */
+typedef
+struct recording
+{
+    /* .. directory of segment files, NULL if recording is disabled */
+    const char *path;
+
+    /* .. size of a segment file */
+    long long segment_size;
+
+    /* .. number of segment files of an interface, the oldest one is overwritten */
+    int segments;
+
+    /* .. size of a block of the segment, one entry of the time index is kept per block */
+    int block_size;
+} recording_t;
+
+/* .. thread preparing capture segments ahead of rotation and unmapping full ones */
+typedef
+struct recorder_stage
+{
+    /* .. wakes the thread up to prepare segments or to stop */
+    int wake_fd;
+
+    /* .. the thread, valid if running is set */
+    pthread_t thread;
+    int running;
+
+    /* .. request to stop the thread */
+    int quit;
+
+    /* .. configuration of the daemon */
+    struct deamon_config *config;
+} recorder_stage_t;
+
+/* .. writer of memory mapped capture segments of a channel */
+typedef
+struct recorder
+{
+    /* .. settings */
+    const recording_t *settings;
+
+    /* .. interface the frames come from */
+    const char *interface_name;
+    uint16_t interface_id;
+
+    /* .. number of the current segment */
+    uint64_t sequence;
+
+    /* .. the mapped segment, NULL if none */
+    uint8_t *map;
+    can2udp_segment_header_t *header;
+    uint64_t *index;
+
+    /* .. block being filled and the number of bytes used in it */
+    can2udp_packet_ver3_t *block;
+    size_t used;
+
+    /* .. the next segment, mapped by the recorder thread and taken by the rotation */
+    uint8_t *spare;
+
+    /* .. number of the segment prepared next, used by the recorder thread only */
+    uint64_t spare_sequence;
+
+    /* .. full segment left by the rotation for the recorder thread to unmap */
+    uint8_t *retired;
+
+    /* .. thread preparing segments */
+    recorder_stage_t *stage;
+
+    /* .. CLOCK_MONOTONIC time in ns the recorder thread may be woken up again without a spare segment */
+    uint64_t retry;
+
+    /* .. failures waiting to be logged */
+    log_limit_t log;
+} recorder_t;
+
+/* .. the latest frame of a CAN ID */
+typedef
+struct snapshot_entry
+{
+    struct canfd_frame frame;
+
+    /* .. timestamp in nanoseconds */
+    uint64_t timestamp;
+} snapshot_entry_t;
+
+/* .. slot of the hash table of extended IDs */
+typedef
+struct snapshot_slot
+{
+    /* .. normalized ID, 0 for an unused slot */
+    canid_t can_id;
+
+    /* .. index of the entry */
+    uint32_t index;
+} snapshot_slot_t;
+
+/* .. table of the latest frames published periodically */
+typedef
+struct snapshot
+{
+    /* .. SOURCE_SNAPSHOT */
+    event_source_t source;
+
+    /* .. channel the table belongs to */
+    channel_t *chc;
+
+    /* .. timer of publishing */
+    int timer_fd;
+
+    /* .. entries in order of the first reception, published densely */
+    snapshot_entry_t *entries;
+    uint32_t size;
+    uint32_t count;
+
+    /* .. index plus one of the entry of standard IDs, 0 if there is none */
+    uint32_t sff[CAN_SFF_MASK + 1];
+
+    /* .. hash table of extended IDs */
+    snapshot_slot_t *eff;
+    size_t eff_mask;
+
+    /* .. number of frames that did not fit in the table */
+    unsigned long overflows;
+} snapshot_t;
+
+/* .. frame passed from the ingest stage to the egress stage */
+typedef
+struct queued_frame
+{
+    /* .. channel the frame was received on */
+    channel_t *chc;
+
+    /* .. timestamp in nanoseconds */
+    uint64_t timestamp;
+
+    /* .. the frame */
+    struct canfd_frame frame;
+} queued_frame_t;
+
+/* .. bounded lock-free single-producer/single-consumer queue of frames */
+typedef
+struct frame_queue
+{
+    /* .. next entry to be written, owned by the producer */
+    unsigned int head __attribute__ ((aligned(64)));
+
+    /* .. number of frames dropped because the queue was full, owned by the producer */
+    uint64_t drops;
+
+    /* .. next entry to be read, owned by the consumer */
+    unsigned int tail __attribute__ ((aligned(64)));
+
+    /* .. number of entries minus one */
+    unsigned int mask __attribute__ ((aligned(64)));
+
+    /* .. storage of entries */
+    queued_frame_t *entries;
+} frame_queue_t;
+
+typedef
+struct deamon_config daemon_config_t;
+
+typedef
+struct worker worker_t;
+
+/* .. thread running its own event loop for a group of channels */
+struct worker
+{
+    /* .. id of the worker from the config, negative for workers created automatically */
+    int id;
+
+    /* .. CPU the thread is pinned to, -1 if not pinned */
+    int cpu;
+
+    /* .. SCHED_FIFO priority of the thread, 0 keeps the default scheduling */
+    int priority;
+
+    /* .. number of channels served by the worker */
+    int channels;
+
+    /* .. epoll instance watching channels of the worker */
+    int epoll_fd;
+
+    /* .. eventfd used to stop the thread */
+    int stop_fd;
+
+    /* .. packets waiting for transmission */
+    egress_t egress;
+
+    /* .. frames passed to the egress stage */
+    frame_queue_t queue;
+
+    /* .. the thread, valid if running is set */
+    pthread_t thread;
+    int running;
+
+    /* .. request to stop the egress stage */
+    int quit;
+
+#ifdef CAN2UDP_IO_URING
+    /* .. io_uring engine, used if io_uring is set in the config */
+    uring_t uring;
+#endif
+
+    /* .. configuration of the daemon */
+    daemon_config_t *config;
+
+    /* .. pointer to the next element in the list */
+    worker_t *next;
+};
+
+struct channel
+{
+    /* .. SOURCE_CHANNEL */
+    event_source_t source;
+
+    /* .. SocketCAN interface name */
+    const char *interface_name;
+
+    /* .. device index for UDP */
+    int udp_interface_index;
+
+    /* .. bit mask of destinations the channel is sent to */
+    uint32_t destinations;
+
+    /* .. index of the CAN network interface */
+    int ifindex;
+
+    /* .. socket for CAN */
+    int raw_socket;
+
+    /* .. the socket receives frames of all interfaces in the list */
+    int shared;
+
+    /* .. runtime counters */
+    channel_stats_t stats;
+
+    /* .. receive errors waiting to be logged */
+    log_limit_t rx_log;
+
+    /* .. filter rules, NULL if all frames are accepted */
+    id_filter_set_t *filters;
+
+    /*.. interface supports CAN FD */
+    int can_fd_enabled;
+
+    /* .. maximal number of frames read at once */
+    int batch_size;
+
+    /* .. where receive timestamps come from */
+    timestamp_source_t timestamp_source;
+
+    /* .. version of UDP packets produced for the channel */
+    int packet_version;
+
+    /* .. maximal size of an aggregated packet */
+    int mtu;
+
+    /* .. use compact records in version 3 packets */
+    int compact;
+
+    /* .. forward frames only when their payload changes */
+    int on_change;
+
+    /* .. heartbeat interval of the send-on-change mode in milliseconds */
+    int heartbeat;
+
+    /* .. number of extended IDs tracked by send-on-change */
+    int change_cache_size;
+
+    /* .. payloads of the send-on-change mode */
+    change_cache_t *changes;
+
+    /* .. publishing interval of the latest frames in milliseconds, 0 forwards every frame */
+    int snapshot_interval;
+
+    /* .. maximal number of IDs in the snapshot */
+    int snapshot_size;
+
+    /* .. the latest frames */
+    snapshot_t *snapshot;
+
+    /* .. store received frames in capture segments */
+    int record;
+
+    /* .. capture segments, NULL if not recorded */
+    recorder_t *recorder;
+
+    /* .. version 3 packet being filled with frames */
+    uint8_t *aggregate;
+
+    /* .. number of bytes used in the aggregated packet, zero if it is empty */
+    size_t aggregate_length;
+
+    /* .. sequence number of the next version 4 packet */
+    uint32_t sequence;
+
+    /* .. kernel drops reported by the previous version 4 packet */
+    uint32_t drops_reported;
+
+    /* .. reception backend */
+    channel_backend_t backend;
+
+    /* .. reception buffers */
+    rx_batch_t rx;
+
+#ifdef CAN2UDP_IO_URING
+    /* .. index of the channel in the table of the ring */
+    unsigned int uring_index;
+#endif
+
+    /* .. receive ring of the mmap backend */
+    rx_ring_t ring;
+
+    /* .. id of the worker from the config, -1 for a dedicated worker */
+    int worker_id;
+
+    /* .. worker serving the channel */
+    worker_t *worker;
+
+    /* .. queue packets of the channel are sent from */
+    egress_t *egress;
+
+    /* .. pointer to the next element in the list */
+    channel_t *next;
+};
+
+struct deamon_config
+{
+    /* .. Single linked list of channels */
+    channel_t *channels;
+
+    /* .. UDP port number we transmit to */
+    int port;
+
+    /* .. network interface to bind UDP socket to */
+    const char *interface;
+
+    /* .. UDP destinations of all channels */
+    destination_t destinations[X2UDP_MAX_DESTINATIONS];
+    int destinations_count;
+
+    /* .. destinations of channels without their own list */
+    uint32_t default_destinations;
+
+    /* .. use UDP generic segmentation offload if the kernel supports it */
+    int gso;
+
+    /* .. send through AF_XDP sockets on the interface */
+    int xdp;
+
+    /* .. first queue of the interface used by AF_XDP sockets */
+    int xdp_queue;
+
+    /* .. number of frames of every AF_XDP socket */
+    int xdp_frames;
+
+    /* .. require zero-copy mode instead of the generic copy mode */
+    int xdp_zerocopy;
+
+    /* .. maximal number of packets sent at once */
+    int send_batch_size;
+
+    /* .. default version of UDP packets */
+    int packet_version;
+
+    /* .. maximal size of an aggregated packet */
+    int mtu;
+
+    /* .. the main thread serving channels without worker threads and signals */
+    worker_t main_worker;
+
+    /* .. serve channels in worker threads */
+    int threaded;
+
+    /* .. single linked list of worker threads */
+    worker_t *workers;
+
+    /* .. send packets from a separate egress thread fed through frame queues */
+    int egress_thread;
+
+    /* .. number of frames in each queue */
+    int queue_depth;
+
+    /* .. thread of the egress stage */
+    worker_t egress_worker;
+
+    /* .. the egress thread waits for frames */
+    int egress_sleeping;
+
+    /* .. use edge-triggered notifications and drain channels completely */
+    int edge_triggered;
+
+    /* .. low-latency operating profile */
+    latency_t latency;
+
+    /* .. statistics socket */
+    stats_server_t stats;
+
+    /* .. timer reporting aggregated warnings */
+    log_timer_t log_timer;
+
+    /* .. capture recording of channels */
+    recording_t recording;
+
+    /* .. thread preparing capture segments */
+    recorder_stage_t recorder_stage;
+
+    /* .. receive frames of all interfaces with a single socket */
+    int shared_socket;
+
+    /* .. maximal number of kernel filter rules of a socket */
+    int kernel_filter_limit;
+
+    /* .. use io_uring for CAN reads and UDP sends */
+    int io_uring;
+
+    /* .. channel of the shared socket */
+    channel_t shared;
+
+    /* .. channels by index of their CAN interface, used with the shared socket */
+    channel_t **ifindex_map;
+
+    /* .. number of elements in ifindex_map */
+    int ifindex_map_size;
+};
+
+/*******************************************************************************
+ * Parsing of config file.
+ * See default cofnfig for file format.
+ ******************************************************************************/
+
+/* .. read a filter rule: a single ID or a group with id/mask or from/to, optionally extended and inverted */
+int parse_filter_rule(const config_setting_t *element, id_filter_t *rule)
+{
+    int id, mask, from, to, extended = 0, invert = 0;
+
+    if (config_setting_is_number(element))
+    {
+        id = config_setting_get_int(element);
+        rule->type = FILTER_MASK;
+        rule->id = id;
+        rule->mask = id > CAN_SFF_MASK ? CAN_EFF_MASK : CAN_SFF_MASK;
+    }
+    else if (config_setting_is_group(element))
+    {
+        config_setting_lookup_bool(element, "extended", &extended);
+        config_setting_lookup_bool(element, "invert", &invert);
+
+        if (config_setting_lookup_int(element, "id", &id))
+        {
+            extended |= id > CAN_SFF_MASK;
+            if (!config_setting_lookup_int(element, "mask", &mask))
+                mask = CAN_EFF_MASK;
+
+            rule->type = FILTER_MASK;
+            rule->id = id;
+            rule->mask = mask;
+        }
+        else if (config_setting_lookup_int(element, "from", &from) &&
+                 config_setting_lookup_int(element, "to", &to) && from <= to)
+        {
+            extended |= to > CAN_SFF_MASK;
+
+            rule->type = FILTER_RANGE;
+            rule->id = from;
+            rule->last = to;
+        }
+        else
+            return -1;
+
+        rule->invert = invert;
+        if (extended)
+            rule->id |= CAN_EFF_FLAG;
+    }
+    else
+        return -1;
+
+    /* .. standard and extended frames never match each other */
+    if (rule->id & CAN_EFF_FLAG || rule->id > CAN_SFF_MASK)
+    {
+        rule->id = (rule->id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+        rule->last = (rule->last & CAN_EFF_MASK) | CAN_EFF_FLAG;
+        rule->mask = (rule->mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    }
+    else
+    {
+        rule->last &= CAN_SFF_MASK;
+        rule->mask = (rule->mask & CAN_SFF_MASK) | CAN_EFF_FLAG;
+    }
+
+    return 0;
+}
+
+int
+parse_config(daemon_config_t *config, const char *config_file_name)
+{
+    config_t cf;
+    int i, j;
+
+    /* .. set default values for parameters */
+    config->channels = NULL;
+    config->port = CAN2UDP_DEFAULT_PORT;
+    config->interface = NULL;
+    config->send_batch_size = CAN2UDP_DEFAULT_SEND_BATCH_SIZE;
+    memset(&config->main_worker, 0, sizeof(config->main_worker));
+    config->main_worker.cpu = -1;
+    config->main_worker.epoll_fd = -1;
+    config->threaded = 0;
+    config->workers = NULL;
+    config->egress_thread = 0;
+    config->queue_depth = CAN2UDP_DEFAULT_QUEUE_DEPTH;
+    memset(&config->egress_worker, 0, sizeof(config->egress_worker));
+    config->egress_worker.cpu = -1;
+    config->egress_worker.epoll_fd = -1;
+    config->egress_worker.stop_fd = -1;
+    config->egress_sleeping = 0;
+    config->edge_triggered = 0;
+    memset(&config->latency, 0, sizeof(config->latency));
+    memset(&config->stats, 0, sizeof(config->stats));
+    config->stats.fd = -1;
+    config->stats.stop_fd = -1;
+    config->log_timer.source = SOURCE_LOG;
+    config->log_timer.fd = -1;
+    memset(&config->recording, 0, sizeof(config->recording));
+    config->recording.segment_size = CAN2UDP_DEFAULT_SEGMENT_SIZE;
+    config->recording.segments = CAN2UDP_DEFAULT_SEGMENTS;
+    config->recording.block_size = CAN2UDP_DEFAULT_SEGMENT_BLOCK_SIZE;
+    memset(&config->recorder_stage, 0, sizeof(config->recorder_stage));
+    config->recorder_stage.wake_fd = -1;
+    config->gso = 0;
+    config->xdp = 0;
+    config->xdp_queue = 0;
+    config->xdp_frames = CAN2UDP_DEFAULT_XDP_FRAMES;
+    config->xdp_zerocopy = 0;
+    config->shared_socket = 0;
+    config->kernel_filter_limit = CAN2UDP_DEFAULT_KERNEL_FILTER_LIMIT;
+    config->io_uring = 0;
+    memset(&config->shared, 0, sizeof(config->shared));
+    config->ifindex_map = NULL;
+    config->ifindex_map_size = 0;
+    config->packet_version = CAN2UDP_PACKET_VERSION;
+    config->mtu = CAN2UDP_DEFAULT_MTU;
+
+    config_init(&cf);
+
+    /* set default name if none is provided */
+    if (!config_file_name)
+        config_file_name = CAN2UDP_DEFAULT_CONFIG_FILENAME;
+
+    /* .. try reading config file */
+    if (config_read_file(&cf, config_file_name) != CONFIG_TRUE)
+    {
+        daemon_log(LOG_ERR, "Error parsing config file '%s' %s:%d - %s\n",
+                   config_file_name,
+                   config_error_file(&cf),
+                   config_error_line(&cf),
+                   config_error_text(&cf));
+
+        /* .. release and exit  */
+        config_destroy(&cf);
+        return -1;
+    }
+
+    config_lookup_int(&cf, "port", &config->port);
+    config_lookup_int(&cf, "send_batch_size", &config->send_batch_size);
+    config_lookup_bool(&cf, "edge_triggered", &config->edge_triggered);
+    config_lookup_bool(&cf, "gso", &config->gso);
+
+    if (config_lookup_string(&cf, "stats_socket", &config->stats.path))
+        config->stats.path = strdup(config->stats.path);
+    config_lookup_bool(&cf, "xdp", &config->xdp);
+    config_lookup_int(&cf, "xdp_queue", &config->xdp_queue);
+    config_lookup_int(&cf, "xdp_frames", &config->xdp_frames);
+    config_lookup_bool(&cf, "xdp_zerocopy", &config->xdp_zerocopy);
+
+    if (config->xdp_frames < 2 || (config->xdp_frames & (config->xdp_frames - 1)))
+    {
+        daemon_log(LOG_WARNING, "Number of AF_XDP frames %d is not a power of 2. Using %d.", config->xdp_frames, CAN2UDP_DEFAULT_XDP_FRAMES);
+        config->xdp_frames = CAN2UDP_DEFAULT_XDP_FRAMES;
+    }
+    config_lookup_bool(&cf, "shared_socket", &config->shared_socket);
+    config_lookup_int(&cf, "kernel_filter_limit", &config->kernel_filter_limit);
+
+    const char *io_engine = NULL;
+    if (config_lookup_string(&cf, "io_engine", &io_engine))
+    {
+        if (!strcmp(io_engine, "io_uring"))
+        {
+#ifdef CAN2UDP_IO_URING
+            config->io_uring = 1;
+#else
+            daemon_log(LOG_WARNING, "can2udp is built without io_uring support. Using epoll.");
+#endif
+        }
+        else if (strcmp(io_engine, "epoll"))
+            daemon_log(LOG_WARNING, "Unknown I/O engine '%s'. Using epoll.", io_engine);
+    }
+    config_lookup_bool(&cf, "threaded", &config->threaded);
+    config_lookup_bool(&cf, "egress_thread", &config->egress_thread);
+    config_lookup_int(&cf, "queue_depth", &config->queue_depth);
+    config_lookup_int(&cf, "egress_cpu", &config->egress_worker.cpu);
+    config_lookup_int(&cf, "egress_priority", &config->egress_worker.priority);
+
+    /* .. the latency profile is enabled by its group unless it says otherwise */
+    config_setting_t *latency = config_lookup(&cf, "latency");
+    parse_latency(latency, &config->latency);
+
+    /* .. io_uring workers sleep in the ring until a completion arrives */
+    if (config->io_uring && config->latency.busy_wait)
+    {
+        daemon_log(LOG_WARNING, "busy_wait is not supported with io_uring. Ignoring it.");
+        config->latency.busy_wait = 0;
+    }
+
+    /* .. the main event loop */
+    if (config->latency.enabled)
+    {
+        config_setting_lookup_int(latency, "cpu", &config->main_worker.cpu);
+        config_setting_lookup_int(latency, "priority", &config->main_worker.priority);
+    }
+
+    /* .. capture recording is enabled by its group */
+    config_setting_t *recording = config_lookup(&cf, "recording");
+    if (recording && config_setting_is_group(recording) &&
+        config_setting_lookup_string(recording, "path", &config->recording.path))
+    {
+        config->recording.path = strdup(config->recording.path);
+        config_setting_lookup_int64(recording, "segment_size", &config->recording.segment_size);
+        config_setting_lookup_int(recording, "segments", &config->recording.segments);
+        config_setting_lookup_int(recording, "block_size", &config->recording.block_size);
+
+        /* .. a block holds at least one record of every size, the record count is 16 bit */
+        if (config->recording.block_size < (int)(sizeof(can2udp_packet_ver3_t) + can2udp_compact_record_size(CANFD_MAX_DLEN)) ||
+            config->recording.block_size > 65536)
+        {
+            daemon_log(LOG_WARNING, "Invalid block size %d of capture segments. Using %d.",
+                       config->recording.block_size, CAN2UDP_DEFAULT_SEGMENT_BLOCK_SIZE);
+            config->recording.block_size = CAN2UDP_DEFAULT_SEGMENT_BLOCK_SIZE;
+        }
+
+        if (config->recording.segment_size < 2 * CAN2UDP_SEGMENT_ALIGN + 2 * config->recording.block_size)
+        {
+            daemon_log(LOG_WARNING, "Capture segment size %lld is too small. Using %d.",
+                       config->recording.segment_size, CAN2UDP_DEFAULT_SEGMENT_SIZE);
+            config->recording.segment_size = CAN2UDP_DEFAULT_SEGMENT_SIZE;
+        }
+
+        /* .. the next segment is prepared while the current one is written */
+        if (config->recording.segments < 2)
+        {
+            daemon_log(LOG_WARNING, "At least 2 capture segments are needed, got %d. Using 2.", config->recording.segments);
+            config->recording.segments = 2;
+        }
+    }
+
+    /* .. the depth of frame queues must be a power of 2 */
+    if (config->queue_depth < 2 || (config->queue_depth & (config->queue_depth - 1)))
+    {
+        daemon_log(LOG_WARNING, "Queue depth %d is not a power of 2. Using %d.", config->queue_depth, CAN2UDP_DEFAULT_QUEUE_DEPTH);
+        config->queue_depth = CAN2UDP_DEFAULT_QUEUE_DEPTH;
+    }
+
+    /* .. try getting settings of worker threads */
+    const config_setting_t *workers = config_lookup(&cf, "workers");
+    if (workers)
+    {
+        int count = config_setting_length(workers);
+
+        for (i = 0; i < count; i++)
+        {
+            config_setting_t *setting = config_setting_get_elem(workers, i);
+            worker_t *worker = calloc(1, sizeof(*worker));
+
+            if (!worker)
+            {
+                daemon_log(LOG_ERR, "Out of memory");
+
+                config_destroy(&cf);
+                return -1;
+            }
+
+            /* .. set default values */
+            worker->id = i;
+            worker->cpu = -1;
+            worker->epoll_fd = -1;
+            worker->stop_fd = -1;
+            worker->config = config;
+
+            config_setting_lookup_int(setting, "id", &worker->id);
+            config_setting_lookup_int(setting, "cpu", &worker->cpu);
+            config_setting_lookup_int(setting, "priority", &worker->priority);
+
+            worker->next = config->workers;
+            config->workers = worker;
+        }
+    }
+    if (config->send_batch_size < 1)
+        config->send_batch_size = 1;
+    config_lookup_int(&cf, "packet_version", &config->packet_version);
+    config_lookup_int(&cf, "mtu", &config->mtu);
+
+    /* .. an aggregated packet must hold at least one record and fit into a UDP datagram */
+    if (config->mtu < (int)(sizeof(can2udp_packet_ver4_t) + sizeof(can2udp_record_t)))
+        config->mtu = sizeof(can2udp_packet_ver4_t) + sizeof(can2udp_record_t);
+    else if (config->mtu > CAN2UDP_MAX_MTU)
+        config->mtu = CAN2UDP_MAX_MTU;
+
+    config_lookup_string(&cf, "interface", &config->interface);
+    if (config->interface)
+        config->interface = strdup(config->interface);
+
+    /* .. packets are broadcast on the port unless destinations are listed */
+    config->destinations_count = 0;
+    if (!(config->default_destinations = parse_destinations(config_lookup(&cf, "destinations"), config->destinations,
+                                                            &config->destinations_count, config->port, config->interface)))
+    {
+        destination_broadcast(&config->destinations[config->destinations_count], config->port, config->interface);
+        config->default_destinations = 1u << config->destinations_count++;
+    }
+
+    /* .. try getting channel configurations */
+    const config_setting_t *channels  = config_lookup(&cf, "interfaces");
+    if (channels)
+    {
+        int count = config_setting_length(channels);
+        channel_t *chc = NULL;
+
+        for (i = 0; i < count; i++)
+        {
+            if (chc)
+            {
+                /* .. allocate memory for new element and jump to it */
+                chc->next = aligned_alloc(CAN2UDP_CACHE_LINE, sizeof(*chc));
+                chc = chc->next;
+            }
+            else
+            {
+                /* .. allocate memory for the first element and store it */
+                chc = aligned_alloc(CAN2UDP_CACHE_LINE, sizeof(*chc));
+                config->channels = chc;
+            }
+
+            if (!chc)
+            {
+                daemon_log(LOG_ERR, "Out of memory");
+
+                config_destroy(&cf);
+                return -1;
+            }
+
+            /* .. parse config for the channel */
+            config_setting_t *channel = config_setting_get_elem (channels, i);
+            if (channel)
+            {
+                /* .. set default values */
+                chc->next = NULL;
+                chc->interface_name = "vcan0";
+                chc->udp_interface_index = i;
+                chc->source = SOURCE_CHANNEL;
+                chc->ifindex = 0;
+                chc->raw_socket = 0;
+                chc->shared = 0;
+                memset(&chc->stats, 0, sizeof(chc->stats));
+                memset(&chc->rx_log, 0, sizeof(chc->rx_log));
+                chc->filters = NULL;
+                chc->can_fd_enabled = 1;
+                chc->batch_size = CAN2UDP_DEFAULT_BATCH_SIZE;
+                chc->timestamp_source = TIMESTAMP_SOFTWARE;
+                chc->packet_version = config->packet_version;
+                chc->mtu = config->mtu;
+                chc->compact = 0;
+                chc->on_change = 0;
+                chc->heartbeat = 0;
+                chc->change_cache_size = CAN2UDP_DEFAULT_CHANGE_CACHE_SIZE;
+                chc->changes = NULL;
+                chc->snapshot_interval = 0;
+                chc->snapshot_size = CAN2UDP_DEFAULT_SNAPSHOT_SIZE;
+                chc->snapshot = NULL;
+                chc->record = config->recording.path != NULL;
+                chc->recorder = NULL;
+                chc->aggregate = NULL;
+                chc->aggregate_length = 0;
+                chc->sequence = 0;
+                chc->drops_reported = 0;
+                chc->backend = BACKEND_RAW;
+                chc->worker_id = -1;
+                chc->worker = NULL;
+                chc->egress = NULL;
+                memset(&chc->rx, 0, sizeof(chc->rx));
+                memset(&chc->ring, 0, sizeof(chc->ring));
+                chc->ring.block_size = CAN2UDP_DEFAULT_RING_BLOCK_SIZE;
+                chc->ring.block_count = CAN2UDP_DEFAULT_RING_BLOCKS;
+                chc->ring.timeout = CAN2UDP_DEFAULT_RING_TIMEOUT;
+
+                /* .. try reading channel settings
+                 *    We copy strings here because they get destroyed together with cf,
+                 *    and we don't really hold the reference to cf any longer.
+                 */
+                config_setting_lookup_string(channel, "name", &chc->interface_name);
+                chc->interface_name = strdup(chc->interface_name);
+                log_limit_init(&chc->rx_log, "receive errors", chc->interface_name);
+                config_setting_lookup_int(channel, "interface_index", &chc->udp_interface_index);
+                if (!(chc->destinations = parse_destinations(config_setting_get_member(channel, "destinations"), config->destinations,
+                                                             &config->destinations_count, config->port, config->interface)))
+                    chc->destinations = config->default_destinations;
+                config_lookup_bool(&cf, "can_fd", &chc->can_fd_enabled);
+                config_setting_lookup_int(channel, "batch_size", &chc->batch_size);
+                config_setting_lookup_int(channel, "packet_version", &chc->packet_version);
+                config_setting_lookup_bool(channel, "compact", &chc->compact);
+                config_setting_lookup_bool(channel, "on_change", &chc->on_change);
+                config_setting_lookup_int(channel, "heartbeat", &chc->heartbeat);
+                if (chc->heartbeat < 0)
+                {
+                    daemon_log(LOG_WARNING, "Invalid heartbeat %d ms of '%s'. Heartbeats are disabled.", chc->heartbeat, chc->interface_name);
+                    chc->heartbeat = 0;
+                }
+                config_setting_lookup_int(channel, "change_cache_size", &chc->change_cache_size);
+                config_setting_lookup_int(channel, "snapshot", &chc->snapshot_interval);
+                config_setting_lookup_int(channel, "snapshot_size", &chc->snapshot_size);
+                if (config->recording.path)
+                    config_setting_lookup_bool(channel, "record", &chc->record);
+
+                if (chc->change_cache_size < 1 || (chc->change_cache_size & (chc->change_cache_size - 1)))
+                {
+                    daemon_log(LOG_WARNING, "Change cache size %d of '%s' is not a power of 2. Using %d.",
+                               chc->change_cache_size, chc->interface_name, CAN2UDP_DEFAULT_CHANGE_CACHE_SIZE);
+                    chc->change_cache_size = CAN2UDP_DEFAULT_CHANGE_CACHE_SIZE;
+                }
+                config_setting_lookup_int(channel, "worker", &chc->worker_id);
+
+                if (chc->packet_version < CAN2UDP_PACKET_VERSION_1 || chc->packet_version > CAN2UDP_PACKET_VERSION_4)
+                {
+                    daemon_log(LOG_WARNING, "Unsupported packet version %d for '%s'. Using version %d.",
+                               chc->packet_version, chc->interface_name, CAN2UDP_PACKET_VERSION);
+                    chc->packet_version = CAN2UDP_PACKET_VERSION;
+                }
+
+                /* .. snapshots are packed into as few datagrams as possible */
+                if (chc->snapshot_interval > 0)
+                {
+                    if (chc->snapshot_size < 1 || chc->snapshot_size > CAN2UDP_MAX_SNAPSHOT_SIZE)
+                    {
+                        daemon_log(LOG_WARNING, "Snapshot size %d of '%s' is out of range 1..%d. Using %d.",
+                                   chc->snapshot_size, chc->interface_name, CAN2UDP_MAX_SNAPSHOT_SIZE, CAN2UDP_DEFAULT_SNAPSHOT_SIZE);
+                        chc->snapshot_size = CAN2UDP_DEFAULT_SNAPSHOT_SIZE;
+                    }
+
+                    if (chc->packet_version < CAN2UDP_PACKET_VERSION_3 || !chc->compact)
+                        daemon_log(LOG_INFO, "Snapshots of '%s' are sent as compact version %d packets.", chc->interface_name,
+                                   chc->packet_version < CAN2UDP_PACKET_VERSION_3 ? CAN2UDP_PACKET_VERSION_3 : chc->packet_version);
+                    if (chc->packet_version < CAN2UDP_PACKET_VERSION_3)
+                        chc->packet_version = CAN2UDP_PACKET_VERSION_3;
+                    chc->compact = 1;
+                }
+
+                /* .. keep the batch size in sane limits */
+                if (chc->batch_size < 1)
+                    chc->batch_size = 1;
+                else if (chc->batch_size > CAN2UDP_MAX_BATCH_SIZE)
+                    chc->batch_size = CAN2UDP_MAX_BATCH_SIZE;
+
+                /* .. select the reception backend */
+                const char *backend = NULL;
+                config_setting_lookup_string(channel, "backend", &backend);
+                if (backend)
+                {
+                    if (!strcmp(backend, "raw"))
+                        chc->backend = BACKEND_RAW;
+                    else if (!strcmp(backend, "mmap"))
+                        chc->backend = BACKEND_MMAP;
+                    else
+                        daemon_log(LOG_WARNING, "Unknown backend '%s' for '%s'. Using raw socket.", backend, chc->interface_name);
+                }
+
+                /* .. blocks are whole pages holding at least one frame */
+                int ring_block_size = chc->ring.block_size, ring_blocks = chc->ring.block_count, ring_timeout = chc->ring.timeout;
+                long page = sysconf(_SC_PAGESIZE);
+                config_setting_lookup_int(channel, "ring_block_size", &ring_block_size);
+                config_setting_lookup_int(channel, "ring_blocks", &ring_blocks);
+                config_setting_lookup_int(channel, "ring_timeout", &ring_timeout);
+                if (ring_block_size < (int)TPACKET_ALIGN(TPACKET3_HDRLEN + CANFD_MTU) || ring_block_size % page ||
+                    ring_blocks < 1 || (long long)ring_block_size * ring_blocks > CAN2UDP_MAX_RING_SIZE)
+                    daemon_log(LOG_WARNING, "Invalid receive ring of %d x %d bytes for '%s'. Blocks must be multiples of %ld bytes, "
+                               "the ring at most %d bytes. Using %d x %d bytes.", ring_blocks, ring_block_size, chc->interface_name,
+                               page, CAN2UDP_MAX_RING_SIZE, chc->ring.block_count, chc->ring.block_size);
+                else
+                {
+                    chc->ring.block_size = ring_block_size;
+                    chc->ring.block_count = ring_blocks;
+                }
+                if (ring_timeout < 0 || ring_timeout > CAN2UDP_MAX_RING_TIMEOUT)
+                    daemon_log(LOG_WARNING, "Invalid receive ring timeout %d ms for '%s'. Using %u ms.",
+                               ring_timeout, chc->interface_name, chc->ring.timeout);
+                else
+                    chc->ring.timeout = ring_timeout;
+
+                /* .. select the source of timestamps */
+                const char *timestamp = NULL;
+                config_setting_lookup_string(channel, "timestamp", &timestamp);
+                if (timestamp)
+                {
+                    if (!strcmp(timestamp, "none"))
+                        chc->timestamp_source = TIMESTAMP_NONE;
+                    else if (!strcmp(timestamp, "software"))
+                        chc->timestamp_source = TIMESTAMP_SOFTWARE;
+                    else if (!strcmp(timestamp, "hardware"))
+                        chc->timestamp_source = TIMESTAMP_HARDWARE;
+                    else
+                        daemon_log(LOG_WARNING, "Unknown timestamp source '%s' for '%s'. Using software timestamps.", timestamp, chc->interface_name);
+                }
+
+                /* .. try parsing message filter */
+                config_setting_t *filter = config_setting_get_member(channel, "filter");
+                if (filter)
+                {
+                    /* .. ignore invalid lengths */
+                    ssize_t len = config_setting_length(filter);
+                    if (len > 0)
+                    {
+                        /* .. allocate memory */
+                        chc->filters = calloc(1, sizeof(*chc->filters));
+                        if (chc->filters)
+                            chc->filters->rules = calloc(len, sizeof(*chc->filters->rules));
+
+                        if (!chc->filters || !chc->filters->rules)
+                        {
+                            daemon_log(LOG_ERR, "Out of memory");
+
+                            config_destroy(&cf);
+                            return -1;
+                        }
+
+                        /* .. read all elements of the filter */
+                        for (j = 0; j < len; j ++)
+                        {
+                            config_setting_t *element =  config_setting_get_elem(filter, j);
+                            if (element && parse_filter_rule(element, &chc->filters->rules[chc->filters->length]) == 0)
+                                chc->filters->length++;
+                            else
+                                daemon_log(LOG_WARNING, "Ignoring invalid filter rule %d of '%s'.", j, chc->interface_name);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* .. AF_XDP builds IPv4 frames only, link layer addresses of unicast destinations come from /proc/net/arp */
+    if (config->xdp)
+    {
+        int d;
+
+        for (d = 0; d < config->destinations_count; d++)
+        {
+            const destination_t *dest = &config->destinations[d];
+            const struct sockaddr_in *sin = (const struct sockaddr_in *)&dest->addr;
+
+            if (dest->addr.ss_family != AF_INET)
+                daemon_log(LOG_WARNING, "AF_XDP supports IPv4 destinations only. Destination %d is sent through its UDP socket.", d);
+            else if (!dest->mac_set && sin->sin_addr.s_addr != htonl(INADDR_BROADCAST) && !IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+                daemon_log(LOG_INFO, "Destination %d has no mac set. Its address must be in the IPv4 neighbour table "
+                           "(/proc/net/arp) when sockets are set up, or it is sent through its UDP socket.", d);
+        }
+    }
+
+    /* .. release */
+    config_destroy(&cf);
+
+    return 0;
+}
+
+/*
+ * Batched reception
+ */
+
+uint64_t timespec_to_ns(struct timespec ts)
+{
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int rx_batch_init(rx_batch_t *rx, unsigned int size)
+{
+    unsigned int i;
+
+    rx->size = size;
+    rx->frames = calloc(size, sizeof(*rx->frames));
+    rx->msgs = calloc(size, sizeof(*rx->msgs));
+    rx->iovs = calloc(size, sizeof(*rx->iovs));
+    rx->controls = calloc(size, CAN2UDP_RX_CONTROL_SIZE);
+    rx->names = calloc(size, sizeof(*rx->names));
+
+    if (!rx->frames || !rx->msgs || !rx->iovs || !rx->controls || !rx->names)
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    /* .. link every message header to its frame and control buffer */
+    for (i = 0; i < size; i++)
+    {
+        rx->iovs[i].iov_base = &rx->frames[i];
+        rx->iovs[i].iov_len = sizeof(rx->frames[i]);
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        rx->msgs[i].msg_hdr.msg_control = rx->controls + i * CAN2UDP_RX_CONTROL_SIZE;
+        rx->msgs[i].msg_hdr.msg_controllen = CAN2UDP_RX_CONTROL_SIZE;
+        rx->msgs[i].msg_hdr.msg_name = &rx->names[i];
+        rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+    }
+
+    return 0;
+}
+
+/* .. receive up to rx->size frames without blocking. Returns the number of frames or -errno */
+int rx_batch_receive(rx_batch_t *rx, int fd)
+{
+    unsigned int i;
+    int n;
+
+    /* .. the kernel overwrites lengths of control buffers, restore them */
+    for (i = 0; i < rx->size; i++)
+    {
+        rx->msgs[i].msg_hdr.msg_controllen = CAN2UDP_RX_CONTROL_SIZE;
+        rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+        rx->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    if ((n = recvmmsg(fd, rx->msgs, rx->size, MSG_DONTWAIT, NULL)) < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+
+    return n;
+}
+
+/* .. update the kernel drop counter from the i-th frame. It is cumulative, so the last frame of a batch is enough */
+void rx_batch_overflows(rx_batch_t *rx, unsigned int i, uint64_t *overflows)
+{
+    struct msghdr *msg = &rx->msgs[i].msg_hdr;
+    struct cmsghdr *cmsg;
+    uint32_t drops;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            __atomic_store_n(overflows, drops, __ATOMIC_RELAXED);
+            return;
+        }
+}
+
+/* .. extract receive timestamp of the i-th frame in nanoseconds and the CAN2UDP_SEGMENT_CLOCK_* it comes from.
+ *    Zero and CAN2UDP_SEGMENT_CLOCK_UNKNOWN if not available */
+uint64_t rx_batch_timestamp(rx_batch_t *rx, unsigned int i, uint8_t *stamp_clock)
+{
+    struct msghdr *msg = &rx->msgs[i].msg_hdr;
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *stamp_clock = CAN2UDP_SEGMENT_CLOCK_REALTIME;
+            return timespec_to_ns(ts);
+        }
+        else if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            /* .. ts[0] is the software timestamp, ts[2] is the raw hardware one */
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            if (tss.ts[2].tv_sec || tss.ts[2].tv_nsec)
+            {
+                *stamp_clock = CAN2UDP_SEGMENT_CLOCK_HARDWARE;
+                return timespec_to_ns(tss.ts[2]);
+            }
+            if (tss.ts[0].tv_sec || tss.ts[0].tv_nsec)
+            {
+                *stamp_clock = CAN2UDP_SEGMENT_CLOCK_REALTIME;
+                return timespec_to_ns(tss.ts[0]);
+            }
+        }
+    }
+
+    *stamp_clock = CAN2UDP_SEGMENT_CLOCK_UNKNOWN;
+    return 0;
+}
+
+void rx_batch_free(rx_batch_t *rx)
+{
+    free(rx->frames);
+    free(rx->msgs);
+    free(rx->iovs);
+    free(rx->controls);
+    free(rx->names);
+    memset(rx, 0, sizeof(*rx));
+}
+
+/*
+ * AF_XDP transmission
+ */
+
+/* .. map a ring of the socket */
+int xdp_ring_map(int fd, const struct xdp_ring_offset *off, uint32_t entries, size_t entry_size, off_t pgoff, xdp_ring_t *ring)
+{
+    ring->map_size = off->desc + entries * entry_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        return -1;
+    }
+
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    ring->mask = entries - 1;
+
+    return 0;
+}
+
+/* .. read link and network addresses of the interface */
+int xdp_interface_addresses(const char *interface, uint8_t *mac, struct in_addr *addr, struct in_addr *broadcast)
+{
+    struct ifreq ifr;
+    int fd, ret = 0;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name) - 1);
+
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+        ret = -1;
+    else
+        memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    if (ret == 0 && ioctl(fd, SIOCGIFADDR, &ifr) < 0)
+        ret = -1;
+    else if (ret == 0)
+        *addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+
+    /* .. point-to-point links have no broadcast address */
+    broadcast->s_addr = htonl(INADDR_BROADCAST);
+    if (ret == 0 && ioctl(fd, SIOCGIFBRDADDR, &ifr) == 0)
+        *broadcast = ((struct sockaddr_in *)&ifr.ifr_broadaddr)->sin_addr;
+
+    close(fd);
+
+    return ret;
+}
+
+int xdp_open(xdp_socket_t *xsk, const char *interface, int queue, unsigned int frames, int zerocopy, int port)
+{
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    unsigned int fill_size = CAN2UDP_XDP_FILL_SIZE, i;
+    struct in_addr broadcast;
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->queue = queue;
+    xsk->port = port;
+
+    if ((xsk->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating AF_XDP socket. %m");
+        return -1;
+    }
+
+    if (xdp_interface_addresses(interface, xsk->mac, &xsk->addr, &broadcast) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot read addresses of '%s'. %m", interface);
+        return -1;
+    }
+
+    /* .. register memory of frames */
+    xsk->umem_size = (size_t)frames * CAN2UDP_XDP_FRAME_SIZE;
+    xsk->umem = mmap(NULL, xsk->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED)
+    {
+        xsk->umem = NULL;
+        daemon_log(LOG_ERR, "Error allocating AF_XDP frames. %m");
+        return -1;
+    }
+
+    struct xdp_umem_reg reg = {
+        .addr = (uintptr_t)xsk->umem,
+        .len = xsk->umem_size,
+        .chunk_size = CAN2UDP_XDP_FRAME_SIZE,
+        .headroom = 0,
+    };
+
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &frames, sizeof(frames)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &frames, sizeof(frames)) < 0 ||
+        getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+    {
+        daemon_log(LOG_ERR, "Error setting up AF_XDP rings. %m");
+        return -1;
+    }
+
+    if (xdp_ring_map(xsk->fd, &off.tx, frames, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING, &xsk->tx) < 0 ||
+        xdp_ring_map(xsk->fd, &off.cr, frames, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, &xsk->cq) < 0)
+    {
+        daemon_log(LOG_ERR, "Error mapping AF_XDP rings. %m");
+        return -1;
+    }
+
+    /* .. the generic copy mode works with any driver, veth included */
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_flags = zerocopy ? XDP_ZEROCOPY : XDP_COPY,
+        .sxdp_ifindex = if_nametoindex(interface),
+        .sxdp_queue_id = queue,
+    };
+
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot bind AF_XDP socket to queue %d of '%s'. %m", queue, interface);
+        return -1;
+    }
+
+    /* .. all frames are free */
+    if (!(xsk->free = malloc(sizeof(*xsk->free) * frames)))
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    for (i = 0; i < frames; i++)
+        xsk->free[i] = (uint64_t)i * CAN2UDP_XDP_FRAME_SIZE;
+    xsk->free_count = frames;
+    log_limit_init(&xsk->kick_log, "failed kicks of AF_XDP queue", NULL);
+
+    daemon_log(LOG_INFO, "Sending through AF_XDP on queue %d of '%s' in %s mode.", queue, interface, zerocopy ? "zero-copy" : "copy");
+
+    return 0;
+}
+
+void xdp_close(xdp_socket_t *xsk)
+{
+    struct xdp_statistics stats;
+    socklen_t optlen = sizeof(stats);
+
+    if (xsk->fd > 0)
+    {
+        daemon_log(LOG_INFO, "AF_XDP queue %d: %llu packets submitted, %llu completed, %llu dropped.",
+                   xsk->queue, (unsigned long long)xsk->submitted, (unsigned long long)xsk->completed,
+                   (unsigned long long)xsk->dropped);
+
+        if (getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &stats, &optlen) == 0 && stats.tx_invalid_descs)
+            daemon_log(LOG_WARNING, "AF_XDP queue %d: %llu invalid descriptors.", xsk->queue, (unsigned long long)stats.tx_invalid_descs);
+
+        close(xsk->fd);
+    }
+    xsk->fd = -1;
+
+    if (xsk->tx.map)
+        munmap(xsk->tx.map, xsk->tx.map_size);
+    if (xsk->cq.map)
+        munmap(xsk->cq.map, xsk->cq.map_size);
+    if (xsk->umem)
+        munmap(xsk->umem, xsk->umem_size);
+    free(xsk->free);
+    log_limit_free(&xsk->kick_log);
+
+    memset(xsk, 0, sizeof(*xsk));
+}
+
+/* .. return frames the kernel has sent. Returns their number */
+unsigned int xdp_reap(xdp_socket_t *xsk)
+{
+    uint32_t producer = __atomic_load_n(xsk->cq.producer, __ATOMIC_ACQUIRE);
+    uint32_t consumer = *xsk->cq.consumer;
+    uint64_t *addrs = xsk->cq.descs;
+    unsigned int count = producer - consumer;
+
+    for (; consumer != producer; consumer++)
+        xsk->free[xsk->free_count++] = addrs[consumer & xsk->cq.mask];
+
+    __atomic_store_n(xsk->cq.consumer, consumer, __ATOMIC_RELEASE);
+    stats_add(&xsk->completed, count);
+
+    return count;
+}
+
+/* .. publish descriptors up to the producer and kick the kernel, the copy mode needs it for every batch */
+static inline void xdp_kick(xdp_socket_t *xsk, uint32_t producer)
+{
+    __atomic_store_n(xsk->tx.producer, producer, __ATOMIC_RELEASE);
+    if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN)
+        log_limit_count(&xsk->kick_log, errno);
+}
+
+/* .. Internet checksum helpers, data are summed as big endian words */
+static inline uint32_t xdp_csum_add(uint32_t sum, const void *data, size_t length)
+{
+    const uint8_t *p = data;
+
+    for (; length > 1; p += 2, length -= 2)
+        sum += (uint32_t)p[0] << 8 | p[1];
+    if (length)
+        sum += (uint32_t)p[0] << 8;
+
+    return sum;
+}
+
+static inline uint16_t xdp_csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return htons(~sum & 0xffff);
+}
+
+/* .. build Ethernet, IPv4 and UDP headers around payloads and pass them to the kernel */
+void xdp_send(xdp_socket_t *xsk, const destination_t *dest, const struct iovec *iov, unsigned int count)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)&dest->addr;
+    struct xdp_desc *descs = xsk->tx.descs;
+    uint32_t producer = *xsk->tx.producer;
+    unsigned int i, retry;
+
+    for (i = 0; i < count; i++)
+    {
+        size_t length = CAN2UDP_XDP_HEADERS + iov[i].iov_len;
+
+        if (length > CAN2UDP_XDP_FRAME_SIZE)
+        {
+            stats_add(&xsk->dropped, 1);
+            continue;
+        }
+
+        /* .. take frames back from the kernel only when running out of them */
+        if (!xsk->free_count)
+            xdp_reap(xsk);
+
+        /* .. the ring is full or all frames are in flight, let the kernel send what is queued */
+        for (retry = 0; retry < CAN2UDP_XDP_SEND_RETRIES &&
+             (!xsk->free_count || producer - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) > xsk->tx.mask); retry++)
+        {
+            xdp_kick(xsk, producer);
+            xdp_reap(xsk);
+        }
+
+        if (!xsk->free_count || producer - __atomic_load_n(xsk->tx.consumer, __ATOMIC_ACQUIRE) > xsk->tx.mask)
+        {
+            stats_add(&xsk->dropped, 1);
+            continue;
+        }
+
+        uint64_t addr = xsk->free[--xsk->free_count];
+        uint8_t *frame = xsk->umem + addr;
+        struct ethhdr *eth = (struct ethhdr *)frame;
+        struct iphdr *ip = (struct iphdr *)(eth + 1);
+        struct udphdr *udp = (struct udphdr *)(ip + 1);
+
+        memcpy(eth->h_dest, dest->mac, ETH_ALEN);
+        memcpy(eth->h_source, xsk->mac, ETH_ALEN);
+        eth->h_proto = htons(ETH_P_IP);
+
+        ip->version = 4;
+        ip->ihl = sizeof(*ip) / 4;
+        ip->tos = 0;
+        ip->tot_len = htons(length - sizeof(*eth));
+        ip->id = htons(xsk->ip_id++);
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = dest->ttl >= 0 ? dest->ttl : IN_MULTICAST(ntohl(sin->sin_addr.s_addr)) ? 1 : 64;
+        ip->protocol = IPPROTO_UDP;
+        ip->check = 0;
+        ip->saddr = xsk->addr.s_addr;
+        ip->daddr = sin->sin_addr.s_addr;
+        ip->check = xdp_csum_fold(xdp_csum_add(0, ip, sizeof(*ip)));
+
+        udp->source = htons(xsk->port);
+        udp->dest = sin->sin_port;
+        udp->len = htons(sizeof(*udp) + iov[i].iov_len);
+        udp->check = 0;
+        memcpy(udp + 1, iov[i].iov_base, iov[i].iov_len);
+
+        /* .. checksum over the pseudo header, the UDP header and the payload */
+        uint32_t sum = xdp_csum_add(0, &ip->saddr, 2 * sizeof(ip->saddr));
+        sum += IPPROTO_UDP + sizeof(*udp) + iov[i].iov_len;
+        sum = xdp_csum_add(sum, udp, sizeof(*udp) + iov[i].iov_len);
+        udp->check = xdp_csum_fold(sum);
+        if (!udp->check)
+            udp->check = 0xffff;
+
+        descs[producer & xsk->tx.mask].addr = addr;
+        descs[producer & xsk->tx.mask].len = length;
+        descs[producer & xsk->tx.mask].options = 0;
+        producer++;
+        stats_add(&xsk->submitted, 1);
+    }
+
+    xdp_kick(xsk, producer);
+    xdp_reap(xsk);
+}
+
+/* .. find the link layer address packets to the destination are sent to */
+int xdp_resolve(destination_t *dest, const char *interface)
+{
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)&dest->addr;
+    uint32_t addr = ntohl(sin->sin_addr.s_addr);
+    uint8_t mac[ETH_ALEN];
+    struct in_addr local, broadcast;
+    char line[256], ip[64], hw[32], dev[IFNAMSIZ + 1], wanted[INET_ADDRSTRLEN];
+    unsigned int type, flags;
+    FILE *arp;
+
+    if (dest->mac_set)
+        return 0;
+
+    if (xdp_interface_addresses(interface, mac, &local, &broadcast) < 0)
+        return -1;
+
+    /* .. broadcast and multicast addresses map to link layer ones */
+    if (addr == INADDR_BROADCAST || sin->sin_addr.s_addr == broadcast.s_addr)
+    {
+        memset(dest->mac, 0xff, ETH_ALEN);
+        return 0;
+    }
+
+    if (IN_MULTICAST(addr))
+    {
+        uint8_t group[ETH_ALEN] = { 0x01, 0x00, 0x5e, (addr >> 16) & 0x7f, (addr >> 8) & 0xff, addr & 0xff };
+        memcpy(dest->mac, group, ETH_ALEN);
+        return 0;
+    }
+
+    /* .. unicast addresses must be in the neighbour table */
+    if (!(arp = fopen("/proc/net/arp", "r")))
+        return -1;
+
+    inet_ntop(AF_INET, &sin->sin_addr, wanted, sizeof(wanted));
+    while (fgets(line, sizeof(line), arp))
+        if (sscanf(line, "%63s %x %x %31s %*s %16s", ip, &type, &flags, hw, dev) == 5 &&
+            !strcmp(ip, wanted) && !strcmp(dev, interface) && (flags & 0x2) &&
+            sscanf(hw, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &dest->mac[0], &dest->mac[1], &dest->mac[2],
+                   &dest->mac[3], &dest->mac[4], &dest->mac[5]) == ETH_ALEN)
+        {
+            fclose(arp);
+            return 0;
+        }
+
+    fclose(arp);
+
+    return -1;
+}
+
+/*
+ * Egress queue
+ */
+
+/* .. send queued packets through the AF_XDP socket of the queue, destinations without link layer address through the UDP stack */
+int egress_flush_xdp(egress_t *eg)
+{
+    unsigned int d, n;
+
+    for (d = 0; d < eg->destinations_count; d++)
+    {
+        destination_t *dest = &eg->destinations[d];
+
+        if (!(n = egress_gather(eg, d)))
+            continue;
+
+        /* .. bypass the UDP stack */
+        if (dest->xdp)
+            xdp_send(eg->backend, dest, eg->gather, n);
+        else
+            egress_send_gathered(eg, dest, n);
+    }
+
+    eg->count = 0;
+
+    return 0;
+}
+
+/* .. release the queue together with its flush backend */
+void egress_close(egress_t *eg)
+{
+    if (eg->flush == egress_flush_xdp)
+    {
+        xdp_close(eg->backend);
+        free(eg->backend);
+    }
+
+    egress_free(eg);
+}
+
+/*
+ * Frame queue
+ */
+
+int frame_queue_init(frame_queue_t *queue, unsigned int depth)
+{
+    queue->head = 0;
+    queue->tail = 0;
+    queue->drops = 0;
+    queue->mask = depth - 1;
+
+    if (!(queue->entries = calloc(depth, sizeof(*queue->entries))))
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* .. add the frame to the queue. Called by the producer only, never blocks */
+int frame_queue_push(frame_queue_t *queue, channel_t *chc, const struct canfd_frame *frame, uint64_t timestamp)
+{
+    unsigned int head = queue->head;
+
+    /* .. drop the frame if the consumer is too slow */
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) > queue->mask)
+    {
+        stats_add(&queue->drops, 1);
+        return -ENOBUFS;
+    }
+
+    queued_frame_t *entry = &queue->entries[head & queue->mask];
+    entry->chc = chc;
+    entry->timestamp = timestamp;
+    memcpy(&entry->frame, frame, sizeof(*frame));
+
+    /* .. publish the entry */
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* .. check if there is anything to read. Called by the consumer */
+int frame_queue_pending(frame_queue_t *queue)
+{
+    return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) != queue->tail;
+}
+
+void frame_queue_free(frame_queue_t *queue)
+{
+    free(queue->entries);
+    queue->entries = NULL;
+}
+
+/*
+ * Capture recording
+ */
+
+/* .. number of the segment following the newest one of the interface in the directory */
+uint64_t recorder_next_sequence(recorder_t *rec)
+{
+    const recording_t *settings = rec->settings;
+    uint64_t next = 0;
+    char name[PATH_MAX];
+    int slot;
+
+    for (slot = 0; slot < settings->segments; slot++)
+    {
+        can2udp_segment_header_t header;
+        int fd;
+
+        snprintf(name, sizeof(name), "%s/%s.%d.seg", settings->path, rec->interface_name, slot);
+        if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+            continue;
+
+        if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            !memcmp(header.magic, CAN2UDP_SEGMENT_MAGIC, sizeof(header.magic)) &&
+            header.sequence >= next)
+            next = header.sequence + 1;
+
+        close(fd);
+    }
+
+    return next;
+}
+
+/* .. create and map the segment file of the sequence number. Returns the mapping or NULL */
+uint8_t *recorder_map(recorder_t *rec, uint64_t sequence)
+{
+    const recording_t *settings = rec->settings;
+    size_t size = settings->segment_size;
+    can2udp_segment_header_t *header;
+    uint32_t block_count;
+    size_t index_size;
+    char name[PATH_MAX];
+    uint8_t *map;
+    int fd, err;
+
+    snprintf(name, sizeof(name), "%s/%s.%d.seg", settings->path, rec->interface_name,
+             (int)(sequence % settings->segments));
+
+    if ((fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+    {
+        log_limit_count(&rec->log, errno);
+        return NULL;
+    }
+
+    /* .. allocate all blocks now, stores to the mapping must not fail on a full disk */
+    if (ftruncate(fd, size) < 0 || (errno = posix_fallocate(fd, 0, size)) != 0)
+    {
+        err = errno;
+        close(fd);
+        log_limit_count(&rec->log, err);
+        return NULL;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        log_limit_count(&rec->log, err);
+        return NULL;
+    }
+
+    /* .. split the file into header, time index and blocks */
+    block_count = (size - CAN2UDP_SEGMENT_ALIGN) / (settings->block_size + sizeof(uint64_t));
+    for (;;)
+    {
+        index_size = ((size_t)block_count * sizeof(uint64_t) + CAN2UDP_SEGMENT_ALIGN - 1) & ~(size_t)(CAN2UDP_SEGMENT_ALIGN - 1);
+        if (CAN2UDP_SEGMENT_ALIGN + index_size + (size_t)block_count * settings->block_size <= size)
+            break;
+        block_count--;
+    }
+
+    header = (can2udp_segment_header_t *)map;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CAN2UDP_SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = CAN2UDP_SEGMENT_VERSION;
+    header->block_size = settings->block_size;
+    header->sequence = sequence;
+    header->size = size;
+    header->index_offset = CAN2UDP_SEGMENT_ALIGN;
+    header->data_offset = CAN2UDP_SEGMENT_ALIGN + index_size;
+    header->block_count = block_count;
+    header->interface_id = rec->interface_id;
+    strncpy(header->interface_name, rec->interface_name, sizeof(header->interface_name) - 1);
+
+    return map;
+}
+
+/* .. mark the segment closed and release its mapping */
+void recorder_unmap(recorder_t *rec, uint8_t *map)
+{
+    if (!map)
+        return;
+
+    ((can2udp_segment_header_t *)map)->closed = 1;
+    munmap(map, rec->settings->segment_size);
+}
+
+/* .. make the mapped segment the current one */
+static inline void recorder_use(recorder_t *rec, uint8_t *map)
+{
+    rec->map = map;
+    rec->header = (can2udp_segment_header_t *)map;
+    rec->index = (uint64_t *)(map + rec->header->index_offset);
+    rec->sequence = rec->header->sequence;
+    rec->block = NULL;
+    rec->used = rec->settings->block_size;
+}
+
+/* .. unmap the retired segment and prepare the next one. Called by the recorder thread */
+void recorder_prepare(recorder_t *rec)
+{
+    uint8_t *map;
+
+    recorder_unmap(rec, __atomic_exchange_n(&rec->retired, NULL, __ATOMIC_ACQUIRE));
+
+    if (__atomic_load_n(&rec->spare, __ATOMIC_ACQUIRE))
+        return;
+
+    if (!(map = recorder_map(rec, rec->spare_sequence)))
+        return;
+
+    rec->spare_sequence++;
+    __atomic_store_n(&rec->spare, map, __ATOMIC_RELEASE);
+}
+
+/* .. let the recorder thread prepare segments */
+static inline void recorder_wake(recorder_t *rec)
+{
+    uint64_t one = 1;
+
+    if (write(rec->stage->wake_fd, &one, sizeof(one)) != sizeof(one))
+        log_limit_count(&rec->log, errno);
+}
+
+/* .. time of the frame in the clock of the segment, never before the previous frame of the segment.
+ *    'stamp_clock' says where the timestamp came from */
+static inline uint64_t recorder_clock(recorder_t *rec, uint64_t timestamp, uint8_t stamp_clock)
+{
+    can2udp_segment_header_t *header = rec->header;
+    struct timespec ts;
+
+    if (header->clock == CAN2UDP_SEGMENT_CLOCK_HARDWARE)
+    {
+        /* .. no other clock is comparable, a frame without a hardware stamp keeps the time of the previous one */
+        if (stamp_clock != CAN2UDP_SEGMENT_CLOCK_HARDWARE)
+            timestamp = header->last_timestamp;
+    }
+    else if (stamp_clock != CAN2UDP_SEGMENT_CLOCK_REALTIME)
+    {
+        /* .. software stamps are system time, so is the fallback */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timestamp = timespec_to_ns(ts);
+    }
+
+    return timestamp < header->last_timestamp ? header->last_timestamp : timestamp;
+}
+
+/* .. start a block with the frame, rotating to the prepared segment if the current one is full.
+ *    The timestamp is converted to the clock of the segment */
+int recorder_next_block(recorder_t *rec, uint64_t *timestamp, uint8_t stamp_clock)
+{
+    can2udp_segment_header_t *header = rec->header;
+    struct timespec ts;
+    uint8_t *spare;
+
+    if (header->blocks == header->block_count)
+    {
+        /* .. wake the thread up once in a while until it manages to prepare the segment */
+        if (!(spare = __atomic_exchange_n(&rec->spare, NULL, __ATOMIC_ACQUIRE)))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            if (timespec_to_ns(ts) >= rec->retry)
+            {
+                rec->retry = timespec_to_ns(ts) + X2UDP_LOG_INTERVAL_NS;
+                recorder_wake(rec);
+            }
+            return -EAGAIN;
+        }
+
+        /* .. the thread unmapped the previous full segment before it prepared the spare one */
+        header->closed = 1;
+        __atomic_store_n(&rec->retired, rec->map, __ATOMIC_RELEASE);
+        recorder_use(rec, spare);
+        recorder_wake(rec);
+        rec->retry = 0;
+        header = rec->header;
+    }
+
+    /* .. the first frame selects the clock of the segment */
+    if (!header->blocks)
+        header->clock = stamp_clock == CAN2UDP_SEGMENT_CLOCK_HARDWARE ? CAN2UDP_SEGMENT_CLOCK_HARDWARE : CAN2UDP_SEGMENT_CLOCK_REALTIME;
+    *timestamp = recorder_clock(rec, *timestamp, stamp_clock);
+
+    rec->block = (can2udp_packet_ver3_t *)(rec->map + header->data_offset + (size_t)header->blocks * header->block_size);
+    rec->block->version = CAN2UDP_PACKET_VERSION_3;
+    rec->block->flags = CAN2UDP_COMPACT;
+    rec->block->interface_id = rec->interface_id;
+    rec->block->count = 0;
+    rec->block->reserved = 0;
+    rec->used = sizeof(*rec->block);
+
+    rec->index[header->blocks] = *timestamp;
+    if (!header->blocks)
+        header->first_timestamp = *timestamp;
+
+    /* .. readers of a growing segment see the block before it is counted */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->blocks++;
+
+    return 0;
+}
+
+/* .. append the frame to the current block, the hot path is a few stores to the mapping */
+static inline int recorder_store(recorder_t *rec, const struct canfd_frame *frame, uint64_t timestamp, uint8_t stamp_clock)
+{
+    size_t size = can2udp_compact_record_size(frame->len);
+
+    if (__builtin_expect(rec->used + size > rec->settings->block_size, 0))
+    {
+        if (recorder_next_block(rec, &timestamp, stamp_clock) < 0)
+            return -EAGAIN;
+    }
+    else
+        timestamp = recorder_clock(rec, timestamp, stamp_clock);
+
+    can2udp_compact_record_encode((uint8_t *)rec->block + rec->used, frame, timestamp);
+    rec->used += size;
+
+    /* .. readers of a growing segment see the record before it is counted */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->block->count++;
+    rec->header->frames++;
+    rec->header->last_timestamp = timestamp;
+
+    return 0;
+}
+
+int recorder_init(recorder_t **recorder, const recording_t *settings, recorder_stage_t *stage, channel_t *chc)
+{
+    recorder_t *rec;
+    uint8_t *map;
+
+    if (!(rec = calloc(1, sizeof(*rec))))
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    rec->settings = settings;
+    rec->stage = stage;
+    rec->interface_name = chc->interface_name;
+    rec->interface_id = chc->udp_interface_index;
+
+    /* .. continue the numbering of a previous run, the oldest segment is overwritten first */
+    if (!(map = recorder_map(rec, recorder_next_sequence(rec))))
+    {
+        daemon_log(LOG_WARNING, "Cannot create capture segment of '%s' in '%s': %s",
+                   chc->interface_name, settings->path, strerror(rec->log.error));
+        free(rec);
+        return -1;
+    }
+    recorder_use(rec, map);
+    log_limit_init(&rec->log, "capture segment failures", rec->interface_name);
+
+    /* .. the first rotation finds the next segment ready, the thread prepares the following ones */
+    rec->spare_sequence = rec->sequence + 1;
+    recorder_prepare(rec);
+
+    daemon_log(LOG_INFO, "Recording '%s' to %d segments of %lld bytes in '%s', starting with segment %llu.",
+               chc->interface_name, settings->segments, settings->segment_size, settings->path,
+               (unsigned long long)rec->sequence);
+
+    *recorder = rec;
+
+    return 0;
+}
+
+/* .. the recorder thread must be stopped. An unused spare segment is left empty and closed */
+void recorder_free(recorder_t *rec)
+{
+    if (!rec)
+        return;
+
+    recorder_unmap(rec, rec->map);
+    recorder_unmap(rec, rec->spare);
+    recorder_unmap(rec, rec->retired);
+    log_limit_free(&rec->log);
+    free(rec);
+}
+
+void *recorder_stage_run(void *arg)
+{
+    recorder_stage_t *stage = arg;
+    uint64_t events;
+    channel_t *chc;
+
+    while (!__atomic_load_n(&stage->quit, __ATOMIC_ACQUIRE))
+    {
+        if (read(stage->wake_fd, &events, sizeof(events)) < 0 && errno != EINTR)
+        {
+            daemon_log(LOG_ERR, "Error waiting for requests in the recorder thread. %m");
+            break;
+        }
+
+        for (chc = stage->config->channels; chc; chc = chc->next)
+            if (chc->recorder)
+                recorder_prepare(chc->recorder);
+    }
+
+    return NULL;
+}
+
+/* .. start the thread preparing capture segments, recorders are set up already */
+int recorder_stage_init(daemon_config_t *config)
+{
+    recorder_stage_t *stage = &config->recorder_stage;
+    int err;
+
+    stage->config = config;
+    if ((stage->wake_fd = eventfd(0, 0)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating wakeup event of the recorder thread. %m");
+        return -1;
+    }
+
+    if ((err = thread_create(&stage->thread, recorder_stage_run, stage)) != 0)
+    {
+        daemon_log(LOG_ERR, "Error starting the recorder thread: %s", strerror(err));
+        return -1;
+    }
+    stage->running = 1;
+
+    return 0;
+}
+
+void recorder_stage_close(daemon_config_t *config)
+{
+    recorder_stage_t *stage = &config->recorder_stage;
+    uint64_t one = 1;
+
+    if (stage->running)
+    {
+        __atomic_store_n(&stage->quit, 1, __ATOMIC_RELEASE);
+        if (write(stage->wake_fd, &one, sizeof(one)) != sizeof(one))
+            daemon_log(LOG_WARNING, "Error stopping the recorder thread. %m");
+
+        pthread_join(stage->thread, NULL);
+        stage->running = 0;
+    }
+
+    if (stage->wake_fd >= 0)
+        close(stage->wake_fd);
+    stage->wake_fd = -1;
+}
+
+/*
+ * SocketCAN channel handling
+ */
+
+/* .. ask the driver to timestamp received frames. Many CAN drivers do it unconditionally */
+void hwtstamp_enable(int fd, const char *interface_name)
+{
+    struct hwtstamp_config hwconfig = {
+        .tx_type = HWTSTAMP_TX_OFF,
+        .rx_filter = HWTSTAMP_FILTER_ALL,
+    };
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface_name, sizeof(ifr.ifr_name) - 1);
+    ifr.ifr_data = (void *)&hwconfig;
+
+    if (ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0)
+        daemon_log(LOG_DEBUG, "Cannot configure hardware timestamping for '%s': %m", interface_name);
+}
+
+/* .. report frames dropped by the kernel with every received frame */
+void channel_enable_overflows(channel_t *chc)
+{
+    const int yes = 1;
+
+    if (setsockopt(chc->raw_socket, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof(yes)) < 0)
+        daemon_log(LOG_WARNING, "Error enabling drop counter for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+}
+
+/* .. request timestamps as control messages of every received frame */
+int channel_enable_timestamps(channel_t *chc)
+{
+    const int yes = 1;
+
+    switch (chc->timestamp_source)
+    {
+    case TIMESTAMP_NONE:
+        return 0;
+
+    case TIMESTAMP_SOFTWARE:
+        if (setsockopt(chc->raw_socket, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) < 0)
+        {
+            daemon_log(LOG_WARNING, "Error enabling timestamps for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+            return -1;
+        }
+        return 0;
+
+    case TIMESTAMP_HARDWARE:
+    {
+        int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+        if (setsockopt(chc->raw_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        {
+            daemon_log(LOG_WARNING, "Error enabling hardware timestamps for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+            return -1;
+        }
+        return 0;
+    }
+    }
+
+    return 0;
+}
+
+/*
+ * Send on change
+ */
+
+/* .. payloads are compared 16 bytes at a time */
+typedef uint8_t change_vector_t __attribute__ ((vector_size(16)));
+
+/* .. loading at tail_mask + 16 - n gives a vector keeping the first n bytes */
+static const uint8_t change_tail_mask[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+int change_cache_init(change_cache_t **cache, channel_t *chc, unsigned int eff_size, unsigned int heartbeat_ms)
+{
+    change_cache_t *c;
+
+    if (!(c = calloc(1, sizeof(*c))) || !(c->eff = calloc(eff_size, sizeof(*c->eff))))
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        free(c);
+        return -1;
+    }
+
+    c->source = SOURCE_HEARTBEAT;
+    c->chc = chc;
+    c->timer_fd = -1;
+    c->eff_mask = eff_size - 1;
+    c->heartbeat = heartbeat_ms * 1000000ull;
+    *cache = c;
+
+    if (!heartbeat_ms)
+        return 0;
+
+    /* .. heartbeats do not wait for frames. The timer runs at a quarter of the interval to keep them close to it */
+    unsigned int period_ms = heartbeat_ms >= 4 ? heartbeat_ms / 4 : 1;
+    struct itimerspec period = {
+        .it_interval = { .tv_sec = period_ms / 1000, .tv_nsec = (period_ms % 1000) * 1000000l },
+        .it_value = { .tv_sec = period_ms / 1000, .tv_nsec = (period_ms % 1000) * 1000000l },
+    };
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = c,
+    };
+
+    if ((c->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0 ||
+        timerfd_settime(c->timer_fd, 0, &period, NULL) < 0 ||
+        epoll_ctl(chc->worker->epoll_fd, EPOLL_CTL_ADD, c->timer_fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot start heartbeat timer for '%s': %m", chc->interface_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+void change_cache_free(change_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    if (cache->timer_fd >= 0)
+    {
+        epoll_ctl(cache->chc->worker->epoll_fd, EPOLL_CTL_DEL, cache->timer_fd, NULL);
+        close(cache->timer_fd);
+    }
+
+    free(cache->eff);
+    free(cache);
+}
+
+/* .. entry of the ID, NULL if the table of extended IDs is full */
+static inline change_entry_t *change_cache_lookup(change_cache_t *cache, canid_t can_id)
+{
+    if (!(can_id & CAN_EFF_FLAG))
+        return &cache->sff[can_id & CAN_SFF_MASK];
+
+    can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+
+    size_t slot = (can_id * 0x9E3779B1u) & cache->eff_mask;
+    for (; cache->eff[slot].can_id; slot = (slot + 1) & cache->eff_mask)
+        if (cache->eff[slot].can_id == can_id)
+            return &cache->eff[slot];
+
+    /* .. keep a free slot so that lookups terminate */
+    if (cache->eff_used >= cache->eff_mask)
+        return NULL;
+
+    cache->eff_used++;
+    cache->eff[slot].can_id = can_id;
+
+    return &cache->eff[slot];
+}
+
+/* .. compare the used part of the payload */
+static inline int change_payload_differs(const uint8_t *cached, const uint8_t *data, unsigned int len)
+{
+    change_vector_t diff = { 0 }, a, b, mask;
+    unsigned int i;
+
+    for (i = 0; i + 16 <= len; i += 16)
+    {
+        memcpy(&a, cached + i, sizeof(a));
+        memcpy(&b, data + i, sizeof(b));
+        diff |= a ^ b;
+    }
+
+    if (i < len)
+    {
+        memcpy(&a, cached + i, sizeof(a));
+        memcpy(&b, data + i, sizeof(b));
+        memcpy(&mask, change_tail_mask + 16 - (len - i), sizeof(mask));
+        diff |= (a ^ b) & mask;
+    }
+
+    uint64_t words[2];
+    memcpy(words, &diff, sizeof(words));
+
+    return (words[0] | words[1]) != 0;
+}
+
+/* .. check if the frame has to be forwarded and remember its payload */
+int channel_frame_changed(channel_t *chc, const struct canfd_frame *frame, uint64_t timestamp)
+{
+    change_cache_t *cache = chc->changes;
+    change_entry_t *entry;
+    struct timespec now;
+    unsigned int len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+
+    /* .. remote and error frames carry no payload to compare */
+    if (frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG))
+        return 1;
+
+    if (!(entry = change_cache_lookup(cache, frame->can_id)))
+        return 1;
+
+    if (entry->valid && entry->len == len && entry->flags == frame->flags &&
+        !change_payload_differs(entry->data, frame->data, len))
+    {
+        entry->received = timestamp;
+        entry->pending = 1;
+        cache->suppressed++;
+        return 0;
+    }
+
+    /* .. keep the payload zero padded */
+    memcpy(entry->data, frame->data, len);
+    memset(entry->data + len, 0, CANFD_MAX_DLEN - len);
+    entry->can_id = frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+    entry->len = len;
+    entry->flags = frame->flags;
+    entry->valid = 1;
+    entry->pending = 0;
+
+    /* .. the clock is read only for changes, which are the rare case */
+    if (cache->heartbeat)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        entry->sent = timespec_to_ns(now);
+    }
+
+    return 1;
+}
+
+/*
+ * Snapshot table
+ */
+
+int snapshot_init(snapshot_t **snapshot, channel_t *chc, unsigned int size, unsigned int interval_ms)
+{
+    snapshot_t *snap;
+    size_t slots;
+
+    for (slots = 1; slots < (size_t)size * 2; slots *= 2)
+        ;
+
+    if (!(snap = calloc(1, sizeof(*snap))) ||
+        !(snap->entries = calloc(size, sizeof(*snap->entries))) ||
+        !(snap->eff = calloc(slots, sizeof(*snap->eff))))
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        if (snap)
+            free(snap->entries);
+        free(snap);
+        return -1;
+    }
+
+    snap->source = SOURCE_SNAPSHOT;
+    snap->chc = chc;
+    snap->size = size;
+    snap->eff_mask = slots - 1;
+    *snapshot = snap;
+
+    /* .. the timer is a member of the epoll set of the worker serving the channel */
+    struct itimerspec period = {
+        .it_interval = { .tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000l },
+        .it_value = { .tv_sec = interval_ms / 1000, .tv_nsec = (interval_ms % 1000) * 1000000l },
+    };
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = snap,
+    };
+
+    if ((snap->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0 ||
+        timerfd_settime(snap->timer_fd, 0, &period, NULL) < 0 ||
+        epoll_ctl(chc->worker->epoll_fd, EPOLL_CTL_ADD, snap->timer_fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot start snapshot timer for '%s': %m", chc->interface_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+void snapshot_free(snapshot_t *snap)
+{
+    if (!snap)
+        return;
+
+    if (snap->timer_fd >= 0)
+    {
+        epoll_ctl(snap->chc->worker->epoll_fd, EPOLL_CTL_DEL, snap->timer_fd, NULL);
+        close(snap->timer_fd);
+    }
+
+    if (snap->overflows)
+        daemon_log(LOG_WARNING, "%lu frames of '%s' did not fit in the snapshot table.", snap->overflows, snap->chc->interface_name);
+
+    free(snap->entries);
+    free(snap->eff);
+    free(snap);
+}
+
+/* .. entry of the ID, NULL if the table is full */
+static inline snapshot_entry_t *snapshot_lookup(snapshot_t *snap, canid_t can_id)
+{
+    snapshot_slot_t *slot = NULL;
+    uint32_t *index;
+
+    if (!(can_id & CAN_EFF_FLAG))
+        index = &snap->sff[can_id & CAN_SFF_MASK];
+    else
+    {
+        can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+
+        /* .. the hash table is twice the size of the table, an unused slot is always left */
+        size_t i = (can_id * 0x9E3779B1u) & snap->eff_mask;
+        while (snap->eff[i].can_id && snap->eff[i].can_id != can_id)
+            i = (i + 1) & snap->eff_mask;
+
+        slot = &snap->eff[i];
+        index = &slot->index;
+    }
+
+    if (!*index)
+    {
+        if (snap->count == snap->size)
+            return NULL;
+
+        *index = ++snap->count;
+        if (slot)
+            slot->can_id = can_id;
+    }
+
+    return &snap->entries[*index - 1];
+}
+
+/* .. keep the frame as the latest one of its ID */
+static inline void snapshot_store(snapshot_t *snap, const struct canfd_frame *frame, uint64_t timestamp)
+{
+    snapshot_entry_t *entry;
+
+    if (!(entry = snapshot_lookup(snap, frame->can_id)))
+    {
+        snap->overflows++;
+        return;
+    }
+
+    memcpy(&entry->frame, frame, sizeof(*frame));
+    entry->timestamp = timestamp;
+}
+
+/*
+ * CAN ID filters
+ */
+
+/* .. match a normalized ID, with CAN_EFF_FLAG for extended frames only, against the rule */
+static inline int id_filter_rule_match(const id_filter_t *rule, canid_t id)
+{
+    if (rule->type == FILTER_RANGE)
+        return id >= rule->id && id <= rule->last;
+
+    return (id & rule->mask) == (rule->id & rule->mask);
+}
+
+/* .. match against all rules, used to build lookup tables */
+int id_filter_rules_match(const id_filter_set_t *set, canid_t id)
+{
+    int accepted = !set->positive;
+    size_t j;
+
+    for (j = 0; j < set->length; j++)
+        if (id_filter_rule_match(&set->rules[j], id))
+        {
+            if (set->rules[j].invert)
+                return 0;
+            accepted = 1;
+        }
+
+    return accepted;
+}
+
+static inline size_t id_filter_hash(canid_t id, size_t mask)
+{
+    return (id * 0x9E3779B1u) & mask;
+}
+
+void id_filter_set_insert(id_filter_set_t *set, canid_t id)
+{
+    size_t slot = id_filter_hash(id, set->eff_set_mask);
+
+    while (set->eff_set[slot] && set->eff_set[slot] != id)
+        slot = (slot + 1) & set->eff_set_mask;
+
+    set->eff_set[slot] = id;
+}
+
+static inline int id_filter_set_contains(const id_filter_set_t *set, canid_t id)
+{
+    size_t slot = id_filter_hash(id, set->eff_set_mask);
+
+    for (; set->eff_set[slot]; slot = (slot + 1) & set->eff_set_mask)
+        if (set->eff_set[slot] == id)
+            return 1;
+
+    return 0;
+}
+
+/* .. add kernel filters covering the range with aligned blocks. Returns the number of filters */
+size_t id_filter_range_to_kernel(canid_t first, canid_t last, canid_t id_mask, struct can_filter *out)
+{
+    canid_t flags = first & CAN_EFF_FLAG;
+    uint64_t lo = first & id_mask, hi = last & id_mask;
+    size_t count = 0;
+
+    while (lo <= hi)
+    {
+        uint64_t size = 1;
+
+        /* .. the largest block aligned at lo that does not pass hi */
+        while (!(lo & size) && lo + size * 2 - 1 <= hi && size * 2 <= (uint64_t)id_mask + 1)
+            size *= 2;
+
+        if (out)
+        {
+            out[count].can_id = (canid_t)lo | flags;
+            out[count].can_mask = ((canid_t)~(size - 1) & id_mask) | CAN_EFF_FLAG;
+        }
+        count++;
+        lo += size;
+    }
+
+    return count;
+}
+
+/* .. translate rules into kernel filters. Returns the number of filters, 0 if it is not possible */
+size_t id_filter_set_to_kernel(const id_filter_set_t *set, struct can_filter *out)
+{
+    size_t j, count = 0;
+
+    /* .. kernel filters are ORed, a rejecting rule can only stand alone */
+    if (set->positive != set->length && set->length != 1)
+        return 0;
+
+    for (j = 0; j < set->length; j++)
+    {
+        const id_filter_t *rule = &set->rules[j];
+        canid_t id_mask = rule->id & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK;
+
+        if (rule->type == FILTER_RANGE)
+        {
+            size_t n = id_filter_range_to_kernel(rule->id, rule->last, id_mask, out ? out + count : NULL);
+            if (rule->invert && n != 1)
+                return 0;
+            count += n;
+        }
+        else
+        {
+            if (out)
+            {
+                out[count].can_id = rule->id;
+                out[count].can_mask = rule->mask;
+            }
+            count++;
+        }
+    }
+
+    if (out && set->length == 1 && set->rules[0].invert)
+        out[0].can_id |= CAN_INV_FILTER;
+
+    return count;
+}
+
+/* .. build lookup tables of the filter set and decide if the kernel can do the filtering */
+int id_filter_set_compile(id_filter_set_t *set, size_t kernel_limit, const char *interface_name)
+{
+    size_t j, eff_ids = 0, eff_other = 0, eff_inverted = 0;
+    canid_t id;
+
+    for (j = 0; j < set->length; j++)
+    {
+        const id_filter_t *rule = &set->rules[j];
+
+        set->positive += !rule->invert;
+        if (!(rule->id & CAN_EFF_FLAG))
+            continue;
+
+        if (rule->invert)
+            eff_inverted++;
+        else if (rule->type == FILTER_MASK && rule->mask == (CAN_EFF_MASK | CAN_EFF_FLAG))
+            eff_ids++;
+        else
+            eff_other++;
+    }
+
+    /* .. every standard ID has its bit */
+    for (id = 0; id <= CAN_SFF_MASK; id++)
+        if (id_filter_rules_match(set, id))
+            set->sff[id / 64] |= 1ull << (id % 64);
+
+    /* .. single extended IDs go to the hash set, kept at most half full */
+    for (set->eff_set_mask = 1; set->eff_set_mask < eff_ids * 2; set->eff_set_mask *= 2)
+        ;
+    set->eff_set = calloc(set->eff_set_mask--, sizeof(*set->eff_set));
+    set->eff_rules = calloc(eff_other + 1, sizeof(*set->eff_rules));
+    set->eff_inverted = calloc(eff_inverted + 1, sizeof(*set->eff_inverted));
+    if (!set->eff_set || !set->eff_rules || !set->eff_inverted)
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    for (j = 0; j < set->length; j++)
+    {
+        id_filter_t *rule = &set->rules[j];
+
+        if (!(rule->id & CAN_EFF_FLAG))
+            continue;
+
+        if (rule->invert)
+            set->eff_inverted[set->eff_inverted_length++] = rule;
+        else if (rule->type == FILTER_MASK && rule->mask == (CAN_EFF_MASK | CAN_EFF_FLAG))
+            id_filter_set_insert(set, rule->id);
+        else
+            set->eff_rules[set->eff_rules_length++] = rule;
+    }
+
+    /* .. the kernel walks its filters linearly for every frame, use it for small sets only */
+    size_t count = id_filter_set_to_kernel(set, NULL);
+    if (count && count <= kernel_limit)
+    {
+        if (!(set->kernel = malloc(sizeof(*set->kernel) * count)))
+        {
+            daemon_log(LOG_ERR, "Out of memory");
+            return -1;
+        }
+        set->kernel_length = id_filter_set_to_kernel(set, set->kernel);
+    }
+    else
+        daemon_log(LOG_INFO, "Filtering %zu rules of '%s' in userspace.", set->length, interface_name);
+
+    return 0;
+}
+
+/* .. O(1) lookup of standard IDs and single extended IDs */
+static inline int id_filter_set_match(const id_filter_set_t *set, canid_t can_id)
+{
+    size_t j;
+
+    if (!(can_id & CAN_EFF_FLAG))
+    {
+        canid_t id = can_id & CAN_SFF_MASK;
+        return (set->sff[id / 64] >> (id % 64)) & 1;
+    }
+
+    can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+
+    if (set->positive && !id_filter_set_contains(set, can_id))
+    {
+        for (j = 0; j < set->eff_rules_length; j++)
+            if (id_filter_rule_match(set->eff_rules[j], can_id))
+                break;
+
+        if (j == set->eff_rules_length)
+            return 0;
+    }
+
+    for (j = 0; j < set->eff_inverted_length; j++)
+        if (id_filter_rule_match(set->eff_inverted[j], can_id))
+            return 0;
+
+    return 1;
+}
+
+void id_filter_set_free(id_filter_set_t *set)
+{
+    if (!set)
+        return;
+
+    free(set->rules);
+    free(set->eff_set);
+    free(set->eff_rules);
+    free(set->eff_inverted);
+    free(set->kernel);
+    free(set);
+}
+
+/* .. install kernel filters */
+int socket_set_filters(int fd, const struct can_filter *filters, size_t len, const char *interface_name)
+{
+    if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, sizeof(*filters) * len) < 0)
+    {
+        daemon_log(LOG_WARNING, "Error setting filters for CAN socket '%s'. Filtering in userspace: %m", interface_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* .. match the frame against filters of the channel */
+static inline int channel_filter_match(channel_t *chc, const struct canfd_frame *frame)
+{
+    if (!chc->filters)
+        return 1;
+
+    return id_filter_set_match(chc->filters, frame->can_id);
+}
+
+/* .. open CAN_RAW socket of the channel */
+int channel_init_raw(channel_t *chc)
+{
+    struct sockaddr_can addr;
+    int use_canfd = 1;
+
+    /* .. create the socket */
+    if ((chc->raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+    {
+        daemon_log(LOG_WARNING, "CAN socket error: %m");
+        return -1;
+    }
+
+    /*.. set non-blocking */
+    if (fcntl(chc->raw_socket, F_SETFL, O_NONBLOCK)< 0)
+    {
+        daemon_log(LOG_WARNING, "Error setting nonblock for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+    }
+
+    if (chc->filters && chc->filters->kernel)
+        chc->filters->in_kernel = socket_set_filters(chc->raw_socket, chc->filters->kernel,
+                                                     chc->filters->kernel_length, chc->interface_name) == 0;
+
+    /* .. connect the socket to the channel */
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = chc->ifindex;
+    if (bind(chc->raw_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        daemon_log(LOG_WARNING, "CAN socket bind failed for '%s': %m", chc->interface_name);
+        return -1;
+    }
+
+    /*.. try to enable CAN FD. Ignore errors. */
+    if (setsockopt(chc->raw_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+                   &use_canfd, sizeof(use_canfd)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Error enabling CAN FD frames for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+        chc->can_fd_enabled = 0;
+    }
+
+    /*.. deliver receive timestamps together with every frame */
+    if (chc->timestamp_source == TIMESTAMP_HARDWARE)
+        hwtstamp_enable(chc->raw_socket, chc->interface_name);
+    channel_enable_timestamps(chc);
+    channel_enable_overflows(chc);
+
+    /* .. allocate buffers for batched reading */
+    if (rx_batch_init(&chc->rx, chc->batch_size) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* .. open AF_PACKET socket of the channel and map its TPACKET_V3 receive ring */
+int channel_init_ring(channel_t *chc)
+{
+    rx_ring_t *ring = &chc->ring;
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+
+    /* .. no protocol, the socket receives nothing until it is bound to the channel */
+    if ((chc->raw_socket = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Packet socket error for '%s': %m", chc->interface_name);
+        return -1;
+    }
+
+    if (setsockopt(chc->raw_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    {
+        daemon_log(LOG_WARNING, "TPACKET_V3 is not supported for '%s': %m", chc->interface_name);
+        return -1;
+    }
+
+    /* .. hardware timestamps go to the frame header instead of software ones */
+    if (chc->timestamp_source == TIMESTAMP_HARDWARE)
+    {
+        int flags = SOF_TIMESTAMPING_RAW_HARDWARE;
+
+        hwtstamp_enable(chc->raw_socket, chc->interface_name);
+        if (setsockopt(chc->raw_socket, SOL_PACKET, PACKET_TIMESTAMP, &flags, sizeof(flags)) < 0)
+            daemon_log(LOG_WARNING, "Error enabling hardware timestamps for '%s'. Ignoring: %m", chc->interface_name);
+    }
+
+    /* .. receive only frames of the channel. Classic frames are ETH_P_CAN, CAN FD frames ETH_P_CANFD,
+     *    a packet socket takes a single protocol, so channels with CAN FD take all of the CAN device */
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(chc->can_fd_enabled ? ETH_P_ALL : ETH_P_CAN);
+    addr.sll_ifindex = chc->ifindex;
+    if (bind(chc->raw_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Packet socket bind failed for '%s': %m", chc->interface_name);
+        return -1;
+    }
+
+    /* .. frames are retired to userspace block by block */
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = ring->block_size;
+    req.tp_block_nr = ring->block_count;
+    req.tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + CANFD_MTU);
+    req.tp_frame_nr = (ring->block_size / req.tp_frame_size) * ring->block_count;
+    req.tp_retire_blk_tov = ring->timeout;
+
+    if (setsockopt(chc->raw_socket, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Cannot set up receive ring of %u x %u bytes for '%s': %m",
+                   ring->block_count, ring->block_size, chc->interface_name);
+        return -1;
+    }
+
+    ring->map = mmap(NULL, (size_t)ring->block_size * ring->block_count,
+                     PROT_READ | PROT_WRITE, MAP_SHARED, chc->raw_socket, 0);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        daemon_log(LOG_WARNING, "Cannot map receive ring for '%s': %m", chc->interface_name);
+        return -1;
+    }
+    ring->block = 0;
+
+    return 0;
+}
+
+void channel_close_ring(channel_t *chc)
+{
+    if (chc->ring.map)
+        munmap(chc->ring.map, (size_t)chc->ring.block_size * chc->ring.block_count);
+    chc->ring.map = NULL;
+}
+
+#ifdef CAN2UDP_IO_URING
+int channel_post_receives(uring_t *uring, channel_t *chc);
+#endif
+
+int channel_init(daemon_config_t *config, channel_t *chc)
+{
+    /* .. obtain CAN channel index */
+    if (!(chc->ifindex = if_nametoindex(chc->interface_name)))
+    {
+        daemon_log(LOG_WARNING, "CAN interface '%s' not found: %m", chc->interface_name);
+        goto error;
+    }
+
+    /* .. allocate the aggregated packet */
+    if (chc->packet_version >= CAN2UDP_PACKET_VERSION_3)
+    {
+        if (!(chc->aggregate = malloc(chc->mtu)))
+        {
+            daemon_log(LOG_ERR, "Out of memory");
+            goto error;
+        }
+        chc->aggregate_length = 0;
+    }
+
+    /* .. allocate the payload cache */
+    if (chc->on_change && change_cache_init(&chc->changes, chc, chc->change_cache_size, chc->heartbeat) < 0)
+        goto error;
+
+    /* .. allocate the snapshot table and start publishing */
+    if (chc->snapshot_interval > 0 && snapshot_init(&chc->snapshot, chc, chc->snapshot_size, chc->snapshot_interval) < 0)
+        goto error;
+
+    /* .. map the first capture segment */
+    if (chc->record && recorder_init(&chc->recorder, &config->recording, &config->recorder_stage, chc) < 0)
+        goto error;
+
+    /* .. prepare lookup tables and kernel filters */
+    if (chc->filters && id_filter_set_compile(chc->filters, config->kernel_filter_limit, chc->interface_name) < 0)
+        goto error;
+
+    if (chc->backend == BACKEND_MMAP)
+    {
+        if (channel_init_ring(chc) < 0)
+            goto error;
+    }
+    else if (config->shared_socket)
+    {
+        /* .. frames of the channel arrive through the shared socket */
+        return 0;
+    }
+    else if (channel_init_raw(chc) < 0)
+        goto error;
+#ifdef CAN2UDP_IO_URING
+    else if (config->io_uring)
+    {
+        /* .. receptions are kept outstanding in the ring of the worker */
+        if (channel_post_receives(&chc->worker->uring, chc) < 0)
+            goto error;
+        return 0;
+    }
+#endif
+
+    /* .. watch the fd, the channel is passed back with its events */
+    struct epoll_event ev = {
+        .events = EPOLLIN | (config->edge_triggered ? EPOLLET : 0),
+        .data.ptr = chc,
+    };
+    if (epoll_ctl(chc->worker->epoll_fd, EPOLL_CTL_ADD, chc->raw_socket, &ev) < 0)
+    {
+        daemon_log(LOG_WARNING, "Cannot watch CAN socket for '%s': %m", chc->interface_name);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    if (chc->raw_socket)
+        close(chc->raw_socket);
+    chc->raw_socket = 0;
+    rx_batch_free(&chc->rx);
+    channel_close_ring(chc);
+    free(chc->aggregate);
+    chc->aggregate = NULL;
+    change_cache_free(chc->changes);
+    chc->changes = NULL;
+    snapshot_free(chc->snapshot);
+    chc->snapshot = NULL;
+    recorder_free(chc->recorder);
+    chc->recorder = NULL;
+
+    return -1;
+}
+
+/* .. open one socket receiving frames of all configured interfaces */
+int shared_init(daemon_config_t *config)
+{
+    channel_t *shared = &config->shared;
+    struct sockaddr_can addr;
+    int use_canfd = 1;
+    int batch_size = 0, all_filtered = 1;
+    size_t filters_length = 0;
+    channel_t *chc;
+
+    shared->source = SOURCE_CHANNEL;
+    shared->shared = 1;
+    shared->worker = &config->main_worker;
+    shared->interface_name = strdup("any");
+    shared->timestamp_source = TIMESTAMP_NONE;
+
+    /* .. build the map of interface indexes and summarize settings of channels */
+    for (chc = config->channels; chc; chc = chc->next)
+    {
+        if (!chc->ifindex || chc->backend != BACKEND_RAW)
+            continue;
+
+        if (chc->ifindex >= config->ifindex_map_size)
+            config->ifindex_map_size = chc->ifindex + 1;
+
+        batch_size += chc->batch_size;
+        /* .. rejecting rules cannot be merged with filters of other channels */
+        all_filtered &= chc->filters && chc->filters->kernel && chc->filters->positive;
+        if (chc->filters)
+            filters_length += chc->filters->kernel_length;
+        if (chc->timestamp_source > shared->timestamp_source)
+            shared->timestamp_source = chc->timestamp_source;
+    }
+
+    config->ifindex_map = calloc(config->ifindex_map_size, sizeof(*config->ifindex_map));
+    if (!config->ifindex_map)
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    for (chc = config->channels; chc; chc = chc->next)
+        if (chc->ifindex && chc->backend == BACKEND_RAW)
+            config->ifindex_map[chc->ifindex] = chc;
+
+    /* .. create the socket */
+    if ((shared->raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+    {
+        daemon_log(LOG_ERR, "CAN socket error: %m");
+        return -1;
+    }
+
+    if (fcntl(shared->raw_socket, F_SETFL, O_NONBLOCK) < 0)
+    {
+        daemon_log(LOG_WARNING, "Error setting nonblock for shared CAN socket. Ignoring: %m");
+    }
+
+    /* .. kernel filters apply to all interfaces. Install the union of filters
+     *    if every channel is filtered, the rest is done by channel_filter_match()
+     */
+    if (all_filtered && filters_length && filters_length <= (size_t)config->kernel_filter_limit)
+    {
+        struct can_filter *filters = malloc(sizeof(*filters) * filters_length);
+        size_t k = 0;
+
+        if (!filters)
+        {
+            daemon_log(LOG_ERR, "Out of memory");
+            return -1;
+        }
+
+        for (chc = config->channels; chc; chc = chc->next)
+            if (chc->ifindex && chc->backend == BACKEND_RAW)
+            {
+                memcpy(filters + k, chc->filters->kernel, sizeof(*filters) * chc->filters->kernel_length);
+                k += chc->filters->kernel_length;
+            }
+
+        socket_set_filters(shared->raw_socket, filters, k, shared->interface_name);
+        free(filters);
+    }
+
+    /* .. interface index 0 means any CAN interface */
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = 0;
+    if (bind(shared->raw_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        daemon_log(LOG_ERR, "Shared CAN socket bind failed: %m");
+        return -1;
+    }
+
+    if (setsockopt(shared->raw_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+                   &use_canfd, sizeof(use_canfd)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Error enabling CAN FD frames for shared CAN socket. Ignoring: %m");
+    }
+
+    /* .. hardware timestamping is configured per interface */
+    for (chc = config->channels; chc; chc = chc->next)
+        if (chc->ifindex && chc->backend == BACKEND_RAW && chc->timestamp_source == TIMESTAMP_HARDWARE)
+            hwtstamp_enable(shared->raw_socket, chc->interface_name);
+    channel_enable_timestamps(shared);
+    channel_enable_overflows(shared);
+
+    if (batch_size > CAN2UDP_MAX_BATCH_SIZE)
+        batch_size = CAN2UDP_MAX_BATCH_SIZE;
+    if (rx_batch_init(&shared->rx, batch_size) < 0)
+        return -1;
+
+#ifdef CAN2UDP_IO_URING
+    if (config->io_uring)
+    {
+        if (channel_post_receives(&shared->worker->uring, shared) < 0)
+            return -1;
+        daemon_log(LOG_INFO, "Receiving frames of all interfaces with a shared socket.");
+        return 0;
+    }
+#endif
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | (config->edge_triggered ? EPOLLET : 0),
+        .data.ptr = shared,
+    };
+    if (epoll_ctl(shared->worker->epoll_fd, EPOLL_CTL_ADD, shared->raw_socket, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot watch shared CAN socket: %m");
+        return -1;
+    }
+
+    daemon_log(LOG_INFO, "Receiving frames of all interfaces with a shared socket.");
+
+    return 0;
+}
+
+/* .. find the channel a frame of the shared socket belongs to. NULL if the frame is not wanted */
+channel_t *shared_lookup(daemon_config_t *config, int ifindex, const struct canfd_frame *frame)
+{
+    channel_t *chc;
+
+    if (ifindex <= 0 || ifindex >= config->ifindex_map_size)
+        return NULL;
+
+    if (!(chc = config->ifindex_map[ifindex]))
+        return NULL;
+
+    if (!channel_filter_match(chc, frame))
+    {
+        stats_add(&chc->stats.rx.filtered, 1);
+        return NULL;
+    }
+
+    return chc;
+}
+
+/* .. queue a packet of the channel for sending */
+static inline int channel_queue_packet(channel_t *chc, const void *packet, size_t length)
+{
+    stats_add(&chc->stats.tx.packets, 1);
+    stats_add(&chc->stats.tx.bytes, length);
+
+    return egress_queue(chc->egress, packet, length, chc->destinations);
+}
+
+/* .. queue the aggregated packet for sending and start a new one */
+int channel_flush_aggregate(daemon_config_t *config, channel_t *chc)
+{
+    int ret;
+
+    if (!chc->aggregate_length)
+        return 0;
+
+    if (chc->packet_version == CAN2UDP_PACKET_VERSION_4)
+    {
+        can2udp_packet_ver4_t *header = (can2udp_packet_ver4_t *)chc->aggregate;
+
+        /* .. channels of the shared socket report its drops */
+        channel_t *source = chc->backend == BACKEND_RAW && config->shared_socket ? &config->shared : chc;
+        uint32_t drops = stats_get(&source->stats.rx.overflows);
+
+        header->sequence = chc->sequence++;
+        header->drops = drops;
+        if (drops != chc->drops_reported)
+        {
+            header->flags |= CAN2UDP_KERNEL_DROPS;
+            chc->drops_reported = drops;
+        }
+    }
+
+    ret = channel_queue_packet(chc, chc->aggregate, chc->aggregate_length);
+    chc->aggregate_length = 0;
+
+    return ret;
+}
+
+/* .. append a frame record to the aggregated packet */
+int channel_aggregate_frame(daemon_config_t *config, channel_t *chc, struct canfd_frame *frame, uint64_t timestamp)
+{
+    can2udp_packet_ver3_t *header = (can2udp_packet_ver3_t *)chc->aggregate;
+    size_t size = chc->compact ? can2udp_compact_record_size(frame->len) : sizeof(can2udp_record_t);
+
+    /* .. send out the packet if there is no room for the record */
+    if (chc->aggregate_length + size > (size_t)chc->mtu)
+        channel_flush_aggregate(config, chc);
+
+    /* .. start a new packet */
+    if (!chc->aggregate_length)
+    {
+        /* .. the version 4 header starts like the version 3 one */
+        header->version = chc->packet_version;
+        header->flags = chc->compact ? CAN2UDP_COMPACT : 0;
+        header->interface_id = (uint16_t)chc->udp_interface_index;
+        header->count = 0;
+        header->reserved = 0;
+        chc->aggregate_length = chc->packet_version == CAN2UDP_PACKET_VERSION_4 ?
+                    sizeof(can2udp_packet_ver4_t) : sizeof(*header);
+    }
+
+    if (chc->compact)
+    {
+        /* .. only the used part of the payload goes to the packet */
+        chc->aggregate_length += can2udp_compact_record_encode(chc->aggregate + chc->aggregate_length, frame, timestamp);
+    }
+    else
+    {
+        can2udp_record_t record = {
+            .timestamp = timestamp
+        };
+
+        memcpy(&record.raw_frame, frame, sizeof(*frame));
+        memcpy(chc->aggregate + chc->aggregate_length, &record, sizeof(record));
+        chc->aggregate_length += sizeof(record);
+    }
+    header->count++;
+
+    return 0;
+}
+
+int channel_send_frame(daemon_config_t *config, channel_t *chc, struct canfd_frame *frame, uint64_t timestamp)
+{
+    switch (chc->packet_version)
+    {
+    case CAN2UDP_PACKET_VERSION_3:
+    case CAN2UDP_PACKET_VERSION_4:
+        return channel_aggregate_frame(config, chc, frame, timestamp);
+
+    case CAN2UDP_PACKET_VERSION_1:
+        /* .. version 1 packets carry classic frames only, CAN FD frames of any length go as version 2 */
+        if (!(frame->flags & CANFD_FDF))
+        {
+            can2udp_packet_ver1_t packet = {
+                .version = CAN2UDP_PACKET_VERSION_1,
+                .flags = 0,
+                .interface_id = (uint16_t)chc->udp_interface_index,
+            };
+
+            /* .. classic frame shares the layout with the head of CAN FD frame */
+            memcpy(&packet.raw_frame, frame, sizeof(packet.raw_frame));
+
+            return channel_queue_packet(chc, &packet, sizeof(packet));
+        }
+        /* .. fall through */
+
+    default:
+    {
+        /* .. init default data */
+        can2udp_packet_t packet = {
+            .version = CAN2UDP_PACKET_VERSION_2,
+            .flags = 0,
+            .interface_id = (uint16_t)chc->udp_interface_index,
+            .timestamp = timestamp
+        };
+
+        /* copy CAN packet */
+        memcpy(&packet.raw_frame, frame, sizeof(*frame));
+
+        /* .. queue the packet, it is sent out at the end of the event loop iteration */
+        return channel_queue_packet(chc, &packet, sizeof(packet));
+    }
+    }
+}
+
+/* .. send the frame or pass it to the egress stage */
+static inline void channel_forward_frame(daemon_config_t *config, channel_t *chc, struct canfd_frame *frame, uint64_t timestamp)
+{
+    if (config->egress_thread)
+        frame_queue_push(&chc->worker->queue, chc, frame, timestamp);
+    else
+        channel_send_frame(config, chc, frame, timestamp);
+}
+
+/* .. pass a received frame on for sending. 'stamp_clock' is the CAN2UDP_SEGMENT_CLOCK_* the timestamp comes from */
+void channel_emit_frame(daemon_config_t *config, channel_t *chc, struct canfd_frame *frame, uint64_t timestamp, uint8_t stamp_clock)
+{
+    stats_add(&chc->stats.rx.frames, 1);
+
+    /* .. every frame is recorded, whatever is forwarded */
+    if (chc->recorder)
+    {
+        if (recorder_store(chc->recorder, frame, timestamp, stamp_clock) == 0)
+            stats_add(&chc->stats.rx.recorded, 1);
+        else
+            stats_add(&chc->stats.rx.record_drops, 1);
+    }
+
+    /* .. snapshots are published by their timer */
+    if (chc->snapshot)
+    {
+        snapshot_store(chc->snapshot, frame, timestamp);
+        return;
+    }
+
+    if (chc->changes && !channel_frame_changed(chc, frame, timestamp))
+    {
+        stats_add(&chc->stats.rx.unchanged, 1);
+        return;
+    }
+
+    channel_forward_frame(config, chc, frame, timestamp);
+}
+
+/* .. all frames of a wakeup were passed on */
+void channel_emit_done(daemon_config_t *config, channel_t *chc)
+{
+    uint64_t one = 1;
+
+    /* .. wake the egress thread up only if it waits for frames */
+    if (config->egress_thread)
+    {
+        if (__atomic_exchange_n(&config->egress_sleeping, 0, __ATOMIC_SEQ_CST) &&
+            write(config->egress_worker.stop_fd, &one, sizeof(one)) != sizeof(one))
+            daemon_log(LOG_WARNING, "Error waking up the egress thread. %m");
+
+        return;
+    }
+
+    /* .. do not hold frames until the next wakeup */
+    if (chc->shared)
+    {
+        channel_t *member;
+        for (member = config->channels; member; member = member->next)
+            channel_flush_aggregate(config, member);
+    }
+    else
+        channel_flush_aggregate(config, chc);
+}
+
+/* .. repeat the payload of the entry if it is still received unchanged and the interval has passed */
+static inline void change_entry_heartbeat(daemon_config_t *config, change_cache_t *cache, change_entry_t *entry, uint64_t now)
+{
+    struct canfd_frame frame;
+
+    if (!entry->valid || !entry->pending || now - entry->sent < cache->heartbeat)
+        return;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = entry->can_id;
+    frame.len = entry->len;
+    frame.flags = entry->flags;
+    memcpy(frame.data, entry->data, entry->len);
+
+    entry->sent = now;
+    entry->pending = 0;
+    channel_forward_frame(config, cache->chc, &frame, entry->received);
+}
+
+/* .. the heartbeat timer expired */
+int change_cache_heartbeat(daemon_config_t *config, change_cache_t *cache)
+{
+    uint64_t expirations;
+    struct timespec ts;
+    size_t i;
+
+    if (read(cache->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        daemon_log(LOG_WARNING, "Error reading heartbeat timer of '%s'. %m", cache->chc->interface_name);
+        return -errno;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    for (i = 0; i <= CAN_SFF_MASK; i++)
+        change_entry_heartbeat(config, cache, &cache->sff[i], timespec_to_ns(ts));
+    for (i = 0; i <= cache->eff_mask; i++)
+        change_entry_heartbeat(config, cache, &cache->eff[i], timespec_to_ns(ts));
+
+    channel_emit_done(config, cache->chc);
+
+    return 0;
+}
+
+/* .. publish the latest frame of every ID seen so far */
+int snapshot_publish(daemon_config_t *config, snapshot_t *snap)
+{
+    uint64_t expirations;
+    uint32_t i;
+
+    if (read(snap->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        daemon_log(LOG_WARNING, "Error reading snapshot timer of '%s'. %m", snap->chc->interface_name);
+        return -errno;
+    }
+
+    for (i = 0; i < snap->count; i++)
+        channel_forward_frame(config, snap->chc, &snap->entries[i].frame, snap->entries[i].timestamp);
+
+    channel_emit_done(config, snap->chc);
+
+    return 0;
+}
+
+/* .. forward all frames of the blocks retired by the kernel */
+int channel_process_ring(daemon_config_t *config, channel_t *chc)
+{
+    rx_ring_t *ring = &chc->ring;
+    uint8_t stamp_clock;
+    uint32_t i;
+
+    for (;;)
+    {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)(ring->map + (size_t)ring->block * ring->block_size);
+
+        /* .. stop at the first block still owned by the kernel */
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            break;
+
+        /* .. the ring overflowed, fetch the number of lost frames. The kernel resets it on every read */
+        if (block->hdr.bh1.block_status & TP_STATUS_LOSING)
+        {
+            struct tpacket_stats_v3 st;
+            socklen_t length = sizeof(st);
+
+            if (getsockopt(chc->raw_socket, SOL_PACKET, PACKET_STATISTICS, &st, &length) == 0)
+                stats_add(&chc->stats.rx.overflows, st.tp_drops);
+        }
+
+        struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < block->hdr.bh1.num_pkts; i++)
+        {
+            struct sockaddr_ll *sll = (struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+            struct canfd_frame *frame = (struct canfd_frame *)((uint8_t *)hdr + hdr->tp_mac);
+            struct canfd_frame classic;
+
+            /* .. like CAN_RAW, do not report frames we send ourselves */
+            if (sll->sll_pkttype == PACKET_OUTGOING)
+                goto next;
+
+            if (!channel_filter_match(chc, frame))
+            {
+                stats_add(&chc->stats.rx.filtered, 1);
+                goto next;
+            }
+
+            if (hdr->tp_snaplen == CAN_MTU)
+            {
+                /* .. classic frame is shorter than canfd_frame, do not read past its end */
+                memcpy(&classic, frame, CAN_MTU);
+                memset(classic.data + CAN_MAX_DLEN, 0, sizeof(classic.data) - CAN_MAX_DLEN);
+                frame = &classic;
+            }
+            else if (hdr->tp_snaplen == CANFD_MTU)
+                frame->flags |= CANFD_FDF;
+            else
+                goto next;
+
+            /* .. the status says which clock the stamp comes from */
+            if (chc->timestamp_source == TIMESTAMP_NONE)
+                stamp_clock = CAN2UDP_SEGMENT_CLOCK_UNKNOWN;
+            else if (hdr->tp_status & TP_STATUS_TS_RAW_HARDWARE)
+                stamp_clock = CAN2UDP_SEGMENT_CLOCK_HARDWARE;
+            else if (hdr->tp_status & TP_STATUS_TS_SOFTWARE)
+                stamp_clock = CAN2UDP_SEGMENT_CLOCK_REALTIME;
+            else
+                stamp_clock = CAN2UDP_SEGMENT_CLOCK_UNKNOWN;
+
+            channel_emit_frame(config, chc, frame, stamp_clock == CAN2UDP_SEGMENT_CLOCK_UNKNOWN ? 0 :
+                               (uint64_t)hdr->tp_sec * 1000000000ull + hdr->tp_nsec, stamp_clock);
+next:
+            hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+        }
+
+        /* .. give the block back to the kernel */
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        ring->block = (ring->block + 1) % ring->block_count;
+    }
+
+    channel_emit_done(config, chc);
+
+    return 0;
+}
+
+/* .. forward the i-th frame of the reception batch */
+static inline int channel_process_frame(daemon_config_t *config, channel_t *chc, unsigned int i, unsigned int nbytes)
+{
+    rx_batch_t *rx = &chc->rx;
+    uint8_t stamp_clock;
+    uint64_t timestamp;
+
+    if (nbytes != CAN_MTU && nbytes != CANFD_MTU)
+    {
+        log_limit_count(&chc->rx_log, EINVAL);
+        return -EINVAL;
+    }
+
+    /* .. frames of the shared socket are routed by their source interface */
+    channel_t *target = chc;
+    if (chc->shared)
+    {
+        if (!(target = shared_lookup(config, rx->names[i].can_ifindex, &rx->frames[i])))
+            return 0;
+    }
+    else if (chc->filters && !chc->filters->in_kernel && !channel_filter_match(chc, &rx->frames[i]))
+    {
+        stats_add(&chc->stats.rx.filtered, 1);
+        return 0;
+    }
+
+    /* .. mark CAN FD frames, so that they can be told apart from classic ones in compact records */
+    if (nbytes == CANFD_MTU)
+        rx->frames[i].flags |= CANFD_FDF;
+
+    timestamp = rx_batch_timestamp(rx, i, &stamp_clock);
+    channel_emit_frame(config, target, &rx->frames[i], timestamp, stamp_clock);
+
+    return 0;
+}
+
+int channel_process(daemon_config_t *config, channel_t *chc)
+{
+    rx_batch_t *rx = &chc->rx;
+    int i, n, err, ret = 0;
+
+    if (chc->backend == BACKEND_MMAP)
+        return channel_process_ring(config, chc);
+
+    do
+    {
+        /* .. drain up to batch_size frames with a single call */
+        n = rx_batch_receive(rx, chc->raw_socket);
+        if (n < 0)
+        {
+            log_limit_count(&chc->rx_log, -n);
+            return n;
+        }
+
+        /* .. process all received messages */
+        for (i = 0; i < n; i++)
+            if ((err = channel_process_frame(config, chc, i, rx->msgs[i].msg_len)) < 0)
+                ret = err;
+
+        if (n)
+            rx_batch_overflows(rx, n - 1, &chc->stats.rx.overflows);
+
+        /* .. a full batch means more frames may be waiting. Edge-triggered mode must read them all */
+    } while (config->edge_triggered && n == (int)rx->size);
+
+    channel_emit_done(config, chc);
+
+    debug_log("processed %llu frames of '%s'", (unsigned long long)stats_get(&chc->stats.rx.frames), chc->interface_name);
+
+    return ret;
+}
+
+#ifdef CAN2UDP_IO_URING
 /*
- * Type declarations
+ * io_uring engine
  */
 
-typedef
-struct channel channel_t;
-
-struct channel
+/* .. user data of a request: index of the channel or the message, and the slot of the reception batch */
+static inline uint64_t uring_tag(unsigned int index, unsigned int slot)
 {
-    /* .. SocketCAN interface name */
-    const char *interface_name;
+    return (uint64_t)index << 16 | slot;
+}
 
-    /* .. device index for UDP */
-    int udp_interface_index;
+/* .. get a submission entry, submitting queued ones if the ring is full */
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *uring)
+{
+    struct io_uring_sqe *sqe;
 
-    /* .. socket for CAN */
-    int raw_socket;
+    while (!(sqe = io_uring_get_sqe(&uring->ring)))
+        io_uring_submit(&uring->ring);
 
-    /* .. array of filtered IDs */
-    canid_t *filters;
+    return sqe;
+}
 
-    /* .. length of filters */
-    size_t filters_length;
+/* .. keep a reception outstanding in the i-th slot of the batch */
+void channel_post_receive(uring_t *uring, channel_t *chc, unsigned int i)
+{
+    struct msghdr *msg = &chc->rx.msgs[i].msg_hdr;
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
 
-    /*.. interface supports CAN FD */
-    int can_fd_enabled;
+    /* .. the kernel overwrites lengths of control buffers, restore them */
+    msg->msg_controllen = CAN2UDP_RX_CONTROL_SIZE;
+    msg->msg_namelen = sizeof(chc->rx.names[i]);
+    msg->msg_flags = 0;
 
-    /* .. pointer to the next element in the list */
-    channel_t *next;
-};
+    io_uring_prep_recvmsg(sqe, chc->raw_socket, msg, 0);
+    sqe->user_data = uring_tag(chc->uring_index, i);
+}
 
-typedef
-struct deamon_config
+/* .. add the channel to the table of the ring and post receptions of all its slots */
+int channel_post_receives(uring_t *uring, channel_t *chc)
 {
-    /* .. Single linked list of channels */
-    channel_t *channels;
+    struct io_uring_cqe *deferred;
+    channel_t **channels;
+    unsigned int i;
 
-    /* .. UDP port number we transmit to */
-    int port;
+    /* .. completions of every slot may be reaped by a flush before they are handled */
+    if (!(channels = realloc(uring->channels, (uring->channels_count + 1) * sizeof(*channels))))
+        goto error;
+    uring->channels = channels;
 
-    /* .. network interface to bind UDP socket to */
-    const char *interface;
+    if (!(deferred = realloc(uring->deferred, (uring->deferred_size + chc->rx.size) * sizeof(*deferred))))
+        goto error;
+    uring->deferred = deferred;
+    uring->deferred_size += chc->rx.size;
 
-    /* .. broadcast UDP socket */
-    int socket_broadcast;
+    chc->uring_index = uring->channels_count;
+    uring->channels[uring->channels_count++] = chc;
 
-    /* .. broadcast IP address */
-    struct sockaddr_in baddr;
-} daemon_config_t;
+    /* .. io_uring fails requests on non-blocking sockets instead of waiting for data */
+    int flags = fcntl(chc->raw_socket, F_GETFL);
+    if (flags < 0 || fcntl(chc->raw_socket, F_SETFL, flags & ~O_NONBLOCK) < 0)
+        daemon_log(LOG_WARNING, "Error clearing nonblock for CAN socket '%s'. Ignoring: %m", chc->interface_name);
 
-/*******************************************************************************
- * Parsing of config file.
- * See default cofnfig for file format.
- ******************************************************************************/
+    for (i = 0; i < chc->rx.size; i++)
+        channel_post_receive(uring, chc, i);
 
-int
-parse_config(daemon_config_t *config, const char *config_file_name)
-{
-    config_t cf;
-    int i, j;
+    return 0;
 
-    /* .. set default values for parameters */
-    config->channels = NULL;
-    config->port = CAN2UDP_DEFAULT_PORT;
-    config->interface = NULL;
+error:
+    daemon_log(LOG_ERR, "Out of memory");
+    return -1;
+}
 
-    config_init(&cf);
+/* .. epoll readiness of other sources is reported through the ring as well */
+void uring_post_poll(uring_t *uring, int epoll_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(uring);
 
-    /* set default name if none is provided */
-    if (!config_file_name)
-        config_file_name = CAN2UDP_DEFAULT_CONFIG_FILENAME;
+    io_uring_prep_poll_add(sqe, epoll_fd, POLLIN);
+    sqe->user_data = uring_tag(0, URING_SLOT_POLL);
+}
 
-    /* .. try reading config file */
-    if (config_read_file(&cf, config_file_name) != CONFIG_TRUE)
+/* .. set up the ring of the worker for all its receptions, sends and the epoll poll */
+int uring_init(daemon_config_t *config, worker_t *worker)
+{
+    uring_t *uring = &worker->uring;
+    unsigned int entries = 1 + config->send_batch_size * config->destinations_count;
+    channel_t *chc;
+    int ret;
+
+    for (chc = config->channels; chc; chc = chc->next)
+        if (chc->worker == worker && chc->backend == BACKEND_RAW)
+            entries += chc->batch_size;
+
+    uring->sends = 0;
+    uring->channels = NULL;
+    uring->channels_count = 0;
+    uring->deferred_head = 0;
+    uring->deferred_count = 0;
+
+    /* .. receptions add their slots when channels are set up */
+    uring->deferred_size = 1;
+    if (!(uring->deferred = calloc(1, sizeof(*uring->deferred))))
     {
-        daemon_log(LOG_ERR, "Error parsing config file '%s' %s:%d - %s\n",
-                   config_file_name,
-                   config_error_file(&cf),
-                   config_error_line(&cf),
-                   config_error_text(&cf));
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
 
-        /* .. release and exit  */
-        config_destroy(&cf);
+    if ((ret = io_uring_queue_init(entries, &uring->ring, 0)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating io_uring of worker %d: %s", worker->id, strerror(-ret));
         return -1;
     }
+    uring->initialized = 1;
 
-    config_lookup_int(&cf, "port", &config->port);
+    uring_post_poll(uring, worker->epoll_fd);
 
-    config_lookup_string(&cf, "interface", &config->interface);
-    if (config->interface)
-        config->interface = strdup(config->interface);
+    return 0;
+}
 
-    /* .. try getting channel configurations */
-    const config_setting_t *channels  = config_lookup(&cf, "interfaces");
-    if (channels)
+/* .. cancel outstanding requests, must be done before reception buffers are released */
+void uring_close(uring_t *uring)
+{
+    if (uring->initialized)
+        io_uring_queue_exit(&uring->ring);
+    uring->initialized = 0;
+
+    free(uring->deferred);
+    uring->deferred = NULL;
+    free(uring->channels);
+    uring->channels = NULL;
+    uring->channels_count = 0;
+}
+
+/* .. account the completion of a send */
+static inline void uring_complete_send(egress_t *eg, const struct io_uring_cqe *cqe)
+{
+    struct msghdr *msg = &eg->msgs[cqe->user_data >> 16].msg_hdr;
+
+    if (cqe->res < 0)
     {
-        int count = config_setting_length(channels);
-        channel_t *chc = NULL;
+        stats_add(&eg->send_errors, 1);
+        log_limit_count(&eg->send_log, -cqe->res);
+    }
+    else if ((size_t)cqe->res != msg->msg_iov->iov_len)
+    {
+        stats_add(&eg->send_errors, 1);
+        log_limit_count(&eg->send_log, EMSGSIZE);
+    }
+}
 
-        for (i = 0; i < count; i++)
+/* .. submit sends of all queued packets and wait until the kernel is done with them */
+int egress_flush_uring(egress_t *eg)
+{
+    uring_t *uring = eg->backend;
+    struct io_uring_sqe *sqe = NULL;
+    struct io_uring_cqe *cqe;
+    unsigned int d, i, k = 0, head, seen;
+    int ret;
+
+    for (d = 0; d < eg->destinations_count; d++)
+    {
+        destination_t *dest = &eg->destinations[d];
+
+        for (i = 0; i < eg->count; i++)
+            if (eg->masks[i] & (1u << d))
+            {
+                struct msghdr *msg = &eg->msgs[k].msg_hdr;
+                msg->msg_iov = &eg->iovs[i];
+                msg->msg_iovlen = 1;
+                msg->msg_name = &dest->addr;
+                msg->msg_namelen = dest->addr_length;
+                msg->msg_control = NULL;
+                msg->msg_controllen = 0;
+
+                /* .. linked sends of a destination keep their order */
+                sqe = uring_get_sqe(uring);
+                io_uring_prep_sendmsg(sqe, dest->fd, msg, 0);
+                sqe->user_data = uring_tag(k, URING_SLOT_SEND);
+                sqe->flags |= IOSQE_IO_LINK;
+                k++;
+            }
+
+        /* .. the chain ends with the last packet of the destination */
+        if (sqe)
+            sqe->flags &= ~IOSQE_IO_LINK;
+        sqe = NULL;
+    }
+
+    eg->count = 0;
+    uring->sends += k;
+
+    /* .. packet slots are reused afterwards. Receptions completed meanwhile are handled later.
+     *    The caller may be handling completions itself, they were taken off the queue before */
+    while (uring->sends)
+    {
+        if ((ret = io_uring_submit_and_wait(&uring->ring, 1)) < 0)
         {
-            if (chc)
+            if (ret == -EINTR)
+                continue;
+
+            daemon_log(LOG_ERR, "Error submitting UDP sends: %s", strerror(-ret));
+            return ret;
+        }
+
+        seen = 0;
+        io_uring_for_each_cqe(&uring->ring, head, cqe)
+        {
+            seen++;
+            if ((cqe->user_data & 0xffff) == URING_SLOT_SEND)
             {
-                /* .. allocate memory for new element and jump to it */
-                chc->next = malloc(sizeof(*chc));
-                chc = chc->next;
+                uring_complete_send(eg, cqe);
+                uring->sends--;
             }
             else
             {
-                /* .. allocate memory for the first element and store it */
-                chc = malloc(sizeof(*chc));
-                config->channels = chc;
+                /* .. reuse entries that were handled already */
+                if (uring->deferred_count == uring->deferred_size && uring->deferred_head)
+                {
+                    uring->deferred_count -= uring->deferred_head;
+                    memmove(uring->deferred, uring->deferred + uring->deferred_head,
+                            uring->deferred_count * sizeof(*uring->deferred));
+                    uring->deferred_head = 0;
+                }
+
+                uring->deferred[uring->deferred_count++] = *cqe;
             }
+        }
+        io_uring_cq_advance(&uring->ring, seen);
+    }
 
-            if (!chc)
-            {
-                daemon_log(LOG_ERR, "Out of memory");
+    return 0;
+}
 
-                config_destroy(&cf);
-                return -1;
-            }
+/* .. handle a completion. Returns 1 if epoll has events */
+static inline int uring_complete(daemon_config_t *config, worker_t *worker, const struct io_uring_cqe *cqe)
+{
+    unsigned int slot = cqe->user_data & 0xffff;
+    channel_t *chc;
+    int err;
 
-            /* .. parse config for the channel */
-            config_setting_t *channel = config_setting_get_elem (channels, i);
-            if (channel)
-            {
-                /* .. set default values */
-                chc->next = NULL;
-                chc->interface_name = "vcan0";
-                chc->udp_interface_index = i;
-                chc->raw_socket = 0;
-                chc->filters = NULL;
-                chc->filters_length = 0;
-                chc->can_fd_enabled = 1;
+    if (slot == URING_SLOT_POLL)
+        return 1;
 
-                /* .. try reading channel settings
-                 *    We copy strings here because they get destroyed together with cf,
-                 *    and we don't really hold the reference to cf any longer.
-                 */
-                config_setting_lookup_string(channel, "name", &chc->interface_name);
-                chc->interface_name = strdup(chc->interface_name);
-                config_setting_lookup_int(channel, "interface_index", &chc->udp_interface_index);
-                config_lookup_bool(&cf, "can_fd", &chc->can_fd_enabled);
+    /* .. sends of an interrupted flush */
+    if (slot == URING_SLOT_SEND)
+    {
+        worker->uring.sends--;
+        return 0;
+    }
 
-                /* .. try parsing message filter */
-                config_setting_t *filter = config_setting_get_member(channel, "filter");
-                if (filter)
-                {
-                    /* .. ignore invalid lengths */
-                    ssize_t len = config_setting_length(filter);
-                    if (len >= 0)
-                    {
-                        /* .. allocate memory */
-                        chc->filters = malloc(sizeof(*chc->filters) * len);
-                        chc->filters_length = len;
+    chc = worker->uring.channels[cqe->user_data >> 16];
 
-                        if (!chc->filters)
-                        {
-                            daemon_log(LOG_ERR, "Out of memory");
+    if (cqe->res < 0)
+    {
+        /* .. the socket is gone */
+        if (cqe->res == -ECANCELED || cqe->res == -EBADF)
+            return 0;
 
-                            config_destroy(&cf);
-                            return -1;
-                        }
+        log_limit_count(&chc->rx_log, -cqe->res);
+    }
+    else
+    {
+        if ((err = channel_process_frame(config, chc, slot, cqe->res)) < 0)
+            debug_log("Error %d processing frame of '%s'", err, chc->interface_name);
 
-                        /* .. read all elements of the filter */
-                        for (j = 0; j < len; j ++)
-                        {
-                            config_setting_t *element =  config_setting_get_elem(filter, j);
-                            if (element)
-                                chc->filters[j] = config_setting_get_int (element);
-                        }
-                    }
-                }
+        rx_batch_overflows(&chc->rx, slot, &chc->stats.rx.overflows);
+    }
+
+    channel_post_receive(&worker->uring, chc, slot);
+
+    return 0;
+}
+
+/* .. process completions until epoll has events, they are returned like epoll_wait() does */
+int uring_wait(worker_t *worker, struct epoll_event *events, int max)
+{
+    daemon_config_t *config = worker->config;
+    uring_t *uring = &worker->uring;
+    struct io_uring_cqe batch[CAN2UDP_URING_CQE_BATCH], cqe, *next;
+    unsigned int head, n, i;
+    channel_t *chc;
+    int ready, ret;
+
+    for (;;)
+    {
+        ready = 0;
+
+        /* .. completions reaped by the last flush come first, flushes while handling them may add more */
+        while (uring->deferred_head < uring->deferred_count)
+        {
+            cqe = uring->deferred[uring->deferred_head++];
+            ready |= uring_complete(config, worker, &cqe);
+        }
+        uring->deferred_head = uring->deferred_count = 0;
+
+        /* .. one call submits new receptions and waits for the next completion */
+        if ((ret = io_uring_submit_and_wait(&uring->ring, ready ? 0 : 1)) < 0 && ret != -EINTR)
+        {
+            errno = -ret;
+            return -1;
+        }
+
+        /* .. handling a completion may flush the egress, which reaps the queue as well.
+         *    Completions are copied and taken off the queue before they are handled */
+        do
+        {
+            n = 0;
+            io_uring_for_each_cqe(&uring->ring, head, next)
+            {
+                batch[n++] = *next;
+                if (n == CAN2UDP_URING_CQE_BATCH)
+                    break;
             }
+            io_uring_cq_advance(&uring->ring, n);
+
+            for (i = 0; i < n; i++)
+                ready |= uring_complete(config, worker, &batch[i]);
+        }
+        while (n == CAN2UDP_URING_CQE_BATCH);
+
+        /* .. pass frames of this round on */
+        if (config->shared_socket)
+            channel_emit_done(config, &config->shared);
+        else
+            for (chc = config->channels; chc; chc = chc->next)
+                if (chc->worker == worker && chc->backend == BACKEND_RAW)
+                    channel_emit_done(config, chc);
+        egress_flush(&worker->egress);
+
+        if (ready)
+        {
+            uring_post_poll(uring, worker->epoll_fd);
+            return epoll_wait(worker->epoll_fd, events, max, 0);
+        }
+    }
+}
+#endif
+
+int channel_close(daemon_config_t *config, channel_t *chc)
+{
+    log_limit_free(&chc->rx_log);
+
+    /* .. channels served by the shared socket have no socket of their own */
+    if (chc->raw_socket)
+    {
+        /* .. stop watching the fd */
+        epoll_ctl(chc->worker->epoll_fd, EPOLL_CTL_DEL, chc->raw_socket, NULL);
+
+        /* close and destroy CAN Socket */
+        if (close(chc->raw_socket) < 0)
+        {
+            daemon_log(LOG_ERR, "Error closing socket for '%s'. %m.", chc->interface_name);
+            return -1;
+        }
+        chc->raw_socket = 0;
+    }
+
+    /* .. release reception buffers */
+    rx_batch_free(&chc->rx);
+    channel_close_ring(chc);
+    free(chc->aggregate);
+    chc->aggregate = NULL;
+    id_filter_set_free(chc->filters);
+    chc->filters = NULL;
+
+    snapshot_free(chc->snapshot);
+    chc->snapshot = NULL;
+
+    if (chc->recorder)
+    {
+        daemon_log(LOG_INFO, "%llu frames of '%s' recorded, %llu lost.", (unsigned long long)stats_get(&chc->stats.rx.recorded),
+                   chc->interface_name, (unsigned long long)stats_get(&chc->stats.rx.record_drops));
+        recorder_free(chc->recorder);
+        chc->recorder = NULL;
+    }
+
+    if (chc->changes)
+    {
+        daemon_log(LOG_INFO, "%lu unchanged frames of '%s' suppressed.", chc->changes->suppressed, chc->interface_name);
+        change_cache_free(chc->changes);
+        chc->changes = NULL;
+    }
+
+    /* .. free strings */
+    free((void *)chc->interface_name);
+    chc->interface_name = NULL;
+
+    return 0;
+}
+
+/*
+ * Socket
+ */
+
+/* .. set up AF_XDP sockets, packets are sent through the UDP stack where it is not possible */
+void socket_init_xdp(daemon_config_t *config)
+{
+    int queue = config->xdp_queue, i;
+    channel_t *chc;
+
+    if (!config->interface)
+    {
+        daemon_log(LOG_WARNING, "AF_XDP needs the interface to be set. Using UDP sockets.");
+        return;
+    }
+
+    for (i = 0; i < config->destinations_count; i++)
+    {
+        destination_t *dest = &config->destinations[i];
+
+        /* .. only IPv4 frames are built, IPv6 destinations were reported by the parser */
+        if (dest->addr.ss_family != AF_INET)
+            continue;
+
+        if (!(dest->xdp = xdp_resolve(dest, config->interface) == 0))
+            daemon_log(LOG_WARNING, "No link layer address of destination %d on '%s' in /proc/net/arp. Using UDP socket for it.", i, config->interface);
+    }
+
+    for (chc = config->channels; chc; chc = chc->next)
+    {
+        egress_t *eg = chc->egress;
+        xdp_socket_t *xsk;
+
+        /* .. the queue has its socket already or sends through io_uring */
+        if (!eg || eg->flush)
+            continue;
+
+        if (!(xsk = malloc(sizeof(*xsk))))
+        {
+            daemon_log(LOG_ERR, "Out of memory");
+            return;
+        }
+
+        if (xdp_open(xsk, config->interface, queue++, config->xdp_frames, config->xdp_zerocopy, config->port) < 0)
+        {
+            xdp_close(xsk);
+            free(xsk);
+            continue;
+        }
+
+        eg->flush = egress_flush_xdp;
+        eg->backend = xsk;
+    }
+}
+
+int socket_init(daemon_config_t *config)
+{
+    int i;
+
+    for (i = 0; i < config->destinations_count; i++)
+        if (destination_open(&config->destinations[i], config->gso) < 0)
+            return -1;
+
+    /* .. init queues of outgoing packets of all workers */
+    size_t slot_size = config->mtu > (int)sizeof(can2udp_packet_t) ? (size_t)config->mtu : sizeof(can2udp_packet_t);
+    worker_t *worker;
+
+    if (egress_init(&config->main_worker.egress, config->send_batch_size, slot_size,
+                    config->destinations, config->destinations_count) < 0)
+        return -1;
+
+    for (worker = config->workers; worker; worker = worker->next)
+        if (worker->channels && egress_init(&worker->egress, config->send_batch_size, slot_size,
+                                            config->destinations, config->destinations_count) < 0)
+            return -1;
+
+    if (config->egress_thread && egress_init(&config->egress_worker.egress, config->send_batch_size, slot_size,
+                                             config->destinations, config->destinations_count) < 0)
+        return -1;
+
+#ifdef CAN2UDP_IO_URING
+    /* .. the egress thread keeps sendmmsg(), workers send through their rings */
+    if (config->io_uring)
+    {
+        config->main_worker.egress.flush = egress_flush_uring;
+        config->main_worker.egress.backend = &config->main_worker.uring;
+        for (worker = config->workers; worker; worker = worker->next)
+        {
+            worker->egress.flush = egress_flush_uring;
+            worker->egress.backend = &worker->uring;
         }
     }
+#endif
 
-    /* .. release */
-    config_destroy(&cf);
+    /* .. every other queue channels send through gets an AF_XDP socket on a queue of its own */
+    if (config->xdp)
+        socket_init_xdp(config);
+
+    return 0;
+}
+
+int socket_close(daemon_config_t *config)
+{
+    /* .. release queues of outgoing packets */
+    worker_t *worker;
+    egress_close(&config->main_worker.egress);
+    for (worker = config->workers; worker; worker = worker->next)
+        egress_close(&worker->egress);
+    egress_close(&config->egress_worker.egress);
+
+    /* close and destroy sockets */
+    int i;
+    for (i = 0; i < config->destinations_count; i++)
+        destination_close(&config->destinations[i]);
 
     return 0;
 }
 
 /*
- * SocketCAN channel handling
+ * Worker threads
  */
-int channel_init(channel_t *chc, fd_set *fds)
-{
-    struct ifreq ifr;
-    struct sockaddr_can addr;
-    size_t j;
-    int use_canfd = 1;
 
-    /* .. create the socket */
-    if ((chc->raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+int worker_init(worker_t *worker)
+{
+    if ((worker->epoll_fd = epoll_create1(0)) < 0)
     {
-        daemon_log(LOG_WARNING, "CAN socket error: %m");
-        goto error;
+        daemon_log(LOG_ERR, "Error creating epoll instance. %m");
+        return -1;
     }
 
-    /* .. obtain CAN channel index */
-    strcpy(ifr.ifr_name, chc->interface_name);
-    if (ioctl(chc->raw_socket, SIOCGIFINDEX, &ifr) < 0)
+    return 0;
+}
+
+int system_check_channels_and_process(daemon_config_t *config, worker_t *worker, struct epoll_event *events, int count);
+
+/* .. apply CPU affinity and real-time priority to the calling thread */
+void worker_set_scheduling(worker_t *worker)
+{
+    if (worker->cpu >= 0)
     {
-        daemon_log(LOG_WARNING, "CAN socket name set failed for '%s': %m", chc->interface_name);
-        goto error;
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            daemon_log(LOG_WARNING, "Cannot pin worker %d to CPU %d.", worker->id, worker->cpu);
     }
 
-    /*.. set non-blocking */
-    if (fcntl(chc->raw_socket, F_SETFL, O_NONBLOCK)< 0)
+    if (worker->priority > 0)
     {
-        daemon_log(LOG_WARNING, "Error setting nonblock for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+        struct sched_param param = { .sched_priority = worker->priority };
+
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+            daemon_log(LOG_WARNING, "Cannot set SCHED_FIFO priority %d for worker %d.", worker->priority, worker->id);
     }
+}
 
-    if (chc->filters)
-    {
-        size_t len = chc->filters_length;
-        if (len > CAN_RAW_FILTER_MAX)
-        {
-            daemon_log(LOG_WARNING, "Limiting the number of filters to %d for CAN socket '%s'. Ignoring: %m", CAN_RAW_FILTER_MAX, chc->interface_name);
-            len = CAN_RAW_FILTER_MAX;
-        }
+/* .. wait for events of the worker. With io_uring frames are processed while waiting */
+int worker_wait(worker_t *worker, struct epoll_event *events, int max)
+{
+#ifdef CAN2UDP_IO_URING
+    if (worker->config->io_uring)
+        return uring_wait(worker, events, max);
+#endif
 
-        struct can_filter *rfilter = malloc(sizeof(struct can_filter) * len);
+    return epoll_wait(worker->epoll_fd, events, max, worker->config->latency.busy_wait ? 0 : -1);
+}
 
-        /*.. filter messages only in case they are needed */
-        for (j = 0; j < len; j++)
-        {
-            rfilter[j].can_mask = chc->filters[j] > CAN_SFF_MASK ? CAN_EFF_MASK : CAN_EFF_MASK;
-            rfilter[j].can_id = chc->filters[j];
-        }
+void *worker_run(void *arg)
+{
+    worker_t *worker = arg;
+
+    worker_set_scheduling(worker);
+
+    if (worker->config->latency.enabled && worker->config->latency.prefault)
+        latency_prefault_stack();
 
-        if (setsockopt(chc->raw_socket, SOL_CAN_RAW, CAN_RAW_FILTER, rfilter, sizeof(struct can_filter) * len) < 0)
+    for (;;)
+    {
+        struct epoll_event events[CAN2UDP_MAX_EVENTS];
+        int i, ret;
+
+        if ((ret = worker_wait(worker, events, CAN2UDP_MAX_EVENTS)) < 0)
         {
-            daemon_log(LOG_WARNING, "Error setting filters for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+            if (errno == EINTR)
+                continue;
+
+            daemon_log(LOG_ERR, "epoll_wait() in worker %d: %s", worker->id, strerror(errno));
+            break;
         }
 
-        free(rfilter);
+        /* .. the stop request is told apart by NULL channel */
+        for (i = 0; i < ret; i++)
+            if (!events[i].data.ptr)
+                return NULL;
+
+        system_check_channels_and_process(worker->config, worker, events, ret);
     }
 
-    /* .. connect the socket to the channel */
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-    if (bind(chc->raw_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-    {
-        daemon_log(LOG_WARNING, "CAN socket bind failed for '%s': %m", chc->interface_name);
+    return NULL;
+}
 
-        goto error;
-    }
+int worker_start(worker_t *worker)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    int err;
 
-    /*.. try to enable CAN FD. Ignore errors. */
-    if (setsockopt(chc->raw_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
-                   &use_canfd, sizeof(use_canfd)) < 0)
+    if ((worker->stop_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->stop_fd, &ev) < 0)
     {
-        daemon_log(LOG_WARNING, "Error enabling CAN FD frames for CAN socket '%s'. Ignoring: %m", chc->interface_name);
-        chc->can_fd_enabled = 0;
+        daemon_log(LOG_ERR, "Error creating stop event for worker %d. %m", worker->id);
+        return -1;
     }
 
-    /* .. add fd to the list for select() call */
-    FD_SET(chc->raw_socket, fds);
+    if ((err = thread_create(&worker->thread, worker_run, worker)) != 0)
+    {
+        daemon_log(LOG_ERR, "Error starting worker %d: %s", worker->id, strerror(err));
+        return -1;
+    }
+    worker->running = 1;
 
     return 0;
-
-error:
-    if (chc->raw_socket)
-        close(chc->raw_socket);
-    chc->raw_socket = 0;
-
-    return -1;
 }
 
-int channel_send_frame(daemon_config_t *config, channel_t *chc, struct canfd_frame *frame, unsigned long timestamp)
+void worker_stop(worker_t *worker)
 {
-    /* .. init default data */
-    can2udp_packet_t packet = {
-        .version = CAN2UDP_PACKET_VERSION,
-        .flags = 0,
-        .interface_id = (uint16_t)chc->udp_interface_index,
-        .timestamp = timestamp
-    };
+    uint64_t one = 1;
 
-    /* copy CAN packet */
-    if (frame)
-        memcpy(&packet.raw_frame, frame, sizeof(*frame));
+    if (!worker->running)
+        return;
 
-    /* .. send the packet out */
-    int err;
-    if ((err = sendto(config->socket_broadcast,
-                      &packet, sizeof(packet),
-                      0,
-                      (struct sockaddr *)&config->baddr, sizeof(config->baddr))
-         != sizeof(packet)))
-        daemon_log(LOG_WARNING, "Error sending data to UDP socket. Data loss occured. %d, %m", err);
+    if (write(worker->stop_fd, &one, sizeof(one)) != sizeof(one))
+        daemon_log(LOG_WARNING, "Error stopping worker %d. %m", worker->id);
 
-    return 0;
+    pthread_join(worker->thread, NULL);
+    worker->running = 0;
 }
 
-unsigned long tiemval_to_ns(struct timeval tv)
+void worker_close(worker_t *worker)
 {
-    return ((tv.tv_sec * 1000000ul + tv.tv_usec) * 1000ul);
-}
+    if (worker->stop_fd >= 0)
+        close(worker->stop_fd);
+    worker->stop_fd = -1;
 
-static unsigned long pkt_count = 0;
+    if (worker->epoll_fd >= 0)
+        close(worker->epoll_fd);
+    worker->epoll_fd = -1;
+}
 
-int channel_process(daemon_config_t *config, channel_t *chc)
+/* .. set up the main worker and distribute channels between worker threads */
+int workers_init(daemon_config_t *config)
 {
-    /*.. FIXME the size of the array can be used for tuning performance */
-    struct canfd_frame frame;
-    int ret = 0;
+    int auto_id = -1;
+    channel_t *chc;
+    worker_t *worker;
 
-    /* .. try reading new BCM message */
-    ssize_t nbytes = read(chc->raw_socket, &frame, chc->can_fd_enabled ? CANFD_MTU : CAN_MTU);
-    if ((nbytes == 0) || (nbytes == -EINTR))
-        return -EINTR;
-    else if ( nbytes != CAN_MTU && nbytes != CANFD_MTU )
+    config->main_worker.config = config;
+    config->main_worker.stop_fd = -1;
+    if (worker_init(&config->main_worker) < 0)
+        return -1;
+
+    /* .. the shared socket is a single channel, there is nothing to distribute */
+    if (config->threaded && config->shared_socket)
     {
-        daemon_log(LOG_WARNING, "Error reading data from RAW socket for '%s'. Unexpected size %zd.", chc->interface_name, nbytes);
-        return -EINVAL;
+        daemon_log(LOG_WARNING, "Threaded mode is not used with the shared socket.");
+        config->threaded = 0;
     }
 
-    struct timeval tv;
-    if (ioctl(chc->raw_socket, SIOCGSTAMP, &tv) < 0)
+    for (chc = config->channels; chc; chc = chc->next)
     {
-        daemon_log(LOG_DEBUG, "Error reading timestamp from RAW socket for '%s'.", chc->interface_name);
-        memset(&tv, 0, sizeof(tv));
+        chc->worker = &config->main_worker;
+        chc->egress = config->egress_thread ? &config->egress_worker.egress : &config->main_worker.egress;
+        if (!config->threaded)
+            continue;
+
+        /* .. channels with the same worker id share a thread */
+        worker = NULL;
+        if (chc->worker_id >= 0)
+            for (worker = config->workers; worker && worker->id != chc->worker_id; worker = worker->next)
+                ;
+
+        /* .. otherwise the channel gets a dedicated thread with default settings */
+        if (!worker)
+        {
+            if (!(worker = calloc(1, sizeof(*worker))))
+            {
+                daemon_log(LOG_ERR, "Out of memory");
+                return -1;
+            }
+
+            worker->id = chc->worker_id >= 0 ? chc->worker_id : auto_id--;
+            worker->cpu = -1;
+            worker->epoll_fd = -1;
+            worker->stop_fd = -1;
+            worker->config = config;
+            worker->next = config->workers;
+            config->workers = worker;
+        }
+
+        if (worker->epoll_fd < 0 && worker_init(worker) < 0)
+            return -1;
+
+        worker->channels++;
+        chc->worker = worker;
+        if (!config->egress_thread)
+            chc->egress = &worker->egress;
     }
 
-    /* .. process all received messages */
-    ret = channel_send_frame(config, chc, &frame, tiemval_to_ns(tv));
+#ifdef CAN2UDP_IO_URING
+    /* .. every thread has a ring of its own */
+    if (config->io_uring)
+    {
+        if (uring_init(config, &config->main_worker) < 0)
+            return -1;
 
-    daemon_log(LOG_DEBUG, "processed %lu packets", ++pkt_count);
+        for (worker = config->workers; worker; worker = worker->next)
+            if (worker->channels && uring_init(config, worker) < 0)
+                return -1;
+    }
+#endif
 
-    return ret;
+    return 0;
 }
 
-int channel_is_ready(channel_t *chc, fd_set *fds)
+/*
+ * Egress stage
+ */
+
+/* .. send all frames waiting in the queue of the worker. Returns the number of frames */
+unsigned int egress_stage_drain_queue(daemon_config_t *config, frame_queue_t *queue)
 {
-    return FD_ISSET(chc->raw_socket, fds);
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = queue->tail;
+    unsigned int count = head - tail;
+
+    for (; tail != head; tail++)
+    {
+        queued_frame_t *entry = &queue->entries[tail & queue->mask];
+        channel_send_frame(config, entry->chc, &entry->frame, entry->timestamp);
+    }
+
+    /* .. release entries to the producer */
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+
+    return count;
 }
 
-int channel_close(channel_t *chc, fd_set *fds)
+/* .. send frames of all workers. Returns the number of frames */
+unsigned int egress_stage_drain(daemon_config_t *config)
 {
-    /* .. add fd to the list for select() call */
-    FD_CLR(chc->raw_socket, fds);
+    unsigned int count;
+    worker_t *worker;
+    channel_t *chc;
+
+    count = egress_stage_drain_queue(config, &config->main_worker.queue);
+    for (worker = config->workers; worker; worker = worker->next)
+        if (worker->channels)
+            count += egress_stage_drain_queue(config, &worker->queue);
 
-    /* close and destroy CAN Socket */
-    if (close(chc->raw_socket) < 0)
+    if (count)
     {
-        daemon_log(LOG_ERR, "Error closing socket for '%s'. %m.", chc->interface_name);
-        return -1;
+        for (chc = config->channels; chc; chc = chc->next)
+            channel_flush_aggregate(config, chc);
+        egress_flush(&config->egress_worker.egress);
     }
-    chc->raw_socket = 0;
 
-    /* .. free strings */
-    free((void *)chc->interface_name);
-    chc->interface_name = NULL;
+    return count;
+}
+
+int egress_stage_pending(daemon_config_t *config)
+{
+    worker_t *worker;
+
+    if (frame_queue_pending(&config->main_worker.queue))
+        return 1;
+
+    for (worker = config->workers; worker; worker = worker->next)
+        if (worker->channels && frame_queue_pending(&worker->queue))
+            return 1;
 
     return 0;
 }
 
-/*
- * Socket
- */
+void *egress_stage_run(void *arg)
+{
+    worker_t *stage = arg;
+    daemon_config_t *config = stage->config;
+    uint64_t events;
 
-int socket_init(daemon_config_t *config)
+    worker_set_scheduling(stage);
+
+    while (!__atomic_load_n(&stage->quit, __ATOMIC_ACQUIRE))
+    {
+        if (egress_stage_drain(config))
+            continue;
+
+        /* .. announce we are going to sleep, then check again to not miss a frame queued meanwhile */
+        __atomic_store_n(&config->egress_sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (egress_stage_pending(config))
+        {
+            __atomic_store_n(&config->egress_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (read(stage->stop_fd, &events, sizeof(events)) < 0 && errno != EINTR)
+        {
+            daemon_log(LOG_ERR, "Error waiting for frames in the egress thread. %m");
+            break;
+        }
+    }
+
+    /* .. send out whatever is left */
+    egress_stage_drain(config);
+
+    return NULL;
+}
+
+/* .. create frame queues of ingest workers and start the egress thread */
+int egress_stage_init(daemon_config_t *config)
 {
-    const int yes = 1;
+    worker_t *stage = &config->egress_worker;
+    worker_t *worker;
+    int err;
+
+    if (frame_queue_init(&config->main_worker.queue, config->queue_depth) < 0)
+        return -1;
+
+    for (worker = config->workers; worker; worker = worker->next)
+        if (worker->channels && frame_queue_init(&worker->queue, config->queue_depth) < 0)
+            return -1;
 
-    if((config->socket_broadcast = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    stage->id = -1;
+    stage->config = config;
+    if ((stage->stop_fd = eventfd(0, 0)) < 0)
     {
-        daemon_log(LOG_ERR, "Error creating UDP socket %m.");
+        daemon_log(LOG_ERR, "Error creating wakeup event of the egress thread. %m");
         return -1;
     }
 
-    /* .. make the socket broadcast */
-    if (setsockopt(config->socket_broadcast, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes)) < 0)
+    if ((err = thread_create(&stage->thread, egress_stage_run, stage)) != 0)
     {
-        daemon_log(LOG_ERR, "Error setting UDP socket broadcast. %m");
+        daemon_log(LOG_ERR, "Error starting the egress thread: %s", strerror(err));
         return -1;
     }
+    stage->running = 1;
 
-    /* .. bind the socket to an interface if required */
-    if (config->interface)
-        if (setsockopt(config->socket_broadcast, SOL_SOCKET, SO_BINDTODEVICE, config->interface, strlen(config->interface)) < 0)
-        {
-            daemon_log(LOG_WARNING, "Cannot bind UDP socket to '%s'. Packets will be sent on all interfaces. %m", config->interface);
-        }
+    return 0;
+}
+
+void egress_stage_close(daemon_config_t *config)
+{
+    worker_t *stage = &config->egress_worker;
+    worker_t *worker;
+    uint64_t one = 1;
 
-    /* .. initialize broadcast address */
-    bzero(&config->baddr, sizeof(config->baddr));
-    config->baddr.sin_family = AF_INET;
-    config->baddr.sin_port = htons(config->port);
-    config->baddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    if (stage->running)
+    {
+        __atomic_store_n(&stage->quit, 1, __ATOMIC_RELEASE);
+        if (write(stage->stop_fd, &one, sizeof(one)) != sizeof(one))
+            daemon_log(LOG_WARNING, "Error stopping the egress thread. %m");
 
-    return 0;
+        pthread_join(stage->thread, NULL);
+        stage->running = 0;
+    }
+
+    if (stage->stop_fd >= 0)
+        close(stage->stop_fd);
+    stage->stop_fd = -1;
+
+    /* .. report and release queues */
+    if (config->main_worker.queue.drops)
+        daemon_log(LOG_WARNING, "%llu frames dropped on queue overflow.", (unsigned long long)config->main_worker.queue.drops);
+    frame_queue_free(&config->main_worker.queue);
+
+    for (worker = config->workers; worker; worker = worker->next)
+    {
+        if (worker->queue.drops)
+            daemon_log(LOG_WARNING, "%llu frames dropped on queue overflow in worker %d.", (unsigned long long)worker->queue.drops, worker->id);
+        frame_queue_free(&worker->queue);
+    }
 }
 
-int socket_close(daemon_config_t *config)
+/*
+ * Statistics socket
+ */
+
+/* .. write counters of a channel as a JSON object */
+void stats_write_channel(FILE *out, channel_t *chc)
+{
+    channel_stats_t *st = &chc->stats;
+
+    fprintf(out, "{\"interface\":\"%s\",\"index\":%d,\"frames\":%llu,\"filtered\":%llu,\"unchanged\":%llu,"
+            "\"overflows\":%llu,\"recorded\":%llu,\"record_drops\":%llu,\"packets\":%llu,\"bytes\":%llu}",
+            chc->interface_name, chc->udp_interface_index,
+            (unsigned long long)stats_get(&st->rx.frames),
+            (unsigned long long)stats_get(&st->rx.filtered),
+            (unsigned long long)stats_get(&st->rx.unchanged),
+            (unsigned long long)stats_get(&st->rx.overflows),
+            (unsigned long long)stats_get(&st->rx.recorded),
+            (unsigned long long)stats_get(&st->rx.record_drops),
+            (unsigned long long)stats_get(&st->tx.packets),
+            (unsigned long long)stats_get(&st->tx.bytes));
+}
+
+/* .. write counters of an event loop as a JSON object */
+void stats_write_worker(FILE *out, const char *name, worker_t *worker)
 {
-    /* close and destroy the socket */
-    if (close(config->socket_broadcast) < 0)
+    fprintf(out, "{\"name\":\"%s\",\"id\":%d,\"send_errors\":%llu,\"queue_drops\":%llu",
+            name, worker->id,
+            (unsigned long long)stats_get(&worker->egress.send_errors),
+            (unsigned long long)stats_get(&worker->queue.drops));
+
+    /* .. packets of the AF_XDP socket of the queue */
+    if (worker->egress.flush == egress_flush_xdp)
     {
-        daemon_log(LOG_ERR, "Error closing UDP socket fd. %m.");
-        return -1;
+        xdp_socket_t *xsk = worker->egress.backend;
+
+        fprintf(out, ",\"xdp_submitted\":%llu,\"xdp_completed\":%llu,\"xdp_dropped\":%llu",
+                (unsigned long long)stats_get(&xsk->submitted),
+                (unsigned long long)stats_get(&xsk->completed),
+                (unsigned long long)stats_get(&xsk->dropped));
     }
-    config->socket_broadcast = 0;
+    fputc('}', out);
+}
 
-    return 0;
+/* .. build a snapshot of all counters. Returns its length, the buffer must be freed */
+size_t stats_snapshot(void *context, char **buffer)
+{
+    daemon_config_t *config = context;
+    size_t length = 0;
+    channel_t *chc;
+    worker_t *worker;
+    FILE *out;
+
+    if (!(out = open_memstream(buffer, &length)))
+        return 0;
+
+    fprintf(out, "{\"daemon\":\"can2udp\",\"uptime\":%.3f,\"channels\":[", stats_server_uptime(&config->stats));
+
+    for (chc = config->channels; chc; chc = chc->next)
+    {
+        stats_write_channel(out, chc);
+        if (chc->next)
+            fputc(',', out);
+    }
+    fputc(']', out);
+
+    /* .. frames of unknown interfaces and kernel drops of the shared socket */
+    if (config->shared_socket && config->shared.interface_name)
+    {
+        fputs(",\"shared\":", out);
+        stats_write_channel(out, &config->shared);
+    }
+
+    fputs(",\"workers\":[", out);
+    stats_write_worker(out, "main", &config->main_worker);
+    for (worker = config->workers; worker; worker = worker->next)
+    {
+        fputc(',', out);
+        stats_write_worker(out, "worker", worker);
+    }
+    if (config->egress_thread)
+    {
+        fputc(',', out);
+        stats_write_worker(out, "egress", &config->egress_worker);
+    }
+    fputs("]}\n", out);
+
+    fclose(out);
+
+    return length;
 }
 
 /*
  * System integration functions.
  */
 
-int system_init(daemon_config_t *config, fd_set *fds, const char* config_file_name)
+int system_init(daemon_config_t *config, const char* config_file_name)
 {
     if (parse_config(config, config_file_name) < 0)
         return -1;
 
+    /* .. create event loops */
+    if (workers_init(config) < 0)
+        return -1;
+
     /* .. init all SocketCAN channels */
     int good_channels = 0;
     channel_t *chc = config->channels;
@@ -479,7 +4766,7 @@ int system_init(daemon_config_t *config, fd_set *fds, const char* config_file_na
     while (chc)
     {
         /* .. try to initialize channel */
-        if (channel_init(chc, fds) == 0)
+        if (channel_init(config, chc) == 0)
             good_channels++;
 
         /* .. go to the next item in the list */
@@ -494,40 +4781,121 @@ int system_init(daemon_config_t *config, fd_set *fds, const char* config_file_na
         return -ENODATA;
     }
 
+    /* .. open the socket for all channels */
+    if (config->shared_socket && shared_init(config) < 0)
+        return -1;
+
+    /* .. segments are prepared ahead of rotation by a thread of their own */
+    if (config->recording.path && recorder_stage_init(config) < 0)
+        return -1;
+
     /* .. init UDP socket for broadcasting */
-    socket_init(config);
+    if (socket_init(config) < 0)
+        return -1;
+
+    /* .. start the egress stage before any frame is queued */
+    if (config->egress_thread && egress_stage_init(config) < 0)
+        return -1;
+
+    /* .. statistics are optional, the daemon works without them */
+    stats_server_init(&config->stats, stats_snapshot, config);
+
+    /* .. pending warnings are reported even if the bus is idle */
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &config->log_timer };
+    if ((config->log_timer.fd = log_timer_open()) < 0 ||
+        epoll_ctl(config->main_worker.epoll_fd, EPOLL_CTL_ADD, config->log_timer.fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot watch the timer of warning reports. %m");
+        return -1;
+    }
+
+    /* .. start threads of workers serving channels */
+    worker_t *worker;
+    for (worker = config->workers; worker; worker = worker->next)
+        if (worker->channels && worker_start(worker) < 0)
+        {
+            /* .. do not leave workers started so far running */
+            for (worker = config->workers; worker; worker = worker->next)
+                worker_stop(worker);
+            return -1;
+        }
 
     return 0;
 }
 
-int system_check_channels_and_process(daemon_config_t *config, fd_set *fds)
+int system_check_channels_and_process(daemon_config_t *config, worker_t *worker, struct epoll_event *events, int count)
 {
-    /* .. init all channels */
-    int procesed_channels = 0;
-    channel_t *chc = config->channels;
+    int i;
 
-    /* .. loop through all elements */
-    while (chc)
+    /* .. dispatch only channels which are ready */
+    for (i = 0; i < count; i++)
     {
-        /* .. try to initialize channel */
-        if (channel_is_ready(chc, fds))
+        channel_t *chc = events[i].data.ptr;
+
+        /* .. signals are handled by the caller */
+        if (!chc)
+            continue;
+
+        /* .. publishing timer of a snapshot */
+        if (chc->source == SOURCE_SNAPSHOT)
         {
-            int err;
-            if ((err = channel_process(config, chc)) != 0)
-                daemon_log(LOG_WARNING, "Error processing channel '%s'. Error %d", chc->interface_name, err);
+            snapshot_publish(config, events[i].data.ptr);
+            continue;
+        }
 
-            procesed_channels ++;
+        /* .. heartbeat timer of send on change */
+        if (chc->source == SOURCE_HEARTBEAT)
+        {
+            change_cache_heartbeat(config, events[i].data.ptr);
+            continue;
         }
 
-        /* .. go to the next item in the list */
-        chc = chc->next;
+        /* .. report of aggregated warnings */
+        if (chc->source == SOURCE_LOG)
+        {
+            log_timer_process(config->log_timer.fd);
+            continue;
+        }
+
+        int err;
+        if ((err = channel_process(config, chc)) != 0)
+            debug_log("Error processing channel '%s'. Error %d", chc->interface_name, err);
     }
 
+    /* .. send out all packets produced in this iteration */
+    egress_flush(&worker->egress);
+
     return 0;
 }
 
-void system_close(daemon_config_t *config, fd_set *fds)
+void system_close(daemon_config_t *config)
 {
+    worker_t *worker;
+
+    /* .. stop worker threads before anything they use is released */
+    for (worker = config->workers; worker; worker = worker->next)
+        worker_stop(worker);
+
+    stats_server_close(&config->stats);
+
+    if (config->log_timer.fd >= 0)
+        close(config->log_timer.fd);
+    config->log_timer.fd = -1;
+
+    /* .. let the egress stage send the rest of frames */
+    if (config->egress_thread)
+        egress_stage_close(config);
+
+    /* .. recorders are released with their channels */
+    recorder_stage_close(config);
+
+#ifdef CAN2UDP_IO_URING
+    /* .. outstanding receptions point to buffers of channels */
+    uring_close(&config->main_worker.uring);
+    for (worker = config->workers; worker; worker = worker->next)
+        uring_close(&worker->uring);
+#endif
+
     /* .. close the socket first */
     socket_close(config);
 
@@ -536,7 +4904,7 @@ void system_close(daemon_config_t *config, fd_set *fds)
     while (chc)
     {
         /* .. try to close the channel */
-        if (channel_close(chc, fds) != 0)
+        if (channel_close(config, chc) != 0)
             daemon_log(LOG_WARNING, "Error closing channel '%s'", chc->interface_name);
 
         /* .. free this element and go to the next in list */
@@ -545,12 +4913,63 @@ void system_close(daemon_config_t *config, fd_set *fds)
         chc = next;
     }
 
+    /* .. close the shared socket */
+    if (config->shared_socket && config->shared.interface_name)
+        channel_close(config, &config->shared);
+    free(config->ifindex_map);
+    config->ifindex_map = NULL;
+
+    /* .. close event loops */
+    worker_close(&config->main_worker);
+    while ((worker = config->workers))
+    {
+        config->workers = worker->next;
+        worker_close(worker);
+        free(worker);
+    }
+
     /* .. free strings */
     if (config->interface)
     {
         free((void *)config->interface);
         config->interface = NULL;
     }
+    free((void *)config->recording.path);
+    config->recording.path = NULL;
+}
+
+/* .. apply the low-latency profile to the initialized system, the main thread runs the event loop */
+int system_apply_latency_profile(daemon_config_t *config)
+{
+    latency_t *latency = &config->latency;
+    channel_t *chc;
+    int i;
+
+    if (!latency->enabled)
+        return 0;
+
+    if (latency->busy_poll > 0)
+    {
+        /* .. channels of the shared socket and failed ones have no socket of their own */
+        for (chc = config->channels; chc; chc = chc->next)
+            if (chc->raw_socket)
+                socket_set_busy_poll(chc->raw_socket, latency->busy_poll, chc->interface_name);
+
+        if (config->shared_socket && config->shared.raw_socket)
+            socket_set_busy_poll(config->shared.raw_socket, latency->busy_poll, "shared CAN socket");
+
+        for (i = 0; i < config->destinations_count; i++)
+            socket_set_busy_poll(config->destinations[i].fd, latency->busy_poll, "UDP socket");
+    }
+
+    worker_set_scheduling(&config->main_worker);
+    latency_apply_memory(latency);
+
+    daemon_log(LOG_INFO, "Latency profile applied: busy poll %d us, %s, main loop on CPU %d with priority %d.",
+               latency->busy_poll, latency->busy_wait ? "busy wait" : "blocking wait",
+               config->main_worker.cpu, config->main_worker.priority);
+
+    return 0;
 }
 
 /*
@@ -577,7 +4996,6 @@ int main(int argc, char **argv)
     pid_t pid;
     int run_daemon = 1;
     int verbosity = 0;
-    fd_set fds;
     int quit = 0;
     daemon_config_t config;
     const char* config_file_name = CAN2UDP_DEFAULT_CONFIG_FILENAME;
@@ -675,11 +5093,12 @@ int main(int argc, char **argv)
         run_or_retval(daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, 0), 9);
 
         /*.. init subsystems*/
-        FD_ZERO(&fds);
-        run_or_retval(system_init(&config, &fds, config_file_name), 10);
+        run_or_retval(system_init(&config, config_file_name), 10);
+        run_or_retval(system_apply_latency_profile(&config), 10);
 
-        /* add dameon signal fd to select() list */
-        FD_SET(daemon_signal_fd(), &fds);
+        /* add dameon signal fd to the epoll set, it is told apart by NULL channel */
+        struct epoll_event sev = { .events = EPOLLIN, .data.ptr = NULL };
+        run_or_retval(epoll_ctl(config.main_worker.epoll_fd, EPOLL_CTL_ADD, daemon_signal_fd(), &sev), 10);
 
         /* Send our status to parent process */
         if (run_daemon)
@@ -688,21 +5107,26 @@ int main(int argc, char **argv)
 
         while (!quit)
         {
-            fd_set fds2 = fds;
+            struct epoll_event events[CAN2UDP_MAX_EVENTS];
+            int i;
 
-            /* Wait for an incoming signal */
-            int ret = select(FD_SETSIZE, &fds2, 0, 0, 0);
+            /* Wait for an incoming signal or data */
+            int ret = worker_wait(&config.main_worker, events, CAN2UDP_MAX_EVENTS);
 
-            if (ret == -EINTR)
+            if (ret < 0 && errno == EINTR)
                 continue;
             else if (ret < 0)
             {
-                daemon_log(LOG_ERR, "select(): %s", strerror(errno));
+                daemon_log(LOG_ERR, "epoll_wait(): %s", strerror(errno));
                 break;
             }
 
             /*.. handle daemon signals */
-            if (FD_ISSET(daemon_signal_fd(), &fds2)) {
+            for (i = 0; i < ret; i++)
+            {
+                if (events[i].data.ptr)
+                    continue;
+
                 int sig;
                 run_or_retval((sig = daemon_signal_next()),  0);
 
@@ -723,12 +5147,12 @@ int main(int argc, char **argv)
                 }
             }
 
-            /*.. check all channels for readiness */
-            run_or_retval(system_check_channels_and_process(&config, &fds2), 0);
+            /*.. process channels which are ready */
+            run_or_retval(system_check_channels_and_process(&config, &config.main_worker, events, ret), 0);
         }
 
 close_and_finish:
-        system_close(&config, &fds);
+        system_close(&config);
 
 finish:
         daemon_log(LOG_INFO, "Terminating.");
@@ -0,0 +1,799 @@
+/*******************************************************************************
+ * common.c
+ *
+ * Code shared by the can2udp, iio2udp and udp2can daemons.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+/*
+ * Includes
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <libdaemon/daemon.h>
+
+#include "common.h"
+
+/*
+ * Rate-limited logging
+ */
+
+/* .. limits reported by the timer */
+static log_limit_t *log_limits;
+static pthread_mutex_t log_limits_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* .. log the occurrences since the previous report, if any */
+static void log_limit_report(log_limit_t *limit)
+{
+    unsigned long count = __atomic_exchange_n(&limit->count, 0, __ATOMIC_RELAXED);
+    int error = __atomic_load_n(&limit->error, __ATOMIC_RELAXED);
+
+    if (!count)
+        return;
+
+    if (limit->name)
+        daemon_log(LOG_WARNING, "%lu %s on '%s' since the last report. Last error: %s", count, limit->what, limit->name, strerror(error));
+    else
+        daemon_log(LOG_WARNING, "%lu %s since the last report. Last error: %s", count, limit->what, strerror(error));
+}
+
+void log_limit_init(log_limit_t *limit, const char *what, const char *name)
+{
+    limit->count = 0;
+    limit->error = 0;
+    limit->what = what;
+    limit->name = name;
+
+    pthread_mutex_lock(&log_limits_lock);
+    limit->next = log_limits;
+    log_limits = limit;
+    limit->registered = 1;
+    pthread_mutex_unlock(&log_limits_lock);
+}
+
+void log_limit_free(log_limit_t *limit)
+{
+    log_limit_t **p;
+
+    if (!limit->registered)
+        return;
+
+    pthread_mutex_lock(&log_limits_lock);
+    for (p = &log_limits; *p; p = &(*p)->next)
+        if (*p == limit)
+        {
+            *p = limit->next;
+            break;
+        }
+    limit->registered = 0;
+    pthread_mutex_unlock(&log_limits_lock);
+
+    log_limit_report(limit);
+}
+
+void log_limit_report_all(void)
+{
+    log_limit_t *limit;
+
+    pthread_mutex_lock(&log_limits_lock);
+    for (limit = log_limits; limit; limit = limit->next)
+        log_limit_report(limit);
+    pthread_mutex_unlock(&log_limits_lock);
+}
+
+int log_timer_open(void)
+{
+    struct itimerspec timer = {
+        .it_interval = {
+            .tv_sec = X2UDP_LOG_INTERVAL_NS / 1000000000ull,
+            .tv_nsec = X2UDP_LOG_INTERVAL_NS % 1000000000ull,
+        },
+    };
+    int fd;
+
+    timer.it_value = timer.it_interval;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+        timerfd_settime(fd, 0, &timer, NULL) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot create the timer of warning reports. %m");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void log_timer_process(int fd)
+{
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        daemon_log(LOG_WARNING, "Error reading the timer of warning reports. %m");
+
+    log_limit_report_all();
+}
+
+/*
+ * Threads
+ */
+
+int thread_create(pthread_t *thread, void *(*run)(void *), void *arg)
+{
+    sigset_t signals, old;
+    int err;
+
+    /* .. the new thread inherits the mask, a signal cannot hit it before it could block them itself */
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+    err = pthread_create(thread, NULL, run, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return err;
+}
+
+/*
+ * UDP destinations
+ */
+
+int parse_destination(const config_setting_t *setting, destination_t *dest, int port, const char *interface)
+{
+    const char *address = NULL;
+    struct addrinfo *ai;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+    };
+    char service[16];
+
+    if (!config_setting_lookup_string(setting, "address", &address))
+        return -1;
+
+    memset(dest, 0, sizeof(*dest));
+    dest->fd = -1;
+    dest->ttl = -1;
+    dest->loopback = 0;
+    config_setting_lookup_int(setting, "port", &port);
+    config_setting_lookup_int(setting, "ttl", &dest->ttl);
+    config_setting_lookup_bool(setting, "loopback", &dest->loopback);
+    config_setting_lookup_string(setting, "interface", &interface);
+
+    /* .. next hop of packets sent with AF_XDP */
+    const char *mac = NULL;
+    dest->mac_set = 0;
+    if (config_setting_lookup_string(setting, "mac", &mac))
+    {
+        if (sscanf(mac, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &dest->mac[0], &dest->mac[1], &dest->mac[2],
+                   &dest->mac[3], &dest->mac[4], &dest->mac[5]) == ETH_ALEN)
+            dest->mac_set = 1;
+        else
+            daemon_log(LOG_WARNING, "Invalid MAC address '%s' of destination '%s'.", mac, address);
+    }
+
+    /* .. IPv4 and IPv6 addresses, IPv6 ones may carry a scope like 'fe80::1%eth0' */
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(address, service, &hints, &ai) != 0)
+    {
+        daemon_log(LOG_WARNING, "Invalid destination address '%s'.", address);
+        return -1;
+    }
+
+    memcpy(&dest->addr, ai->ai_addr, ai->ai_addrlen);
+    dest->addr_length = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    dest->interface = interface ? strdup(interface) : NULL;
+
+    return 0;
+}
+
+uint32_t parse_destinations(const config_setting_t *list, destination_t *destinations, int *count, int port, const char *interface)
+{
+    uint32_t mask = 0;
+    int j;
+
+    for (j = 0; list && j < config_setting_length(list); j++)
+    {
+        if (*count == X2UDP_MAX_DESTINATIONS)
+        {
+            daemon_log(LOG_WARNING, "Too many destinations, at most %d are supported.", X2UDP_MAX_DESTINATIONS);
+            break;
+        }
+
+        if (parse_destination(config_setting_get_elem(list, j), &destinations[*count], port, interface) < 0)
+        {
+            daemon_log(LOG_WARNING, "Ignoring invalid destination %d.", j);
+            continue;
+        }
+
+        mask |= 1u << (*count)++;
+    }
+
+    return mask;
+}
+
+void destination_broadcast(destination_t *dest, int port, const char *interface)
+{
+    struct sockaddr_in *baddr = (struct sockaddr_in *)&dest->addr;
+
+    memset(dest, 0, sizeof(*dest));
+    baddr->sin_family = AF_INET;
+    baddr->sin_port = htons(port);
+    baddr->sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    dest->addr_length = sizeof(*baddr);
+    dest->fd = -1;
+    dest->ttl = -1;
+    dest->interface = interface ? strdup(interface) : NULL;
+}
+
+int destination_open(destination_t *dest, int gso)
+{
+    const int yes = 1;
+    int loop = dest->loopback;
+    unsigned int ifindex = 0;
+
+    if ((dest->fd = socket(dest->addr.ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating UDP socket %m.");
+        return -1;
+    }
+
+    /* .. bind the socket to an interface if required */
+    if (dest->interface)
+    {
+        if (setsockopt(dest->fd, SOL_SOCKET, SO_BINDTODEVICE, dest->interface, strlen(dest->interface)) < 0)
+        {
+            daemon_log(LOG_WARNING, "Cannot bind UDP socket to '%s'. Packets will be sent on all interfaces. %m", dest->interface);
+        }
+        ifindex = if_nametoindex(dest->interface);
+    }
+
+    if (dest->addr.ss_family == AF_INET)
+    {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&dest->addr;
+
+        if (IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+        {
+            struct ip_mreqn mreq = { .imr_ifindex = ifindex };
+
+            if ((dest->ttl >= 0 && setsockopt(dest->fd, IPPROTO_IP, IP_MULTICAST_TTL, &dest->ttl, sizeof(dest->ttl)) < 0) ||
+                setsockopt(dest->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+                (ifindex && setsockopt(dest->fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0))
+                daemon_log(LOG_WARNING, "Error setting multicast options of UDP socket. %m");
+        }
+        else
+        {
+            /* .. unicast addresses do not mind, broadcast ones need it */
+            if (setsockopt(dest->fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes)) < 0)
+            {
+                daemon_log(LOG_ERR, "Error setting UDP socket broadcast. %m");
+                return -1;
+            }
+
+            if (dest->ttl >= 0 && setsockopt(dest->fd, IPPROTO_IP, IP_TTL, &dest->ttl, sizeof(dest->ttl)) < 0)
+                daemon_log(LOG_WARNING, "Error setting TTL of UDP socket. %m");
+        }
+    }
+    else
+    {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&dest->addr;
+
+        if (IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+        {
+            if ((dest->ttl >= 0 && setsockopt(dest->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &dest->ttl, sizeof(dest->ttl)) < 0) ||
+                setsockopt(dest->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)) < 0 ||
+                (ifindex && setsockopt(dest->fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0))
+                daemon_log(LOG_WARNING, "Error setting multicast options of UDP socket. %m");
+        }
+        else if (dest->ttl >= 0 && setsockopt(dest->fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &dest->ttl, sizeof(dest->ttl)) < 0)
+            daemon_log(LOG_WARNING, "Error setting hop limit of UDP socket. %m");
+    }
+
+    /* .. probe segmentation offload, a zero segment size leaves single packets unchanged */
+    dest->gso = 0;
+    if (gso)
+    {
+        int segment = 0;
+
+        if (setsockopt(dest->fd, IPPROTO_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0)
+            dest->gso = 1;
+        else
+            daemon_log(LOG_WARNING, "UDP segmentation offload is not supported. Sending single packets. %m");
+    }
+
+    return 0;
+}
+
+void destination_close(destination_t *dest)
+{
+    if (dest->fd >= 0 && close(dest->fd) < 0)
+        daemon_log(LOG_ERR, "Error closing UDP socket fd. %m.");
+    dest->fd = -1;
+
+    free((void *)dest->interface);
+    dest->interface = NULL;
+}
+
+/*
+ * Egress queue
+ */
+
+int egress_init(egress_t *eg, unsigned int size, size_t slot_size, destination_t *destinations, unsigned int destinations_count)
+{
+    unsigned int i;
+
+    eg->size = size;
+    eg->slot_size = slot_size;
+    eg->count = 0;
+    eg->destinations = destinations;
+    eg->destinations_count = destinations_count;
+    eg->flush = NULL;
+    eg->backend = NULL;
+    eg->send_errors = 0;
+    log_limit_init(&eg->send_log, "packets lost on send errors", NULL);
+    eg->packets = calloc(size, slot_size);
+    eg->msgs = calloc(size * (destinations_count ? destinations_count : 1), sizeof(*eg->msgs));
+    eg->iovs = calloc(size, sizeof(*eg->iovs));
+    eg->masks = calloc(size, sizeof(*eg->masks));
+    eg->gather = calloc(size, sizeof(*eg->gather));
+    eg->controls = calloc(size, CMSG_SPACE(sizeof(uint16_t)));
+
+    if (!eg->packets || !eg->msgs || !eg->iovs || !eg->masks || !eg->gather || !eg->controls)
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    /* .. link io vectors to their slots once */
+    for (i = 0; i < size; i++)
+        eg->iovs[i].iov_base = eg->packets + i * slot_size;
+    for (i = 0; i < size * (destinations_count ? destinations_count : 1); i++)
+        eg->msgs[i].msg_hdr.msg_iovlen = 1;
+
+    return 0;
+}
+
+/* .. number of bytes in the message */
+static inline size_t egress_msg_length(const struct msghdr *msg)
+{
+    size_t length = 0, i;
+
+    for (i = 0; i < msg->msg_iovlen; i++)
+        length += msg->msg_iov[i].iov_len;
+
+    return length;
+}
+
+/* .. send packets of a segmented message one by one */
+static void egress_send_single(egress_t *eg, destination_t *dest, const struct msghdr *msg)
+{
+    struct msghdr hdr = {
+        .msg_name = msg->msg_name,
+        .msg_namelen = msg->msg_namelen,
+        .msg_iovlen = 1,
+    };
+    size_t i;
+    ssize_t n;
+
+    for (i = 0; i < msg->msg_iovlen; i++)
+    {
+        hdr.msg_iov = &msg->msg_iov[i];
+        while ((n = sendmsg(dest->fd, &hdr, 0)) < 0 && errno == EINTR)
+            ;
+
+        if (n < 0 || (size_t)n != msg->msg_iov[i].iov_len)
+        {
+            stats_add(&eg->send_errors, 1);
+            log_limit_count(&eg->send_log, n < 0 ? errno : EMSGSIZE);
+        }
+    }
+}
+
+/* .. send the first count messages to the destination with as few sendmmsg() calls as possible */
+static void egress_send(egress_t *eg, destination_t *dest, unsigned int count)
+{
+    unsigned int sent = 0, i;
+
+    while (sent < count)
+    {
+        int n = sendmmsg(dest->fd, eg->msgs + sent, count - sent, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            /* .. the device cannot segment, send single packets from now on. Threads sharing the destination may race here */
+            if (errno == EIO && eg->msgs[sent].msg_hdr.msg_controllen)
+            {
+                if (__atomic_exchange_n(&dest->gso, 0, __ATOMIC_RELAXED))
+                    daemon_log(LOG_WARNING, "UDP segmentation offload failed. Sending single packets.");
+
+                egress_send_single(eg, dest, &eg->msgs[sent].msg_hdr);
+                sent++;
+                continue;
+            }
+
+            /* .. the first remaining message failed, drop it and go on with the rest. ENOBUFS storms are logged in aggregate */
+            stats_add(&eg->send_errors, eg->msgs[sent].msg_hdr.msg_iovlen);
+            log_limit_count(&eg->send_log, errno);
+            sent++;
+            continue;
+        }
+
+        /* .. account packets which were sent only partially */
+        for (i = sent; i < sent + n; i++)
+            if (eg->msgs[i].msg_len != egress_msg_length(&eg->msgs[i].msg_hdr))
+            {
+                stats_add(&eg->send_errors, 1);
+                log_limit_count(&eg->send_log, EMSGSIZE);
+            }
+
+        sent += n;
+    }
+}
+
+/* .. number of packets from iov on sent as one segmented message. All but the last one have the same size */
+static inline unsigned int egress_gso_run(const struct iovec *iov, unsigned int n)
+{
+    size_t size = iov[0].iov_len, total = size;
+    unsigned int run = 1;
+
+    while (run < n && run < X2UDP_GSO_MAX_SEGMENTS &&
+           iov[run].iov_len <= size && total + iov[run].iov_len <= X2UDP_GSO_MAX_BYTES)
+    {
+        total += iov[run].iov_len;
+        if (iov[run++].iov_len < size)
+            break;
+    }
+
+    return run;
+}
+
+unsigned int egress_gather(egress_t *eg, unsigned int d)
+{
+    unsigned int i, n;
+
+    for (i = n = 0; i < eg->count; i++)
+        if (eg->masks[i] & (1u << d))
+            eg->gather[n++] = eg->iovs[i];
+
+    return n;
+}
+
+void egress_send_gathered(egress_t *eg, destination_t *dest, unsigned int n)
+{
+    unsigned int i, count;
+
+    /* .. link headers to runs of packets, a run is a single packet without GSO */
+    for (i = count = 0; i < n; count++)
+    {
+        struct msghdr *hdr = &eg->msgs[count].msg_hdr;
+        unsigned int run = __atomic_load_n(&dest->gso, __ATOMIC_RELAXED) ? egress_gso_run(eg->gather + i, n - i) : 1;
+
+        hdr->msg_iov = &eg->gather[i];
+        hdr->msg_iovlen = run;
+        hdr->msg_name = &dest->addr;
+        hdr->msg_namelen = dest->addr_length;
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+
+        /* .. the kernel splits the message into datagrams of the segment size */
+        if (run > 1)
+        {
+            uint16_t segment = eg->gather[i].iov_len;
+
+            hdr->msg_control = eg->controls + count * CMSG_SPACE(sizeof(segment));
+            hdr->msg_controllen = CMSG_SPACE(sizeof(segment));
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+
+        i += run;
+    }
+
+    egress_send(eg, dest, count);
+}
+
+int egress_flush(egress_t *eg)
+{
+    unsigned int d;
+
+    if (eg->flush)
+        return eg->flush(eg);
+
+    for (d = 0; d < eg->destinations_count; d++)
+        egress_send_gathered(eg, &eg->destinations[d], egress_gather(eg, d));
+
+    eg->count = 0;
+
+    return 0;
+}
+
+int egress_queue(egress_t *eg, const void *packet, size_t length, uint32_t destinations)
+{
+    /* .. a packet larger than a slot is never sent */
+    if (length > eg->slot_size)
+    {
+        stats_add(&eg->send_errors, 1);
+        log_limit_count(&eg->send_log, EMSGSIZE);
+        return -EMSGSIZE;
+    }
+
+    if (eg->count == eg->size)
+        egress_flush(eg);
+
+    memcpy(eg->iovs[eg->count].iov_base, packet, length);
+    eg->iovs[eg->count].iov_len = length;
+    eg->masks[eg->count] = destinations;
+    eg->count++;
+
+    return 0;
+}
+
+void egress_free(egress_t *eg)
+{
+    log_limit_free(&eg->send_log);
+    free(eg->packets);
+    free(eg->msgs);
+    free(eg->iovs);
+    free(eg->masks);
+    free(eg->gather);
+    free(eg->controls);
+    memset(eg, 0, sizeof(*eg));
+}
+
+/*
+ * Statistics socket
+ */
+
+/* .. send a snapshot to every waiting client and disconnect it. A client not taking it at once is dropped */
+static void stats_server_process(stats_server_t *stats)
+{
+    int client;
+
+    while ((client = accept4(stats->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        char *buffer = NULL;
+        size_t length = stats->snapshot(stats->context, &buffer), sent = 0;
+        ssize_t n;
+
+        while (sent < length && (n = send(client, buffer + sent, length - sent, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+            sent += n;
+
+        free(buffer);
+        close(client);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        daemon_log(LOG_WARNING, "Error accepting statistics client. %m");
+}
+
+static void *stats_server_run(void *arg)
+{
+    stats_server_t *stats = arg;
+    struct pollfd fds[2] = {
+        { .fd = stats->fd, .events = POLLIN },
+        { .fd = stats->stop_fd, .events = POLLIN },
+    };
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            daemon_log(LOG_ERR, "poll() of statistics socket: %m");
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (fds[0].revents)
+            stats_server_process(stats);
+    }
+
+    return NULL;
+}
+
+int stats_server_init(stats_server_t *stats, stats_snapshot_t snapshot, void *context)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int err;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats->started);
+    stats->snapshot = snapshot;
+    stats->context = context;
+    stats->stop_fd = -1;
+    stats->running = 0;
+
+    if (!stats->path)
+        return 0;
+
+    if (strlen(stats->path) >= sizeof(addr.sun_path))
+    {
+        daemon_log(LOG_WARNING, "Statistics socket path '%s' is too long.", stats->path);
+        return -1;
+    }
+    strcpy(addr.sun_path, stats->path);
+
+    if ((stats->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Error creating statistics socket. %m");
+        return -1;
+    }
+
+    /* .. remove a socket left by a previous run */
+    unlink(stats->path);
+
+    if (bind(stats->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(stats->fd, 4) < 0 ||
+        (stats->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Cannot serve statistics on '%s'. %m", stats->path);
+        stats_server_close(stats);
+        return -1;
+    }
+
+    /* .. snapshots are built and sent off the event loops */
+    if ((err = thread_create(&stats->thread, stats_server_run, stats)) != 0)
+    {
+        daemon_log(LOG_WARNING, "Cannot start statistics thread: %s", strerror(err));
+        stats_server_close(stats);
+        return -1;
+    }
+    stats->running = 1;
+
+    daemon_log(LOG_INFO, "Serving statistics on '%s'.", stats->path);
+
+    return 0;
+}
+
+void stats_server_close(stats_server_t *stats)
+{
+    const uint64_t one = 1;
+
+    if (stats->running)
+    {
+        if (write(stats->stop_fd, &one, sizeof(one)) < 0)
+            daemon_log(LOG_WARNING, "Cannot stop statistics thread. %m");
+        pthread_join(stats->thread, NULL);
+        stats->running = 0;
+    }
+
+    if (stats->stop_fd >= 0)
+        close(stats->stop_fd);
+    stats->stop_fd = -1;
+
+    if (stats->fd >= 0)
+    {
+        close(stats->fd);
+        unlink(stats->path);
+    }
+    stats->fd = -1;
+
+    free((void *)stats->path);
+    stats->path = NULL;
+}
+
+double stats_server_uptime(const stats_server_t *stats)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - stats->started.tv_sec) + (now.tv_nsec - stats->started.tv_nsec) / 1e9;
+}
+
+/*
+ * Latency profile
+ */
+
+void parse_latency(const config_setting_t *setting, latency_t *latency)
+{
+    memset(latency, 0, sizeof(*latency));
+
+    if (!setting || !config_setting_is_group(setting))
+        return;
+
+    latency->enabled = 1;
+    latency->lock_memory = 1;
+    latency->prefault = 1;
+    config_setting_lookup_bool(setting, "enabled", &latency->enabled);
+    config_setting_lookup_int(setting, "busy_poll", &latency->busy_poll);
+    config_setting_lookup_bool(setting, "busy_wait", &latency->busy_wait);
+    config_setting_lookup_bool(setting, "lock_memory", &latency->lock_memory);
+    config_setting_lookup_bool(setting, "prefault", &latency->prefault);
+}
+
+void socket_set_busy_poll(int fd, int usec, const char *name)
+{
+    if (fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+        daemon_log(LOG_WARNING, "Cannot enable busy polling of %s. Ignoring: %m", name);
+}
+
+__attribute__((noinline)) void latency_prefault_stack(void)
+{
+    volatile uint8_t stack[X2UDP_PREFAULT_STACK];
+    size_t i, page = sysconf(_SC_PAGESIZE);
+
+    for (i = 0; i < sizeof(stack); i += page)
+        stack[i] = 0;
+}
+
+void latency_prefault_heap(void)
+{
+    size_t i, page = sysconf(_SC_PAGESIZE);
+    volatile uint8_t *heap;
+
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    if (!(heap = malloc(X2UDP_PREFAULT_HEAP)))
+        return;
+
+    for (i = 0; i < X2UDP_PREFAULT_HEAP; i += page)
+        heap[i] = 0;
+
+    free((void *)heap);
+}
+
+void latency_apply_memory(const latency_t *latency)
+{
+    if (latency->prefault)
+    {
+        latency_prefault_heap();
+        latency_prefault_stack();
+    }
+
+    /* .. rings and buffers are allocated by now, locking faults them in */
+    if (latency->lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        daemon_log(LOG_WARNING, "Cannot lock memory. Ignoring: %m");
+}
@@ -0,0 +1,341 @@
+/*******************************************************************************
+ * common.h
+ *
+ * Code shared by the can2udp, iio2udp and udp2can daemons.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+#ifndef __X_2_UDP_COMMON_H
+#define __X_2_UDP_COMMON_H
+
+/*******************************************************************************
+ * Includes
+ ******************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/if_ether.h>
+
+#include <libconfig.h>
+
+/*******************************************************************************
+ * Settings
+ ******************************************************************************/
+
+/* .. warnings of the hot path are aggregated and reported by a timer of this period */
+#define X2UDP_LOG_INTERVAL_NS 1000000000ull
+
+/* .. maximal number of UDP destinations, queued packets carry a bit mask of them */
+#define X2UDP_MAX_DESTINATIONS 32
+
+/* .. limits of a single message segmented by the kernel */
+#define X2UDP_GSO_MAX_SEGMENTS 64
+#define X2UDP_GSO_MAX_BYTES 65507
+
+/* .. stack and heap faulted in by the latency profile */
+#define X2UDP_PREFAULT_STACK (256 * 1024)
+#define X2UDP_PREFAULT_HEAP (8 * 1024 * 1024)
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/*******************************************************************************
+ * Type declarations
+ ******************************************************************************/
+
+typedef
+struct log_limit log_limit_t;
+
+/* .. occurrences of a warning aggregated over an interval */
+struct log_limit
+{
+    /* .. occurrences since the last report, counted by the thread hitting them */
+    unsigned long count;
+
+    /* .. errno of the last occurrence */
+    int error;
+
+    /* .. what happened and where, the name may be NULL */
+    const char *what;
+    const char *name;
+
+    /* .. the limit is in the list of the report timer */
+    int registered;
+    log_limit_t *next;
+};
+
+/* .. UDP destination with its own socket */
+typedef
+struct destination
+{
+    /* .. address and port */
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+
+    /* .. socket set up for the destination */
+    int fd;
+
+    /* .. hop limit of packets, -1 for the system default */
+    int ttl;
+
+    /* .. multicast packets are looped back to local receivers */
+    int loopback;
+
+    /* .. network interface to send packets through, NULL for any */
+    const char *interface;
+
+    /* .. packets of the same size are sent as one message segmented by the kernel.
+     *    Cleared by any thread sending to the destination, accessed atomically */
+    int gso;
+
+    /* .. packets are sent through AF_XDP sockets */
+    int xdp;
+
+    /* .. link layer address of the destination or the next hop */
+    uint8_t mac[ETH_ALEN];
+    int mac_set;
+} destination_t;
+
+typedef
+struct egress egress_t;
+
+/* .. packets queued for transmission with sendmmsg() */
+struct egress
+{
+    /* .. number of packets the queue can hold */
+    unsigned int size;
+
+    /* .. maximal size of a single packet */
+    size_t slot_size;
+
+    /* .. number of queued packets */
+    unsigned int count;
+
+    /* .. destinations packets are sent to */
+    destination_t *destinations;
+    unsigned int destinations_count;
+
+    /* .. packet storage, size * slot_size bytes */
+    uint8_t *packets;
+
+    /* .. message headers, size for every destination */
+    struct mmsghdr *msgs;
+
+    /* .. one io vector per packet */
+    struct iovec *iovs;
+
+    /* .. bit mask of destinations of every packet */
+    uint32_t *masks;
+
+    /* .. io vectors of packets going to one destination */
+    struct iovec *gather;
+
+    /* .. UDP_SEGMENT control messages, one per message header */
+    uint8_t *controls;
+
+    /* .. sends all queued packets in place of sendmmsg(), NULL for the UDP stack */
+    int (*flush)(egress_t *eg);
+
+    /* .. state of the flush backend */
+    void *backend;
+
+    /* .. number of packets lost because of send errors */
+    uint64_t send_errors;
+
+    /* .. send errors waiting to be logged */
+    log_limit_t send_log;
+};
+
+/* .. build a snapshot of all counters of the daemon. Returns its length, the buffer must be freed.
+ *    Called by the thread of the server, counters are read with stats_get() */
+typedef size_t (*stats_snapshot_t)(void *context, char **buffer);
+
+/* .. local socket serving snapshots of counters from a thread of its own */
+typedef
+struct stats_server
+{
+    /* .. listening socket */
+    int fd;
+
+    /* .. wakes the thread up to stop it */
+    int stop_fd;
+
+    /* .. thread accepting clients */
+    pthread_t thread;
+    int running;
+
+    /* .. path of the socket, NULL if disabled */
+    const char *path;
+
+    /* .. start of the daemon */
+    struct timespec started;
+
+    /* .. snapshot builder of the daemon */
+    stats_snapshot_t snapshot;
+    void *context;
+} stats_server_t;
+
+/* .. low-latency operating profile */
+typedef
+struct latency
+{
+    /* .. the profile is applied after init */
+    int enabled;
+
+    /* .. SO_BUSY_POLL time of sockets in microseconds, 0 disables it */
+    int busy_poll;
+
+    /* .. poll for events without sleeping */
+    int busy_wait;
+
+    /* .. lock all current and future memory of the process */
+    int lock_memory;
+
+    /* .. fault in stack and heap before the event loop starts */
+    int prefault;
+} latency_t;
+
+/*******************************************************************************
+ * Rate-limited logging
+ ******************************************************************************/
+
+/* .. register the limit with the report timer. The strings must outlive it */
+void log_limit_init(log_limit_t *limit, const char *what, const char *name);
+
+/* .. report what is pending and unregister the limit */
+void log_limit_free(log_limit_t *limit);
+
+/* .. note an occurrence, nothing is logged here. Safe to call from any thread */
+static inline void log_limit_count(log_limit_t *limit, int error)
+{
+    __atomic_store_n(&limit->error, error, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED);
+}
+
+/* .. log occurrences of all registered limits since the previous report */
+void log_limit_report_all(void);
+
+/* .. periodic timer reporting all limits. Returns its fd or -1 */
+int log_timer_open(void);
+
+/* .. the timer expired */
+void log_timer_process(int fd);
+
+/*******************************************************************************
+ * Threads
+ ******************************************************************************/
+
+/* .. create a thread with all signals blocked from its first instruction, they are handled by the main thread.
+ *    Returns 0 or an error number like pthread_create() */
+int thread_create(pthread_t *thread, void *(*run)(void *), void *arg);
+
+/*******************************************************************************
+ * Statistics counters
+ ******************************************************************************/
+
+/* .. counters have a single writer, a relaxed load/store pair avoids locked instructions */
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ * UDP destinations
+ ******************************************************************************/
+
+/* .. read a destination: address with optional port, ttl, loopback, interface and mac */
+int parse_destination(const config_setting_t *setting, destination_t *dest, int port, const char *interface);
+
+/* .. append destinations of the list to the array. Returns their bit mask, 0 if there are none */
+uint32_t parse_destinations(const config_setting_t *list, destination_t *destinations, int *count, int port, const char *interface);
+
+/* .. set up the destination as the broadcast address of the port */
+void destination_broadcast(destination_t *dest, int port, const char *interface);
+
+/* .. create the socket of the destination and set it up for its kind of address */
+int destination_open(destination_t *dest, int gso);
+
+void destination_close(destination_t *dest);
+
+/*******************************************************************************
+ * Egress queue
+ ******************************************************************************/
+
+int egress_init(egress_t *eg, unsigned int size, size_t slot_size, destination_t *destinations, unsigned int destinations_count);
+
+/* .. collect io vectors of packets going to the d-th destination in eg->gather. Returns their number */
+unsigned int egress_gather(egress_t *eg, unsigned int d);
+
+/* .. send the gathered packets to the destination, runs of them segmented by the kernel if possible */
+void egress_send_gathered(egress_t *eg, destination_t *dest, unsigned int n);
+
+/* .. send all queued packets, one batch per destination */
+int egress_flush(egress_t *eg);
+
+/* .. copy the packet to the queue. The queue is flushed if it is full. Packets larger than a slot are dropped */
+int egress_queue(egress_t *eg, const void *packet, size_t length, uint32_t destinations);
+
+void egress_free(egress_t *eg);
+
+/*******************************************************************************
+ * Statistics socket
+ ******************************************************************************/
+
+/* .. start serving snapshots in a thread if a path is set. Counters must stay valid until the server is closed */
+int stats_server_init(stats_server_t *stats, stats_snapshot_t snapshot, void *context);
+
+/* .. stop the thread and remove the socket */
+void stats_server_close(stats_server_t *stats);
+
+/* .. seconds since the server was initialized */
+double stats_server_uptime(const stats_server_t *stats);
+
+/*******************************************************************************
+ * Latency profile
+ ******************************************************************************/
+
+/* .. read the common settings of the latency group, it is enabled by its presence */
+void parse_latency(const config_setting_t *setting, latency_t *latency);
+
+/* .. enable busy polling of the socket */
+void socket_set_busy_poll(int fd, int usec, const char *name);
+
+/* .. touch stack pages of the calling thread so the hot path does not fault on them */
+void latency_prefault_stack(void);
+
+/* .. keep a pool of faulted-in heap, freed memory is never returned to the kernel */
+void latency_prefault_heap(void);
+
+/* .. fault in and lock memory of the process as the profile says */
+void latency_apply_memory(const latency_t *latency);
+
+#endif    /*  __X_2_UDP_COMMON_H */
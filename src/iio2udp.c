@@ -27,10 +27,12 @@
 /*
  * Includes
  */
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <signal.h>
 #include <errno.h>
 #include <sys/timerfd.h>
@@ -42,8 +44,11 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <net/if.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -52,6 +57,7 @@
 
 #include "iio2udp.h"
 #include "iio.h"
+#include "common.h"
 
 /*
  * Settings
@@ -59,10 +65,41 @@
 
 #define IIO2UDP_DEFAULT_CONFIG_FILENAME "/etc/iio2udp"
 
+/* .. maximal number of events handled by one epoll_wait() call */
+#define IIO2UDP_MAX_EVENTS 64
+
+/* .. default number of packets sent by one sendmmsg() call */
+#define IIO2UDP_DEFAULT_SEND_BATCH_SIZE 64
+
+/* .. debug messages of the hot path are compiled in only if IIO2UDP_DEBUG_LOG is defined */
+#ifdef IIO2UDP_DEBUG_LOG
+#define debug_log(...) daemon_log(LOG_DEBUG, __VA_ARGS__)
+#else
+#define debug_log(...) do { } while (0)
+#endif
+
 /*
  * Type declarations
  */
 
+/* .. counters of a channel. The event loop is single threaded, they need no synchronization */
+typedef
+struct channel_stats
+{
+    /* .. values read successfully */
+    uint64_t reads;
+
+    /* .. failed reads, sent with bad quality */
+    uint64_t read_errors;
+
+    /* .. timer expirations missed because the loop was late */
+    uint64_t overruns;
+
+    /* .. packets queued for sending */
+    uint64_t packets;
+    uint64_t bytes;
+} channel_stats_t;
+
 typedef
 struct channel channel_t;
 
@@ -101,9 +138,18 @@ struct channel
     /* .. use long packet format for UDP */
     int use_long_format;
 
+    /* .. bit mask of destinations the channel is sent to */
+    uint32_t destinations;
+
     /* .. file descriptor of the timer */
     int timerfd;
 
+    /* .. runtime counters */
+    channel_stats_t stats;
+
+    /* .. processing errors waiting to be logged */
+    log_limit_t error_log;
+
     /* .. pointer to the next element in the list */
     channel_t *next;
 };
@@ -123,11 +169,42 @@ struct deamon_config
     /* .. network interface to bind UDP socket to */
     const char *interface;
 
-    /* .. broadcast UDP socket */
-    int socket_broadcast;
+    /* .. UDP destinations of all channels */
+    destination_t destinations[X2UDP_MAX_DESTINATIONS];
+    int destinations_count;
+
+    /* .. destinations of channels without their own list */
+    uint32_t default_destinations;
+
+    /* .. use UDP generic segmentation offload if the kernel supports it */
+    int gso;
 
-    /* .. broadcast IP address */
-    struct sockaddr_in baddr;
+    /* .. maximal number of packets sent at once */
+    int send_batch_size;
+
+    /* .. packets waiting for transmission */
+    egress_t egress;
+
+    /* .. epoll instance watching all channels */
+    int epoll_fd;
+
+    /* .. use edge-triggered notifications and drain channels completely */
+    int edge_triggered;
+
+    /* .. low-latency operating profile */
+    latency_t latency;
+
+    /* .. CPU the event loop is pinned to by the profile, -1 if not pinned */
+    int cpu;
+
+    /* .. SCHED_FIFO priority of the event loop, 0 keeps the default scheduling */
+    int priority;
+
+    /* .. statistics socket */
+    stats_server_t stats;
+
+    /* .. timer reporting aggregated warnings */
+    int log_timer_fd;
 } daemon_config_t;
 
 /*
@@ -146,6 +223,16 @@ parse_config(daemon_config_t *config, const char *config_file_name)
     config->port = IIO2UDP_DEFAULT_PORT;
     config->context = NULL;
     config->interface = NULL;
+    config->send_batch_size = IIO2UDP_DEFAULT_SEND_BATCH_SIZE;
+    config->epoll_fd = -1;
+    config->edge_triggered = 0;
+    config->cpu = -1;
+    config->priority = 0;
+    memset(&config->stats, 0, sizeof(config->stats));
+    config->stats.fd = -1;
+    config->stats.stop_fd = -1;
+    config->log_timer_fd = -1;
+    config->gso = 0;
 
     config_init(&cf);
 
@@ -168,11 +255,37 @@ parse_config(daemon_config_t *config, const char *config_file_name)
     }
 
     config_lookup_int(&cf, "port", &config->port);
+    config_lookup_int(&cf, "send_batch_size", &config->send_batch_size);
+    config_lookup_bool(&cf, "edge_triggered", &config->edge_triggered);
+    config_lookup_bool(&cf, "gso", &config->gso);
+
+    if (config_lookup_string(&cf, "stats_socket", &config->stats.path))
+        config->stats.path = strdup(config->stats.path);
+
+    /* .. the latency profile is enabled by its group unless it says otherwise */
+    config_setting_t *latency = config_lookup(&cf, "latency");
+    parse_latency(latency, &config->latency);
+    if (config->latency.enabled)
+    {
+        config_setting_lookup_int(latency, "cpu", &config->cpu);
+        config_setting_lookup_int(latency, "priority", &config->priority);
+    }
+    if (config->send_batch_size < 1)
+        config->send_batch_size = 1;
 
     config_lookup_string(&cf, "interface", &config->interface);
     if (config->interface)
         config->interface = strdup(config->interface);
 
+    /* .. packets are broadcast on the port unless destinations are listed */
+    config->destinations_count = 0;
+    if (!(config->default_destinations = parse_destinations(config_lookup(&cf, "destinations"), config->destinations,
+                                                            &config->destinations_count, config->port, config->interface)))
+    {
+        destination_broadcast(&config->destinations[config->destinations_count], config->port, config->interface);
+        config->default_destinations = 1u << config->destinations_count++;
+    }
+
     /* .. try getting channel configurations */
     const config_setting_t *channels  = config_lookup(&cf, "channels");
     if (channels)
@@ -214,6 +327,7 @@ parse_config(daemon_config_t *config, const char *config_file_name)
                 chc->next = NULL;
                 chc->rx = NULL;
                 chc->ch = NULL;
+                memset(&chc->stats, 0, sizeof(chc->stats));
                 chc->device_name = "";
                 chc->channel_name = "";
                 chc->sample_time = 100;
@@ -233,9 +347,13 @@ parse_config(daemon_config_t *config, const char *config_file_name)
                 chc->device_name = strdup(chc->device_name);
                 config_setting_lookup_string(channel, "channel", &chc->channel_name);
                 chc->channel_name = strdup(chc->channel_name);
+                log_limit_init(&chc->error_log, "processing errors", chc->channel_name);
                 config_setting_lookup_bool(channel, "long_format", &chc->use_long_format);
                 config_setting_lookup_int(channel, "device_index", &chc->udp_device_index);
                 config_setting_lookup_int(channel, "channel_index", &chc->udp_channel_index);
+                if (!(chc->destinations = parse_destinations(config_setting_get_member(channel, "destinations"), config->destinations,
+                                                             &config->destinations_count, config->port, config->interface)))
+                    chc->destinations = config->default_destinations;
             }
         }
     }
@@ -250,10 +368,10 @@ parse_config(daemon_config_t *config, const char *config_file_name)
  * Signal channel handling
  */
 
-int channel_init(struct iio_context *context, channel_t *chc, fd_set *fds)
+int channel_init(daemon_config_t *config, channel_t *chc)
 {
     /* .. locate the device */
-    chc->rx = iio_context_find_device(context, chc->device_name);
+    chc->rx = iio_context_find_device(config->context, chc->device_name);
     if (!chc->rx)
     {
         char err_str[1024];
@@ -301,8 +419,16 @@ int channel_init(struct iio_context *context, channel_t *chc, fd_set *fds)
         goto error;
     }
 
-    /* .. add fd to the list for select() call */
-    FD_SET(chc->timerfd, fds);
+    /* .. watch the fd, the channel is passed back with its events */
+    struct epoll_event ev = {
+        .events = EPOLLIN | (config->edge_triggered ? EPOLLET : 0),
+        .data.ptr = chc,
+    };
+    if (epoll_ctl(config->epoll_fd, EPOLL_CTL_ADD, chc->timerfd, &ev) < 0)
+    {
+        daemon_log(LOG_WARNING, "Cannot watch timer for '%s/%s': %m", chc->device_name, chc->channel_name);
+        goto error;
+    }
 
     return 0;
 
@@ -316,10 +442,14 @@ error:
 
 int channel_process(daemon_config_t *config, channel_t *chc)
 {
-    int64_t dummy;
-    if (read(chc->timerfd, &dummy, sizeof(dummy)) != sizeof(dummy))
+    uint64_t expirations;
+    if (read(chc->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
         return -EINPROGRESS;
 
+    /* .. only one sample is taken however late the loop is */
+    if (expirations > 1)
+        stats_add(&chc->stats.overruns, expirations - 1);
+
     /* .. fill in short packet */
     iio2udp_packet_short_t p_short = {
         .version = IIO2UDP_PACKET_VERSION,
@@ -337,11 +467,14 @@ int channel_process(daemon_config_t *config, channel_t *chc)
         /*.. fill in data for the short packet */
         p_short.OPCQuality = htons(0xC0); /* .. this is good quality, no limits */
         p_short.value_dbl = conditioned;
+        stats_add(&chc->stats.reads, 1);
     }
     else
     {
         /*.. fill in data for the short packet */
         p_short.OPCQuality = htons(0x00); /* .. this is bad quality */
+        stats_add(&chc->stats.read_errors, 1);
+        debug_log("Cannot read value of '%s/%s'", chc->device_name, chc->channel_name);
     }
 
     /* .. fill in long packet */
@@ -364,27 +497,20 @@ int channel_process(daemon_config_t *config, channel_t *chc)
         packet_length = sizeof(p_long);
     }
 
-    /* .. send the packet out */
-    int err;
-    if ((err = sendto(config->socket_broadcast,
-                      packet, packet_length,
-                      0,
-                      (struct sockaddr *)&config->baddr, sizeof(config->baddr))
-         != packet_length))
-        daemon_log(LOG_WARNING, "Error sending data to UDP socket. Data loss occured. %d, %m", err);
+    stats_add(&chc->stats.packets, 1);
+    stats_add(&chc->stats.bytes, packet_length);
 
-    return 0;
+    /* .. queue the packet, it is sent out at the end of the event loop iteration */
+    return egress_queue(&config->egress, packet, packet_length, chc->destinations);
 }
 
-int channel_is_ready(channel_t *chc, fd_set *fds)
+int channel_close(daemon_config_t *config, channel_t *chc)
 {
-    return FD_ISSET(chc->timerfd, fds);
-}
+    /* .. report what is left, the channel goes away */
+    log_limit_free(&chc->error_log);
 
-int channel_close(channel_t *chc, fd_set *fds)
-{
-    /* .. add fd to the list for select() call */
-    FD_CLR(chc->timerfd, fds);
+    /* .. stop watching the fd */
+    epoll_ctl(config->epoll_fd, EPOLL_CTL_DEL, chc->timerfd, NULL);
 
     /* close and destroy the timer */
     if (close(chc->timerfd) < 0)
@@ -413,59 +539,86 @@ int channel_close(channel_t *chc, fd_set *fds)
 
 int socket_init(daemon_config_t *config)
 {
-    const int yes = 1;
+    int i;
 
-    if((config->socket_broadcast = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-    {
-        daemon_log(LOG_ERR, "Error creating UDP socket %m.");
-        return -1;
-    }
+    for (i = 0; i < config->destinations_count; i++)
+        if (destination_open(&config->destinations[i], config->gso) < 0)
+            return -1;
 
-    /* .. make the socket broadcast */
-    if (setsockopt(config->socket_broadcast, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes)) < 0)
-    {
-        daemon_log(LOG_ERR, "Error setting UDP socket broadcast. %m");
+    /* .. init the queue of outgoing packets */
+    if (egress_init(&config->egress, config->send_batch_size, sizeof(iio2udp_packet_long_t),
+                    config->destinations, config->destinations_count) < 0)
         return -1;
-    }
 
-    /* .. bind the socket to an interface if required */
-    if (config->interface)
-        if (setsockopt(config->socket_broadcast, SOL_SOCKET, SO_BINDTODEVICE, config->interface, strlen(config->interface)) < 0)
-        {
-            daemon_log(LOG_WARNING, "Cannot bind UDP socket to '%s'. Packets will be sent on all interfaces. %m", config->interface);
-        }
+    return 0;
+}
 
-    /* .. initialize broadcast address */
-    bzero(&config->baddr, sizeof(config->baddr));
-    config->baddr.sin_family = AF_INET;
-    config->baddr.sin_port = htons(config->port);
-    config->baddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+int socket_close(daemon_config_t *config)
+{
+    /* .. release the queue of outgoing packets */
+    egress_free(&config->egress);
+
+    /* close and destroy sockets */
+    int i;
+    for (i = 0; i < config->destinations_count; i++)
+        destination_close(&config->destinations[i]);
 
     return 0;
 }
 
-int socket_close(daemon_config_t *config)
+/*
+ * Statistics socket
+ */
+
+/* .. build a snapshot of all counters. Returns its length, the buffer must be freed */
+size_t stats_snapshot(void *context, char **buffer)
 {
-    /* close and destroy the socket */
-    if (close(config->socket_broadcast) < 0)
+    daemon_config_t *config = context;
+    size_t length = 0;
+    channel_t *chc;
+    FILE *out;
+
+    if (!(out = open_memstream(buffer, &length)))
+        return 0;
+
+    fprintf(out, "{\"daemon\":\"iio2udp\",\"uptime\":%.3f,\"send_errors\":%llu,\"channels\":[",
+            stats_server_uptime(&config->stats), (unsigned long long)stats_get(&config->egress.send_errors));
+
+    for (chc = config->channels; chc; chc = chc->next)
     {
-        daemon_log(LOG_ERR, "Error closing UDP socket fd. %m.");
-        return -1;
+        fprintf(out, "{\"device\":\"%s\",\"channel\":\"%s\",\"reads\":%llu,\"read_errors\":%llu,"
+                "\"overruns\":%llu,\"packets\":%llu,\"bytes\":%llu}%s",
+                chc->device_name, chc->channel_name,
+                (unsigned long long)stats_get(&chc->stats.reads),
+                (unsigned long long)stats_get(&chc->stats.read_errors),
+                (unsigned long long)stats_get(&chc->stats.overruns),
+                (unsigned long long)stats_get(&chc->stats.packets),
+                (unsigned long long)stats_get(&chc->stats.bytes),
+                chc->next ? "," : "");
     }
-    config->socket_broadcast = 0;
+    fputs("]}\n", out);
 
-    return 0;
+    fclose(out);
+
+    return length;
 }
 
 /*
  * System integration functions.
  */
 
-int system_init(daemon_config_t *config, fd_set *fds, const char* config_file_name)
+int system_init(daemon_config_t *config, const char* config_file_name)
 {
     if (parse_config(config, config_file_name) < 0)
         return -1;
 
+    /* .. create epoll instance for the event loop */
+    if ((config->epoll_fd = epoll_create1(0)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating epoll instance. %m");
+        return -1;
+    }
+
     if (!(config->context = iio_create_default_context()))
     {
         char err_str[1024];
@@ -482,7 +635,7 @@ int system_init(daemon_config_t *config, fd_set *fds, const char* config_file_na
     while (chc)
     {
         /* .. try to initialize channel */
-        if (channel_init(config->context, chc, fds)  == 0)
+        if (channel_init(config, chc)  == 0)
             good_channels++;
 
         /* .. go to the next item in the list */
@@ -498,39 +651,63 @@ int system_init(daemon_config_t *config, fd_set *fds, const char* config_file_na
     }
 
     /* .. init UDP socket for broadcasting */
-    socket_init(config);
+    if (socket_init(config) < 0)
+        return -1;
+
+    /* .. pending warnings are reported even if nothing else happens */
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &config->log_timer_fd };
+    if ((config->log_timer_fd = log_timer_open()) < 0 ||
+        epoll_ctl(config->epoll_fd, EPOLL_CTL_ADD, config->log_timer_fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot watch the timer of warning reports. %m");
+        return -1;
+    }
+
+    /* .. statistics are optional, the daemon works without them */
+    stats_server_init(&config->stats, stats_snapshot, config);
 
     return 0;
 }
 
-int system_check_channels_and_process(daemon_config_t *config, fd_set *fds)
+int system_check_channels_and_process(daemon_config_t *config, struct epoll_event *events, int count)
 {
-    /* .. init all channels */
-    int procesed_channels = 0;
-    channel_t *chc = config->channels;
+    int i;
 
-    /* .. loop through all elements */
-    while (chc)
+    /* .. dispatch only channels which are ready */
+    for (i = 0; i < count; i++)
     {
-        /* .. try to initialize channel */
-        if (channel_is_ready(chc, fds))
-        {
-            int err;
-            if ((err = channel_process(config, chc)) != 0)
-                daemon_log(LOG_WARNING, "Error processing channel '%s/%s'. Error %d", chc->device_name, chc->channel_name, err);
+        channel_t *chc = events[i].data.ptr;
+
+        /* .. signals are handled by the caller */
+        if (!chc)
+            continue;
 
-            procesed_channels ++;
+        /* .. report of aggregated warnings */
+        if (events[i].data.ptr == &config->log_timer_fd)
+        {
+            log_timer_process(config->log_timer_fd);
+            continue;
         }
 
-        /* .. go to the next item in the list */
-        chc = chc->next;
+        int err;
+        if ((err = channel_process(config, chc)) != 0)
+            log_limit_count(&chc->error_log, -err);
     }
 
+    /* .. send out all packets produced in this iteration */
+    egress_flush(&config->egress);
+
     return 0;
 }
 
-void system_close(daemon_config_t *config, fd_set *fds)
+void system_close(daemon_config_t *config)
 {
+    stats_server_close(&config->stats);
+
+    if (config->log_timer_fd >= 0)
+        close(config->log_timer_fd);
+    config->log_timer_fd = -1;
+
     /* .. close the socket first */
     socket_close(config);
 
@@ -539,7 +716,7 @@ void system_close(daemon_config_t *config, fd_set *fds)
     while (chc)
     {
         /* .. try to close the channel */
-        if (channel_close(chc, fds) != 0)
+        if (channel_close(config, chc) != 0)
             daemon_log(LOG_WARNING, "Error closing channel '%s/%s'", chc->device_name, chc->channel_name);
 
         /* .. free this element and go to the next in list */
@@ -552,6 +729,11 @@ void system_close(daemon_config_t *config, fd_set *fds)
     iio_context_destroy(config->context);
     config->context  = NULL;
 
+    /* .. close epoll instance */
+    if (config->epoll_fd >= 0)
+        close(config->epoll_fd);
+    config->epoll_fd = -1;
+
     /* .. free strings */
     if (config->interface)
     {
@@ -560,6 +742,44 @@ void system_close(daemon_config_t *config, fd_set *fds)
     }
 }
 
+/* .. apply the low-latency profile to the initialized system, the calling thread runs the event loop */
+int system_apply_latency_profile(daemon_config_t *config)
+{
+    latency_t *latency = &config->latency;
+    int i;
+
+    if (!latency->enabled)
+        return 0;
+
+    for (i = 0; latency->busy_poll > 0 && i < config->destinations_count; i++)
+        socket_set_busy_poll(config->destinations[i].fd, latency->busy_poll, "UDP socket");
+
+    if (config->cpu >= 0)
+    {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(config->cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            daemon_log(LOG_WARNING, "Cannot pin the event loop to CPU %d. %m", config->cpu);
+    }
+
+    if (config->priority > 0)
+    {
+        struct sched_param param = { .sched_priority = config->priority };
+
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+            daemon_log(LOG_WARNING, "Cannot set SCHED_FIFO priority %d. %m", config->priority);
+    }
+
+    latency_apply_memory(latency);
+
+    daemon_log(LOG_INFO, "Latency profile applied: busy poll %d us, %s, event loop on CPU %d with priority %d.",
+               latency->busy_poll, latency->busy_wait ? "busy wait" : "blocking wait", config->cpu, config->priority);
+
+    return 0;
+}
+
 /*
  * Main daemon routines
  */
@@ -584,7 +804,6 @@ int main(int argc, char **argv)
     pid_t pid;
     int run_daemon = 1;
     int verbosity = 0;
-    fd_set fds;
     int quit = 0;
     daemon_config_t config;
     const char* config_file_name = IIO2UDP_DEFAULT_CONFIG_FILENAME;
@@ -682,11 +901,12 @@ int main(int argc, char **argv)
         run_or_retval(daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, 0), 9);
 
         /*.. init subsystems*/
-        FD_ZERO(&fds);
-        run_or_retval(system_init(&config, &fds, config_file_name), 10);
+        run_or_retval(system_init(&config, config_file_name), 10);
+        run_or_retval(system_apply_latency_profile(&config), 10);
 
-        /* add dameon signal fd to select() list */
-        FD_SET(daemon_signal_fd(), &fds);
+        /* add dameon signal fd to the epoll set, it is told apart by NULL channel */
+        struct epoll_event sev = { .events = EPOLLIN, .data.ptr = NULL };
+        run_or_retval(epoll_ctl(config.epoll_fd, EPOLL_CTL_ADD, daemon_signal_fd(), &sev), 10);
 
         /* Send our status to parent process */
         if (run_daemon)
@@ -695,21 +915,26 @@ int main(int argc, char **argv)
 
         while (!quit)
         {
-            fd_set fds2 = fds;
+            struct epoll_event events[IIO2UDP_MAX_EVENTS];
+            int i;
 
-            /* Wait for an incoming signal */
-            int ret = select(FD_SETSIZE, &fds2, 0, 0, 0);
+            /* Wait for an incoming signal or data */
+            int ret = epoll_wait(config.epoll_fd, events, IIO2UDP_MAX_EVENTS, config.latency.busy_wait ? 0 : -1);
 
-            if (ret == -EINTR)
+            if (ret < 0 && errno == EINTR)
                 continue;
             else if (ret < 0)
             {
-                daemon_log(LOG_ERR, "select(): %s", strerror(errno));
+                daemon_log(LOG_ERR, "epoll_wait(): %s", strerror(errno));
                 break;
             }
 
             /*.. handle daemon signals */
-            if (FD_ISSET(daemon_signal_fd(), &fds2)) {
+            for (i = 0; i < ret; i++)
+            {
+                if (events[i].data.ptr)
+                    continue;
+
                 int sig;
                 run_or_retval((sig = daemon_signal_next()),  0);
 
@@ -730,12 +955,12 @@ int main(int argc, char **argv)
                 }
             }
 
-            /*.. check all channels for readiness */
-            run_or_retval(system_check_channels_and_process(&config, &fds2), 0);
+            /*.. process channels which are ready */
+            run_or_retval(system_check_channels_and_process(&config, events, ret), 0);
         }
 
 close_and_finish:
-        system_close(&config, &fds);
+        system_close(&config);
 
 finish:
         daemon_log(LOG_INFO, "Terminating.");
@@ -0,0 +1,1335 @@
+/*******************************************************************************
+ * udp2can.c
+ *
+ * Daemon for converting UDP packets of can2udp back to SocketCAN frames.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+/*
+ * Includes
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include <libdaemon/daemon.h>
+#include <libconfig.h>
+
+#include "can2udp.h"
+#include "common.h"
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/*
+ * Settings
+ */
+
+#define UDP2CAN_DEFAULT_CONFIG_FILENAME "/etc/udp2can"
+
+/* .. maximal number of events handled by one epoll_wait() call */
+#define UDP2CAN_MAX_EVENTS 64
+
+/* .. default number of datagrams read by one recvmmsg() call */
+#define UDP2CAN_DEFAULT_RECEIVE_BATCH_SIZE 64
+
+/* .. default number of frames written by one sendmmsg() call */
+#define UDP2CAN_DEFAULT_SEND_BATCH_SIZE 32
+
+/* .. default number of frames waiting for every CAN interface, power of 2 */
+#define UDP2CAN_DEFAULT_TX_QUEUE_DEPTH 1024
+
+/* .. default delay before writing again after the CAN transmit queue was full, in microseconds */
+#define UDP2CAN_DEFAULT_RETRY_INTERVAL 1000
+
+/* .. interface ids are 16 bit in all packet versions */
+#define UDP2CAN_MAX_INTERFACE_INDEX 0xffff
+
+/*
+ * Type declarations
+ */
+
+/* .. kind of an object watched by epoll, the first member of such objects */
+typedef
+enum event_source
+{
+    SOURCE_CHANNEL = 0,
+    SOURCE_RECEIVER,
+    SOURCE_RETRY,
+    SOURCE_LOG
+} event_source_t;
+
+typedef
+struct channel channel_t;
+
+/* .. CAN interface frames are written to */
+struct channel
+{
+    /* .. SOURCE_CHANNEL */
+    event_source_t source;
+
+    /* .. SocketCAN interface name */
+    const char *interface_name;
+
+    /* .. id of the interface in UDP packets */
+    int udp_interface_index;
+
+    /* .. socket for CAN */
+    int raw_socket;
+
+    /*.. interface supports CAN FD */
+    int can_fd_enabled;
+
+    /* .. ring of frames waiting for transmission */
+    struct canfd_frame *frames;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t mask;
+
+    /* .. one io vector per frame of the ring, its length tells CAN FD frames apart */
+    struct iovec *iovs;
+
+    /* .. message headers passed to sendmmsg() */
+    struct mmsghdr *msgs;
+
+    /* .. the socket buffer is full, writing continues on EPOLLOUT */
+    int waiting;
+
+    /* .. frames queued, written and dropped */
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t dropped;
+
+    /* .. write errors waiting to be logged */
+    log_limit_t tx_log;
+
+    /* .. pointer to the next element in the list */
+    channel_t *next;
+};
+
+/* .. UDP socket with a batch of received datagrams */
+typedef
+struct receiver
+{
+    /* .. SOURCE_RECEIVER */
+    event_source_t source;
+
+    int fd;
+
+    /* .. number of datagrams read at once and maximal size of a datagram */
+    unsigned int size;
+    size_t mtu;
+
+    /* .. datagram storage, size * mtu bytes */
+    uint8_t *buffers;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+
+    /* .. datagrams in the batch, the one being decoded and the offset of its next record */
+    unsigned int count;
+    unsigned int current;
+    size_t offset;
+
+    /* .. reading is stopped until queues of channels have room */
+    int paused;
+
+    /* .. datagrams received and rejected */
+    uint64_t datagrams;
+    uint64_t invalid;
+
+    /* .. rejected datagrams waiting to be logged */
+    log_limit_t invalid_log;
+} receiver_t;
+
+/* .. timer writing frames again after the CAN transmit queue was full */
+typedef
+struct retry_timer
+{
+    /* .. SOURCE_RETRY */
+    event_source_t source;
+
+    int fd;
+
+    /* .. the timer runs */
+    int armed;
+} retry_timer_t;
+
+/* .. timer reporting aggregated warnings */
+typedef
+struct log_timer
+{
+    /* .. SOURCE_LOG */
+    event_source_t source;
+
+    int fd;
+} log_timer_t;
+
+typedef
+struct deamon_config
+{
+    /* .. Single linked list of channel configs */
+    channel_t *channels;
+
+    /* .. channels by interface id of UDP packets */
+    channel_t **index_map;
+    int index_map_size;
+
+    /* .. UDP port number we listen on */
+    int port;
+
+    /* .. local address to listen on, a multicast group is joined */
+    const char *address;
+
+    /* .. network interface to receive packets on, NULL for any */
+    const char *interface;
+
+    /* .. size of the socket receive buffer, 0 keeps the system default */
+    int receive_buffer;
+
+    /* .. datagrams read by one recvmmsg() call */
+    int receive_batch_size;
+
+    /* .. maximal size of a datagram */
+    int mtu;
+
+    /* .. frames written by one sendmmsg() call */
+    int send_batch_size;
+
+    /* .. frames waiting for every CAN interface */
+    int tx_queue_depth;
+
+    /* .. delay before writing again after ENOBUFS, in microseconds */
+    int retry_interval;
+
+    /* .. UDP socket */
+    receiver_t receiver;
+
+    /* .. timer of writing after ENOBUFS */
+    retry_timer_t retry;
+
+    /* .. timer reporting aggregated warnings */
+    log_timer_t log_timer;
+
+    /* .. epoll instance watching all sockets */
+    int epoll_fd;
+} daemon_config_t;
+
+/*
+ * Parsing of config file.
+ * See default cofnfig for file format.
+ */
+
+int
+parse_config(daemon_config_t *config, const char *config_file_name)
+{
+    config_t cf;
+    int i;
+
+    /* .. set default values for parameters */
+    config->channels = NULL;
+    config->index_map = NULL;
+    config->index_map_size = 0;
+    config->port = CAN2UDP_DEFAULT_PORT;
+    config->address = NULL;
+    config->interface = NULL;
+    config->receive_buffer = 0;
+    config->receive_batch_size = UDP2CAN_DEFAULT_RECEIVE_BATCH_SIZE;
+    config->mtu = CAN2UDP_DEFAULT_MTU;
+    config->send_batch_size = UDP2CAN_DEFAULT_SEND_BATCH_SIZE;
+    config->tx_queue_depth = UDP2CAN_DEFAULT_TX_QUEUE_DEPTH;
+    config->retry_interval = UDP2CAN_DEFAULT_RETRY_INTERVAL;
+    memset(&config->receiver, 0, sizeof(config->receiver));
+    config->receiver.source = SOURCE_RECEIVER;
+    config->receiver.fd = -1;
+    memset(&config->retry, 0, sizeof(config->retry));
+    config->retry.source = SOURCE_RETRY;
+    config->retry.fd = -1;
+    config->log_timer.source = SOURCE_LOG;
+    config->log_timer.fd = -1;
+    config->epoll_fd = -1;
+
+    config_init(&cf);
+
+    /* set default name if none is provided */
+    if (!config_file_name)
+        config_file_name = UDP2CAN_DEFAULT_CONFIG_FILENAME;
+
+    /* .. try reading config file */
+    if (config_read_file(&cf, config_file_name) != CONFIG_TRUE)
+    {
+        daemon_log(LOG_ERR, "Error parsing config file '%s' %s:%d - %s\n",
+                   config_file_name,
+                   config_error_file(&cf),
+                   config_error_line(&cf),
+                   config_error_text(&cf));
+
+        /* .. release and exit  */
+        config_destroy(&cf);
+        return -1;
+    }
+
+    /* .. read the configuration */
+    config_lookup_int(&cf, "port", &config->port);
+    config_lookup_int(&cf, "receive_buffer", &config->receive_buffer);
+    config_lookup_int(&cf, "receive_batch_size", &config->receive_batch_size);
+    config_lookup_int(&cf, "mtu", &config->mtu);
+    config_lookup_int(&cf, "send_batch_size", &config->send_batch_size);
+    config_lookup_int(&cf, "tx_queue_depth", &config->tx_queue_depth);
+    config_lookup_int(&cf, "retry_interval", &config->retry_interval);
+
+    if (config->receive_batch_size < 1)
+        config->receive_batch_size = 1;
+    if (config->send_batch_size < 1)
+        config->send_batch_size = 1;
+
+    /* .. a datagram must hold at least a version 2 packet */
+    if (config->mtu < (int)sizeof(can2udp_packet_t))
+        config->mtu = sizeof(can2udp_packet_t);
+
+    if (config->tx_queue_depth < 2 || (config->tx_queue_depth & (config->tx_queue_depth - 1)))
+    {
+        daemon_log(LOG_WARNING, "Transmit queue depth %d is not a power of 2. Using %d.",
+                   config->tx_queue_depth, UDP2CAN_DEFAULT_TX_QUEUE_DEPTH);
+        config->tx_queue_depth = UDP2CAN_DEFAULT_TX_QUEUE_DEPTH;
+    }
+
+    config_lookup_string(&cf, "address", &config->address);
+    if (config->address)
+        config->address = strdup(config->address);
+
+    config_lookup_string(&cf, "interface", &config->interface);
+    if (config->interface)
+        config->interface = strdup(config->interface);
+
+    /* .. read interfaces */
+    const config_setting_t *channels = config_lookup(&cf, "interfaces");
+    if (channels)
+    {
+        int count = config_setting_length(channels);
+        channel_t *chc = NULL;
+
+        for (i = 0; i < count; i++)
+        {
+            if (chc)
+            {
+                /* .. allocate memory for new element and jump to it */
+                chc->next = malloc(sizeof(*chc));
+                chc = chc->next;
+            }
+            else
+            {
+                /* .. allocate memory for the first element and store it */
+                chc = malloc(sizeof(*chc));
+                config->channels = chc;
+            }
+
+            if (!chc)
+            {
+                daemon_log(LOG_ERR, "Out of memory");
+
+                config_destroy(&cf);
+                return -1;
+            }
+
+            /* .. set default values */
+            memset(chc, 0, sizeof(*chc));
+            chc->source = SOURCE_CHANNEL;
+            chc->interface_name = "vcan0";
+            chc->udp_interface_index = i;
+            chc->raw_socket = -1;
+            chc->can_fd_enabled = 1;
+
+            /* .. parse config for the channel */
+            config_setting_t *channel = config_setting_get_elem(channels, i);
+            if (channel)
+            {
+                config_setting_lookup_string(channel, "name", &chc->interface_name);
+                config_setting_lookup_int(channel, "interface_index", &chc->udp_interface_index);
+                config_setting_lookup_bool(channel, "can_fd", &chc->can_fd_enabled);
+            }
+            chc->interface_name = strdup(chc->interface_name);
+            log_limit_init(&chc->tx_log, "frames lost on write errors", chc->interface_name);
+
+            if (chc->udp_interface_index < 0 || chc->udp_interface_index > UDP2CAN_MAX_INTERFACE_INDEX)
+            {
+                daemon_log(LOG_WARNING, "Invalid interface index %d of '%s'. Using %d.", chc->udp_interface_index, chc->interface_name, i);
+                chc->udp_interface_index = i;
+            }
+
+            if (chc->udp_interface_index >= config->index_map_size)
+                config->index_map_size = chc->udp_interface_index + 1;
+        }
+    }
+
+    /* .. release */
+    config_destroy(&cf);
+
+    return 0;
+}
+
+/*
+ * SocketCAN channel handling
+ */
+
+int channel_init(daemon_config_t *config, channel_t *chc)
+{
+    struct sockaddr_can addr;
+    unsigned int i, depth = config->tx_queue_depth;
+
+    /* .. create the socket */
+    if ((chc->raw_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+    {
+        daemon_log(LOG_WARNING, "CAN socket error: %m");
+        return -1;
+    }
+
+    if (fcntl(chc->raw_socket, F_SETFL, O_NONBLOCK) < 0)
+        daemon_log(LOG_WARNING, "Error setting nonblock for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+
+    /* .. the socket only writes, do not queue frames of the bus */
+    if (setsockopt(chc->raw_socket, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0) < 0)
+        daemon_log(LOG_WARNING, "Error disabling reception of CAN socket '%s'. Ignoring: %m", chc->interface_name);
+
+    addr.can_family = AF_CAN;
+    if (!(addr.can_ifindex = if_nametoindex(chc->interface_name)))
+    {
+        daemon_log(LOG_WARNING, "CAN interface '%s' not found: %m", chc->interface_name);
+        goto error;
+    }
+
+    if (bind(chc->raw_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        daemon_log(LOG_WARNING, "CAN socket bind failed for '%s': %m", chc->interface_name);
+        goto error;
+    }
+
+    /*.. try to enable CAN FD. CAN FD frames are dropped if it fails */
+    if (chc->can_fd_enabled &&
+        setsockopt(chc->raw_socket, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &chc->can_fd_enabled, sizeof(chc->can_fd_enabled)) < 0)
+    {
+        daemon_log(LOG_WARNING, "Error enabling CAN FD frames for CAN socket '%s'. Ignoring: %m", chc->interface_name);
+        chc->can_fd_enabled = 0;
+    }
+
+    /* .. allocate the ring and link io vectors to its slots once */
+    chc->frames = calloc(depth, sizeof(*chc->frames));
+    chc->iovs = calloc(depth, sizeof(*chc->iovs));
+    chc->msgs = calloc(config->send_batch_size, sizeof(*chc->msgs));
+    if (!chc->frames || !chc->iovs || !chc->msgs)
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        goto error;
+    }
+
+    for (i = 0; i < depth; i++)
+        chc->iovs[i].iov_base = &chc->frames[i];
+    chc->head = chc->tail = 0;
+    chc->mask = depth - 1;
+
+    /* .. the socket is watched only while its buffer is full */
+    struct epoll_event ev = { .events = 0, .data.ptr = chc };
+    if (epoll_ctl(config->epoll_fd, EPOLL_CTL_ADD, chc->raw_socket, &ev) < 0)
+    {
+        daemon_log(LOG_WARNING, "Cannot watch CAN socket for '%s': %m", chc->interface_name);
+        goto error;
+    }
+
+    return 0;
+
+error:
+    close(chc->raw_socket);
+    chc->raw_socket = -1;
+
+    return -1;
+}
+
+/* .. queue a frame for transmission. Returns -EAGAIN if the queue is full */
+static inline int channel_push(channel_t *chc, const struct canfd_frame *frame, int fd)
+{
+    uint32_t slot = chc->head & chc->mask;
+
+    /* .. the interface cannot send it, waiting would not help */
+    if (fd && !chc->can_fd_enabled)
+    {
+        chc->dropped++;
+        return 0;
+    }
+
+    if (chc->head - chc->tail > chc->mask)
+        return -EAGAIN;
+
+    chc->frames[slot] = *frame;
+    chc->iovs[slot].iov_len = fd ? CANFD_MTU : CAN_MTU;
+
+    /* .. classic frames have no flags, the byte is padding of struct can_frame */
+    if (!fd)
+        chc->frames[slot].flags = 0;
+
+    chc->head++;
+    chc->frames_in++;
+
+    return 0;
+}
+
+/* .. start the retry timer unless it runs already */
+void retry_timer_arm(daemon_config_t *config)
+{
+    struct itimerspec timer = {
+        .it_value = {
+            .tv_sec = config->retry_interval / 1000000,
+            .tv_nsec = (config->retry_interval % 1000000) * 1000,
+        },
+    };
+
+    if (config->retry.armed)
+        return;
+
+    /* .. a zero time would stop the timer */
+    if (!timer.it_value.tv_sec && !timer.it_value.tv_nsec)
+        timer.it_value.tv_nsec = 1000;
+
+    if (timerfd_settime(config->retry.fd, 0, &timer, NULL) < 0)
+        daemon_log(LOG_WARNING, "Error starting retry timer. %m");
+    else
+        config->retry.armed = 1;
+}
+
+/* .. write queued frames with as few sendmmsg() calls as possible. Frames are kept when the bus is busy */
+int channel_flush(daemon_config_t *config, channel_t *chc)
+{
+    int ret = 0;
+
+    while (chc->head != chc->tail && !chc->waiting)
+    {
+        uint32_t pending = chc->head - chc->tail, i;
+        int n;
+
+        if (pending > (uint32_t)config->send_batch_size)
+            pending = config->send_batch_size;
+
+        for (i = 0; i < pending; i++)
+        {
+            chc->msgs[i].msg_hdr.msg_iov = &chc->iovs[(chc->tail + i) & chc->mask];
+            chc->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        if ((n = sendmmsg(chc->raw_socket, chc->msgs, pending, MSG_DONTWAIT)) > 0)
+        {
+            chc->tail += n;
+            chc->frames_out += n;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        /* .. the socket buffer is full, continue when it has room */
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = chc };
+
+            if (epoll_ctl(config->epoll_fd, EPOLL_CTL_MOD, chc->raw_socket, &ev) == 0)
+                chc->waiting = 1;
+            else
+                retry_timer_arm(config);
+            return -EAGAIN;
+        }
+
+        /* .. the transmit queue of the interface is full. It does not signal room, so try again later */
+        if (errno == ENOBUFS)
+        {
+            retry_timer_arm(config);
+            return -ENOBUFS;
+        }
+
+        /* .. the frame cannot be sent at all, drop it and go on with the rest */
+        log_limit_count(&chc->tx_log, errno);
+        chc->dropped++;
+        chc->tail++;
+        ret = -errno;
+    }
+
+    return ret;
+}
+
+/* .. the socket buffer has room again */
+int channel_process(daemon_config_t *config, channel_t *chc)
+{
+    struct epoll_event ev = { .events = 0, .data.ptr = chc };
+
+    epoll_ctl(config->epoll_fd, EPOLL_CTL_MOD, chc->raw_socket, &ev);
+    chc->waiting = 0;
+
+    return channel_flush(config, chc);
+}
+
+void channel_close(daemon_config_t *config, channel_t *chc)
+{
+    if (chc->raw_socket >= 0)
+    {
+        if (chc->head != chc->tail)
+            daemon_log(LOG_WARNING, "%u frames of '%s' were not sent.", chc->head - chc->tail, chc->interface_name);
+
+        daemon_log(LOG_INFO, "'%s': %llu frames queued, %llu written, %llu dropped.", chc->interface_name,
+                   (unsigned long long)chc->frames_in, (unsigned long long)chc->frames_out, (unsigned long long)chc->dropped);
+
+        epoll_ctl(config->epoll_fd, EPOLL_CTL_DEL, chc->raw_socket, NULL);
+        close(chc->raw_socket);
+    }
+    chc->raw_socket = -1;
+
+    free(chc->frames);
+    free(chc->iovs);
+    free(chc->msgs);
+    chc->frames = NULL;
+    chc->iovs = NULL;
+    chc->msgs = NULL;
+
+    log_limit_free(&chc->tx_log);
+    free((void *)chc->interface_name);
+    chc->interface_name = NULL;
+}
+
+/*
+ * UDP reception
+ */
+
+int receiver_init(daemon_config_t *config)
+{
+    receiver_t *rx = &config->receiver;
+    const char *address = config->address ? config->address : "::";
+    struct addrinfo *ai;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE,
+    };
+    const int yes = 1;
+    unsigned int ifindex = 0, i;
+    char service[16];
+
+    /* .. IPv4 and IPv6 addresses, the default one accepts both */
+    snprintf(service, sizeof(service), "%d", config->port);
+    if (getaddrinfo(address, service, &hints, &ai) != 0)
+    {
+        daemon_log(LOG_ERR, "Invalid listen address '%s'.", address);
+        return -1;
+    }
+
+    if ((rx->fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating UDP socket %m.");
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    /* .. several receivers may listen to the same group */
+    setsockopt(rx->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    if (config->receive_buffer > 0 &&
+        setsockopt(rx->fd, SOL_SOCKET, SO_RCVBUF, &config->receive_buffer, sizeof(config->receive_buffer)) < 0)
+        daemon_log(LOG_WARNING, "Cannot set receive buffer of UDP socket. Ignoring: %m");
+
+    if (config->interface)
+    {
+        if (setsockopt(rx->fd, SOL_SOCKET, SO_BINDTODEVICE, config->interface, strlen(config->interface)) < 0)
+            daemon_log(LOG_WARNING, "Cannot bind UDP socket to '%s'. Packets are received on all interfaces. %m", config->interface);
+        ifindex = if_nametoindex(config->interface);
+    }
+
+    if (bind(rx->fd, ai->ai_addr, ai->ai_addrlen) < 0)
+    {
+        daemon_log(LOG_ERR, "UDP socket bind to '%s' port %d failed: %m", address, config->port);
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    /* .. join the group of a multicast address */
+    if (ai->ai_family == AF_INET && IN_MULTICAST(ntohl(((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr)))
+    {
+        struct ip_mreqn mreq = {
+            .imr_multiaddr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr,
+            .imr_ifindex = ifindex,
+        };
+
+        if (setsockopt(rx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            daemon_log(LOG_WARNING, "Cannot join multicast group '%s'. %m", address);
+    }
+    else if (ai->ai_family == AF_INET6 && IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr))
+    {
+        struct ipv6_mreq mreq = {
+            .ipv6mr_multiaddr = ((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr,
+            .ipv6mr_interface = ifindex,
+        };
+
+        if (setsockopt(rx->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0)
+            daemon_log(LOG_WARNING, "Cannot join multicast group '%s'. %m", address);
+    }
+    freeaddrinfo(ai);
+
+    /* .. allocate buffers for batched reading */
+    rx->size = config->receive_batch_size;
+    rx->mtu = config->mtu;
+    rx->buffers = calloc(rx->size, rx->mtu);
+    rx->msgs = calloc(rx->size, sizeof(*rx->msgs));
+    rx->iovs = calloc(rx->size, sizeof(*rx->iovs));
+    if (!rx->buffers || !rx->msgs || !rx->iovs)
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    for (i = 0; i < rx->size; i++)
+    {
+        rx->iovs[i].iov_base = rx->buffers + i * rx->mtu;
+        rx->iovs[i].iov_len = rx->mtu;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    rx->count = rx->current = 0;
+    rx->offset = 0;
+    log_limit_init(&rx->invalid_log, "datagrams rejected", NULL);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = rx };
+    if (epoll_ctl(config->epoll_fd, EPOLL_CTL_ADD, rx->fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot watch UDP socket: %m");
+        return -1;
+    }
+
+    daemon_log(LOG_INFO, "Listening on '%s' port %d.", address, config->port);
+
+    return 0;
+}
+
+void receiver_close(daemon_config_t *config)
+{
+    receiver_t *rx = &config->receiver;
+
+    if (rx->fd >= 0)
+    {
+        daemon_log(LOG_INFO, "%llu datagrams received, %llu rejected.",
+                   (unsigned long long)rx->datagrams, (unsigned long long)rx->invalid);
+
+        epoll_ctl(config->epoll_fd, EPOLL_CTL_DEL, rx->fd, NULL);
+        close(rx->fd);
+    }
+    rx->fd = -1;
+
+    log_limit_free(&rx->invalid_log);
+    free(rx->buffers);
+    free(rx->msgs);
+    free(rx->iovs);
+    rx->buffers = NULL;
+    rx->msgs = NULL;
+    rx->iovs = NULL;
+}
+
+/* .. channel of the interface id, NULL if it is not configured */
+static inline channel_t *receiver_lookup(daemon_config_t *config, uint16_t interface_id)
+{
+    if (interface_id >= config->index_map_size)
+        return NULL;
+
+    return config->index_map[interface_id];
+}
+
+/* .. queue records of a version 3 or 4 packet starting at rx->offset. Returns -EAGAIN if a queue is full */
+int receiver_decode_records(daemon_config_t *config, const uint8_t *data, size_t length)
+{
+    receiver_t *rx = &config->receiver;
+    const can2udp_packet_ver3_t *header = (const can2udp_packet_ver3_t *)data;
+    size_t header_length = header->version == CAN2UDP_PACKET_VERSION_4 ? sizeof(can2udp_packet_ver4_t) : sizeof(*header);
+    channel_t *chc;
+
+    if (length < header_length || !(chc = receiver_lookup(config, header->interface_id)))
+        return -EINVAL;
+
+    /* .. check the whole packet first, no frame of a malformed one is sent */
+    if (!rx->offset)
+    {
+        size_t offset = header_length, size;
+        unsigned int count = 0;
+
+        if (header->flags & CAN2UDP_COMPACT)
+        {
+            struct canfd_frame frame;
+
+            for (; offset < length; offset += size, count++)
+                if (!(size = can2udp_compact_record_decode(data + offset, length - offset, &frame, NULL)))
+                    return -EINVAL;
+        }
+        else
+        {
+            count = (length - offset) / sizeof(can2udp_record_t);
+            offset += count * sizeof(can2udp_record_t);
+        }
+
+        if (offset != length || count != header->count)
+            return -EINVAL;
+
+        rx->offset = header_length;
+    }
+
+    while (rx->offset < length)
+    {
+        struct canfd_frame frame;
+        size_t size;
+
+        if (header->flags & CAN2UDP_COMPACT)
+        {
+            /* .. records were validated above, a damaged one must not stop the walk */
+            if (!(size = can2udp_compact_record_decode(data + rx->offset, length - rx->offset, &frame, NULL)))
+                return -EINVAL;
+        }
+        else
+        {
+            size = sizeof(can2udp_record_t);
+            memcpy(&frame, data + rx->offset, sizeof(frame));
+        }
+
+        if (channel_push(chc, &frame, (frame.flags & CANFD_FDF) || frame.len > CAN_MAX_DLEN) < 0)
+            return -EAGAIN;
+
+        rx->offset += size;
+    }
+
+    return 0;
+}
+
+/* .. queue frames of the received datagram. Returns -EAGAIN if a queue is full */
+int receiver_decode_datagram(daemon_config_t *config, unsigned int i)
+{
+    receiver_t *rx = &config->receiver;
+    const uint8_t *data = rx->iovs[i].iov_base;
+    size_t length = rx->msgs[i].msg_len;
+    channel_t *chc;
+
+    /* .. a datagram cut to the mtu would be decoded partially */
+    if (!length || (rx->msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+        return -EMSGSIZE;
+
+    switch (data[0])
+    {
+    case CAN2UDP_PACKET_VERSION_1:
+    {
+        const can2udp_packet_ver1_t *packet = (const can2udp_packet_ver1_t *)data;
+        struct canfd_frame frame;
+
+        if (length != sizeof(*packet) || !(chc = receiver_lookup(config, packet->interface_id)))
+            return -EINVAL;
+
+        memset(&frame, 0, sizeof(frame));
+        memcpy(&frame, &packet->raw_frame, sizeof(packet->raw_frame));
+
+        return channel_push(chc, &frame, 0);
+    }
+
+    case CAN2UDP_PACKET_VERSION_2:
+    {
+        const can2udp_packet_t *packet = (const can2udp_packet_t *)data;
+        struct canfd_frame frame;
+
+        if (length != sizeof(*packet) || !(chc = receiver_lookup(config, packet->interface_id)))
+            return -EINVAL;
+
+        memcpy(&frame, &packet->raw_frame, sizeof(frame));
+
+        return channel_push(chc, &frame, (frame.flags & CANFD_FDF) || frame.len > CAN_MAX_DLEN);
+    }
+
+    case CAN2UDP_PACKET_VERSION_3:
+    case CAN2UDP_PACKET_VERSION_4:
+        return receiver_decode_records(config, data, length);
+
+    default:
+        return -EPROTONOSUPPORT;
+    }
+}
+
+/* .. queue frames of the batch from where decoding stopped. Returns -EAGAIN if a queue is full */
+int receiver_decode(daemon_config_t *config)
+{
+    receiver_t *rx = &config->receiver;
+    int err;
+
+    for (; rx->current < rx->count; rx->current++, rx->offset = 0)
+    {
+        if ((err = receiver_decode_datagram(config, rx->current)) == -EAGAIN)
+            return err;
+
+        if (err < 0)
+        {
+            rx->invalid++;
+            log_limit_count(&rx->invalid_log, -err);
+        }
+    }
+
+    return 0;
+}
+
+/* .. write frames of all channels */
+void channels_flush(daemon_config_t *config)
+{
+    channel_t *chc;
+
+    for (chc = config->channels; chc; chc = chc->next)
+        if (chc->raw_socket >= 0 && chc->head != chc->tail)
+            channel_flush(config, chc);
+}
+
+/* .. stop or restart reading the UDP socket. Datagrams wait in the socket buffer meanwhile */
+void receiver_pause(daemon_config_t *config, int paused)
+{
+    receiver_t *rx = &config->receiver;
+    struct epoll_event ev = { .events = paused ? 0 : EPOLLIN, .data.ptr = rx };
+
+    if (rx->paused == paused)
+        return;
+
+    if (epoll_ctl(config->epoll_fd, EPOLL_CTL_MOD, rx->fd, &ev) < 0)
+        daemon_log(LOG_WARNING, "Error %s UDP socket. %m", paused ? "pausing" : "resuming");
+    rx->paused = paused;
+}
+
+/* .. read a batch of datagrams and queue their frames */
+int receiver_process(daemon_config_t *config)
+{
+    receiver_t *rx = &config->receiver;
+    unsigned int i;
+    int n;
+
+    /* .. the previous batch must be queued completely first */
+    if (rx->count && receiver_decode(config) < 0)
+    {
+        receiver_pause(config, 1);
+        return 0;
+    }
+
+    for (i = 0; i < rx->size; i++)
+        rx->msgs[i].msg_hdr.msg_flags = 0;
+
+    if ((n = recvmmsg(rx->fd, rx->msgs, rx->size, MSG_DONTWAIT, NULL)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+
+        daemon_log(LOG_WARNING, "Error reading data from UDP socket. %m");
+        return -errno;
+    }
+
+    rx->datagrams += n;
+    rx->count = n;
+    rx->current = 0;
+    rx->offset = 0;
+
+    /* .. queues are full, read again when frames are written */
+    if (receiver_decode(config) < 0)
+        receiver_pause(config, 1);
+
+    return 0;
+}
+
+/* .. the retry timer expired, write frames again */
+int retry_timer_process(daemon_config_t *config)
+{
+    uint64_t expirations;
+
+    if (read(config->retry.fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        daemon_log(LOG_WARNING, "Error reading retry timer. %m");
+    config->retry.armed = 0;
+
+    return 0;
+}
+
+/*
+ * System integration functions.
+ */
+
+int system_init(daemon_config_t *config, const char* config_file_name)
+{
+    channel_t *chc;
+
+    if (parse_config(config, config_file_name) < 0)
+        return -1;
+
+    /* .. create epoll instance for the event loop */
+    if ((config->epoll_fd = epoll_create1(0)) < 0)
+    {
+        daemon_log(LOG_ERR, "Error creating epoll instance. %m");
+        return -1;
+    }
+
+    if ((config->retry.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot create the retry timer. %m");
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &config->retry };
+    if (epoll_ctl(config->epoll_fd, EPOLL_CTL_ADD, config->retry.fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot watch the retry timer. %m");
+        return -1;
+    }
+
+    /* .. pending warnings are reported even if no datagram arrives */
+    ev.data.ptr = &config->log_timer;
+    if ((config->log_timer.fd = log_timer_open()) < 0 ||
+        epoll_ctl(config->epoll_fd, EPOLL_CTL_ADD, config->log_timer.fd, &ev) < 0)
+    {
+        daemon_log(LOG_ERR, "Cannot watch the timer of warning reports. %m");
+        return -1;
+    }
+
+    /* .. init all SocketCAN channels */
+    int good_channels = 0;
+
+    if (config->index_map_size &&
+        !(config->index_map = calloc(config->index_map_size, sizeof(*config->index_map))))
+    {
+        daemon_log(LOG_ERR, "Out of memory");
+        return -1;
+    }
+
+    for (chc = config->channels; chc; chc = chc->next)
+    {
+        if (channel_init(config, chc) < 0)
+            continue;
+
+        if (config->index_map[chc->udp_interface_index])
+            daemon_log(LOG_WARNING, "Interface index %d of '%s' is used by '%s' already.", chc->udp_interface_index,
+                       chc->interface_name, config->index_map[chc->udp_interface_index]->interface_name);
+        else
+            config->index_map[chc->udp_interface_index] = chc;
+
+        good_channels++;
+    }
+
+    daemon_log(LOG_INFO, "Initialized %d good channels.", good_channels);
+
+    if (!good_channels)
+    {
+        daemon_log(LOG_ERR, "No channels to work with. Exit.");
+        return -ENODATA;
+    }
+
+    /* .. start receiving once the channels are ready */
+    if (receiver_init(config) < 0)
+        return -1;
+
+    return 0;
+}
+
+int system_check_channels_and_process(daemon_config_t *config, struct epoll_event *events, int count)
+{
+    int i;
+
+    /* .. dispatch only sockets which are ready */
+    for (i = 0; i < count; i++)
+    {
+        event_source_t *source = events[i].data.ptr;
+
+        /* .. signals are handled by the caller */
+        if (!source)
+            continue;
+
+        switch (*source)
+        {
+        case SOURCE_RECEIVER:
+            receiver_process(config);
+            break;
+
+        case SOURCE_RETRY:
+            retry_timer_process(config);
+            break;
+
+        case SOURCE_LOG:
+            log_timer_process(config->log_timer.fd);
+            break;
+
+        case SOURCE_CHANNEL:
+            channel_process(config, (channel_t *)source);
+            break;
+        }
+    }
+
+    /* .. write frames produced in this iteration */
+    channels_flush(config);
+
+    /* .. go on with the stopped batch if the queues have room now */
+    if (config->receiver.paused && receiver_decode(config) == 0)
+    {
+        receiver_pause(config, 0);
+        channels_flush(config);
+    }
+
+    return 0;
+}
+
+void system_close(daemon_config_t *config)
+{
+    /* .. stop receiving first */
+    receiver_close(config);
+
+    /* .. loop through all channels */
+    channel_t *chc = config->channels;
+    while (chc)
+    {
+        channel_close(config, chc);
+
+        /* .. free this element and go to the next in list */
+        channel_t *next = chc->next;
+        free(chc);
+        chc = next;
+    }
+    config->channels = NULL;
+
+    free(config->index_map);
+    config->index_map = NULL;
+
+    if (config->retry.fd >= 0)
+        close(config->retry.fd);
+    config->retry.fd = -1;
+
+    if (config->log_timer.fd >= 0)
+        close(config->log_timer.fd);
+    config->log_timer.fd = -1;
+
+    /* .. close epoll instance */
+    if (config->epoll_fd >= 0)
+        close(config->epoll_fd);
+    config->epoll_fd = -1;
+
+    /* .. free strings */
+    free((void *)config->address);
+    config->address = NULL;
+    free((void *)config->interface);
+    config->interface = NULL;
+}
+
+/*
+ * Main daemon routines
+ */
+
+#define run_or_return(fun, retval) \
+    do { int rv = fun; \
+    if (rv < 0) \
+{ daemon_log(LOG_ERR, #fun " failed (%d): %s", rv, strerror(errno)); \
+    return retval; } \
+    } while (0)
+
+#define run_or_retval(fun, retval) \
+    do { int rv = fun; \
+    if (rv < 0) \
+{ daemon_log(LOG_ERR, #fun " failed (%d): %s", rv, strerror(errno)); \
+    if (run_daemon && retval != 0) daemon_retval_send(retval); \
+    goto finish; } \
+    } while (0)
+
+int main(int argc, char **argv)
+{
+    pid_t pid;
+    int run_daemon = 1;
+    int verbosity = 0;
+    int quit = 0;
+    daemon_config_t config;
+    const char* config_file_name = UDP2CAN_DEFAULT_CONFIG_FILENAME;
+
+    /*.. use damon name from command line for both syslog and PID file */
+    daemon_pid_file_ident = daemon_log_ident = daemon_ident_from_argv0(argv[0]);
+
+    int c;
+    while ((c = getopt (argc, argv, "kDtvc:")) != -1)
+        switch (c)
+        {
+        case 'k':
+            run_or_return(daemon_pid_file_kill_wait(SIGTERM, 5), 4);
+            return 0;
+
+        case 'D':
+            run_daemon = 1;
+            daemon_log_use = DAEMON_LOG_AUTO;
+            break;
+
+        case 't':
+            run_daemon = 0;
+            daemon_log_use = DAEMON_LOG_STDERR;
+            break;
+
+        case 'v':
+            verbosity = 1;
+            daemon_set_verbosity(verbosity ? 7 : 3);
+            break;
+
+        case 'c':
+            config_file_name = optarg;
+            break;
+
+        case '?':
+            if (optopt == 'c')
+                daemon_log(LOG_ERR, "Option -%c requires an argument.\n", optopt);
+            else if (isprint(optopt))
+                daemon_log(LOG_ERR, "Unsupported comand line option provided: %c", optopt);
+            return 1;
+
+        default:
+            abort();
+        }
+
+    /*.. fix signals for the daemon */
+    run_or_return(daemon_reset_sigs(-1), 2);
+    run_or_return(daemon_unblock_sigs(-1), 3);
+
+    if ((pid = daemon_pid_file_is_running()) >= 0)
+    {
+        daemon_log(LOG_ERR, "Already running, pid=%u", pid);
+        return 1;
+    }
+
+    run_or_return(daemon_retval_init(), 1);
+
+    /*.. fork the daemon */
+    if (run_daemon && (pid = daemon_fork()) < 0)
+    {
+
+        /*.. error -> exit */
+        daemon_retval_done();
+        return 1;
+
+    }
+    else if (run_daemon && pid)
+    {
+        /*.. parent */
+        int ret;
+
+        /*.. 20 seconds timeout */
+        if ((ret = daemon_retval_wait(20)) < 0)
+        {
+            daemon_log(LOG_ERR, "Could not recieve return value from daemon process: %s", strerror(errno));
+            return 6;
+        }
+
+        if (ret != 0)
+            daemon_log(LOG_ERR, "Daemon failed with return value %i", ret);
+
+        return ret;
+    }
+    else
+    {
+        /* daemon */
+        daemon_log(LOG_INFO, "Starting %s ver: " VERSION "...", daemon_log_ident);
+
+        /*.. close FDs */
+        run_or_retval(daemon_close_all(-1), 7);
+
+        /*.. housekeeping */
+        if (run_daemon)
+            run_or_retval(daemon_pid_file_create(), 8);
+        run_or_retval(daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, 0), 9);
+
+        /*.. init subsystems*/
+        run_or_retval(system_init(&config, config_file_name), 10);
+
+        /* add dameon signal fd to the epoll set, it is told apart by NULL pointer */
+        struct epoll_event sev = { .events = EPOLLIN, .data.ptr = NULL };
+        run_or_retval(epoll_ctl(config.epoll_fd, EPOLL_CTL_ADD, daemon_signal_fd(), &sev), 10);
+
+        /* Send our status to parent process */
+        if (run_daemon)
+            daemon_retval_send(0);
+        daemon_log(LOG_INFO, "Started and working...");
+
+        while (!quit)
+        {
+            struct epoll_event events[UDP2CAN_MAX_EVENTS];
+            int i;
+
+            /* Wait for an incoming signal or data */
+            int ret = epoll_wait(config.epoll_fd, events, UDP2CAN_MAX_EVENTS, -1);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+            else if (ret < 0)
+            {
+                daemon_log(LOG_ERR, "epoll_wait(): %s", strerror(errno));
+                break;
+            }
+
+            /*.. handle daemon signals */
+            for (i = 0; i < ret; i++)
+            {
+                if (events[i].data.ptr)
+                    continue;
+
+                int sig;
+                run_or_retval((sig = daemon_signal_next()),  0);
+
+                switch (sig) {
+                case SIGINT:
+                case SIGQUIT:
+                case SIGTERM:
+                    daemon_log(LOG_WARNING, "Got SIGINT, SIGQUIT or SIGTERM.");
+                    quit = 1;
+                    goto close_and_finish;
+
+                case SIGHUP:
+                    daemon_log(LOG_INFO, "Got HUP. The configuration is read on start only, restart the daemon to apply changes.");
+                    break;
+                default:
+                    /*.. ignore other signals */;
+                }
+            }
+
+            /*.. process sockets which are ready */
+            run_or_retval(system_check_channels_and_process(&config, events, ret), 0);
+        }
+
+close_and_finish:
+        system_close(&config);
+
+finish:
+        daemon_log(LOG_INFO, "Terminating.");
+        if (run_daemon)
+        {
+            daemon_retval_send(255);
+            daemon_signal_done();
+            daemon_pid_file_remove();
+        }
+
+        return 0;
+    }
+}
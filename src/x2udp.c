@@ -0,0 +1,745 @@
+/*******************************************************************************
+ * x2udp.c
+ *
+ * Receiver library for UDP packets of can2udp and iio2udp.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+/*
+ * Includes
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "x2udp.h"
+
+/*
+ * Settings
+ */
+
+/* .. datagrams are stored at multiples of this, records of full frames stay aligned */
+#define X2UDP_BUFFER_ALIGN 8
+
+/* .. space for the SO_RXQ_OVFL counter */
+#define X2UDP_CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+
+/*
+ * Type declarations
+ */
+
+/* .. layout of the records of the datagram being walked */
+typedef
+enum record_format
+{
+    RECORD_VER1 = 0,
+    RECORD_VER2,
+    RECORD_FULL,
+    RECORD_COMPACT,
+    RECORD_IIO
+} record_format_t;
+
+/* .. sender identity: IPv4 addresses are mapped to IPv6, the port is in network byte order */
+typedef
+struct source_key
+{
+    uint8_t address[16];
+    uint16_t port;
+    uint16_t id;
+} source_key_t;
+
+struct x2udp_receiver
+{
+    x2udp_protocol_t protocol;
+
+    int fd;
+
+    /* .. datagrams read at once, maximal size of a datagram and the distance of buffers */
+    unsigned int size;
+    size_t mtu;
+    size_t stride;
+
+    /* .. storage of the batch */
+    uint8_t *buffers;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *names;
+    uint8_t *controls;
+
+    /* .. datagrams of the batch and the next one to walk */
+    unsigned int count;
+    unsigned int current;
+
+    /* .. records of the datagram being walked */
+    record_format_t format;
+    const uint8_t *next;
+    unsigned int remaining;
+    const uint8_t *details;
+
+    /* .. fields shared by all frames of the datagram */
+    x2udp_can_frame_t shared;
+
+    /* .. tracked senders, an open addressing table maps keys to them */
+    x2udp_source_t *sources;
+    source_key_t *keys;
+    unsigned int sources_count;
+    unsigned int max_sources;
+    int *table;
+    unsigned int table_mask;
+
+    /* .. sender of the previous datagram, most batches come from one sender */
+    unsigned int last_source;
+
+    /* .. CLOCK_MONOTONIC time the batch was read in nanoseconds */
+    uint64_t now;
+
+    x2udp_stats_t stats;
+};
+
+/*
+ * Unaligned access
+ */
+
+static inline uint16_t read16(const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * Senders
+ */
+
+static void source_key_make(source_key_t *key, const struct sockaddr_storage *address, uint16_t id)
+{
+    memset(key, 0, sizeof(*key));
+    key->id = id;
+
+    if (address->ss_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)address;
+
+        key->address[10] = key->address[11] = 0xff;
+        memcpy(&key->address[12], &in->sin_addr, 4);
+        key->port = in->sin_port;
+    }
+    else if (address->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)address;
+
+        memcpy(key->address, &in6->sin6_addr, 16);
+        key->port = in6->sin6_port;
+    }
+}
+
+/* .. FNV-1a, keys are short */
+static inline unsigned int source_key_hash(const source_key_t *key)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++)
+        hash = (hash ^ p[i]) * 16777619u;
+
+    return hash;
+}
+
+/* .. sender of the datagram, a new one is added. NULL if the table is full */
+static x2udp_source_t *source_lookup(x2udp_receiver_t *rx, unsigned int i, uint16_t id)
+{
+    source_key_t key;
+    unsigned int slot;
+
+    source_key_make(&key, &rx->names[i], id);
+
+    if (rx->sources_count && !memcmp(&rx->keys[rx->last_source], &key, sizeof(key)))
+        return &rx->sources[rx->last_source];
+
+    for (slot = source_key_hash(&key) & rx->table_mask; rx->table[slot] >= 0; slot = (slot + 1) & rx->table_mask)
+    {
+        if (!memcmp(&rx->keys[rx->table[slot]], &key, sizeof(key)))
+        {
+            rx->last_source = rx->table[slot];
+            return &rx->sources[rx->last_source];
+        }
+    }
+
+    if (rx->sources_count == rx->max_sources)
+    {
+        rx->stats.untracked++;
+        return NULL;
+    }
+
+    x2udp_source_t *source = &rx->sources[rx->sources_count];
+    memset(source, 0, sizeof(*source));
+    memcpy(&source->address, &rx->names[i], rx->msgs[i].msg_hdr.msg_namelen);
+    source->id = id;
+    rx->keys[rx->sources_count] = key;
+    rx->table[slot] = rx->last_source = rx->sources_count++;
+
+    return source;
+}
+
+/* .. account a version 4 packet */
+static void source_sequence(x2udp_source_t *source, uint32_t sequence, uint32_t drops, uint64_t now)
+{
+    int32_t distance = (int32_t)(sequence - source->sequence);
+    uint64_t silence = now - source->seen;
+
+    source->kernel_drops = drops;
+    source->seen = now;
+
+    if (!source->sequenced || distance >= 0)
+    {
+        if (source->sequenced)
+            source->lost += distance;
+        source->sequence = sequence + 1;
+        source->sequenced = 1;
+    }
+    else if (distance < -X2UDP_SEQUENCE_WINDOW || !sequence || silence > X2UDP_RESTART_SILENCE_NS)
+    {
+        /* .. not a late packet, a restarted sender starts over at 0. Follow the new sequence */
+        source->restarts++;
+        source->sequence = sequence + 1;
+    }
+    else
+        source->reordered++;
+}
+
+/*
+ * Datagram validation
+ */
+
+/* .. prepare walking a can2udp datagram. Returns 0 or -1 if it is malformed */
+static int datagram_open_can(x2udp_receiver_t *rx, unsigned int i)
+{
+    const uint8_t *data = rx->iovs[i].iov_base;
+    size_t length = rx->msgs[i].msg_len;
+    x2udp_can_frame_t *shared = &rx->shared;
+    x2udp_source_t *source;
+    size_t header_length;
+    unsigned int count;
+
+    if (!length)
+        return -1;
+
+    shared->version = data[0];
+
+    switch (data[0])
+    {
+    case CAN2UDP_PACKET_VERSION_1:
+        if (length != sizeof(can2udp_packet_ver1_t))
+            return -1;
+
+        rx->format = RECORD_VER1;
+        rx->next = data + offsetof(can2udp_packet_ver1_t, raw_frame);
+        count = 1;
+        break;
+
+    case CAN2UDP_PACKET_VERSION_2:
+        if (length != sizeof(can2udp_packet_t))
+            return -1;
+
+        rx->format = RECORD_VER2;
+        rx->next = data;
+        count = 1;
+        break;
+
+    case CAN2UDP_PACKET_VERSION_3:
+    case CAN2UDP_PACKET_VERSION_4:
+        header_length = data[0] == CAN2UDP_PACKET_VERSION_4 ? sizeof(can2udp_packet_ver4_t) : sizeof(can2udp_packet_ver3_t);
+        if (length < header_length)
+            return -1;
+
+        count = read16(data + offsetof(can2udp_packet_ver3_t, count));
+        rx->next = data + header_length;
+
+        /* .. records must fill the datagram exactly */
+        if (data[1] & CAN2UDP_COMPACT)
+        {
+            const uint8_t *p = rx->next, *end = data + length;
+            unsigned int n;
+
+            for (n = 0; n < count; n++)
+            {
+                if (end - p < (ptrdiff_t)sizeof(can2udp_compact_record_t) ||
+                    p[offsetof(can2udp_compact_record_t, len)] > CANFD_MAX_DLEN)
+                    return -1;
+                p += can2udp_compact_record_size(p[offsetof(can2udp_compact_record_t, len)]);
+            }
+
+            if (p != end)
+                return -1;
+
+            rx->format = RECORD_COMPACT;
+        }
+        else
+        {
+            if (length - header_length != (size_t)count * sizeof(can2udp_record_t))
+                return -1;
+
+            rx->format = RECORD_FULL;
+        }
+        break;
+
+    default:
+        return -1;
+    }
+
+    shared->packet_flags = data[1];
+    shared->interface_id = read16(data + offsetof(can2udp_packet_t, interface_id));
+
+    if ((source = source_lookup(rx, i, shared->interface_id)))
+    {
+        source->version = data[0];
+        source->packets++;
+        source->frames += count;
+
+        if (data[0] == CAN2UDP_PACKET_VERSION_4)
+            source_sequence(source, read32(data + offsetof(can2udp_packet_ver4_t, sequence)),
+                            read32(data + offsetof(can2udp_packet_ver4_t, drops)), rx->now);
+    }
+    shared->source = source;
+    rx->remaining = count;
+
+    return 0;
+}
+
+/* .. prepare walking an iio2udp datagram. Returns 0 or -1 if it is malformed */
+static int datagram_open_iio(x2udp_receiver_t *rx, unsigned int i)
+{
+    const uint8_t *data = rx->iovs[i].iov_base;
+    size_t length = rx->msgs[i].msg_len;
+    x2udp_source_t *source;
+    uint16_t device_id;
+
+    if (length != sizeof(iio2udp_packet_short_t) && length != sizeof(iio2udp_packet_long_t))
+        return -1;
+
+    if (data[0] != IIO2UDP_PACKET_VERSION)
+        return -1;
+
+    rx->format = RECORD_IIO;
+    rx->next = data;
+    rx->details = length == sizeof(iio2udp_packet_long_t) ? data : NULL;
+    rx->remaining = 1;
+
+    /* .. iio2udp sends ids in network order, sources keep them in host order */
+    device_id = ntohs(read16(data + offsetof(iio2udp_packet_short_t, device_id)));
+    if ((source = source_lookup(rx, i, device_id)))
+    {
+        source->version = data[0];
+        source->packets++;
+        source->frames++;
+    }
+    rx->shared.source = source;
+
+    return 0;
+}
+
+/* .. move to the next valid datagram of the batch. Returns 0 at the end of the batch */
+static int datagram_next(x2udp_receiver_t *rx)
+{
+    while (rx->current < rx->count)
+    {
+        unsigned int i = rx->current++;
+        int err;
+
+        if (rx->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            rx->stats.truncated++;
+            continue;
+        }
+
+        if (rx->protocol == X2UDP_CAN)
+            err = datagram_open_can(rx, i);
+        else
+            err = datagram_open_iio(rx, i);
+
+        if (err < 0)
+            rx->stats.invalid++;
+        else if (rx->remaining)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Public interface
+ */
+
+void x2udp_options_init(x2udp_options_t *options, x2udp_protocol_t protocol)
+{
+    memset(options, 0, sizeof(*options));
+    options->protocol = protocol;
+    options->port = protocol == X2UDP_IIO ? IIO2UDP_DEFAULT_PORT : CAN2UDP_DEFAULT_PORT;
+    options->batch_size = X2UDP_DEFAULT_BATCH_SIZE;
+    options->mtu = X2UDP_DEFAULT_MTU;
+    options->max_sources = X2UDP_DEFAULT_MAX_SOURCES;
+}
+
+/* .. create and bind the socket, join the group of a multicast address */
+static int receiver_socket(x2udp_receiver_t *rx, const x2udp_options_t *options)
+{
+    const char *address = options->address ? options->address : "::";
+    struct addrinfo *ai;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE,
+    };
+    const int yes = 1;
+    unsigned int ifindex = 0;
+    char service[16];
+    int err = 0;
+
+    snprintf(service, sizeof(service), "%d", options->port);
+    if (getaddrinfo(address, service, &hints, &ai) != 0)
+        return -EINVAL;
+
+    if ((rx->fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP)) < 0)
+    {
+        err = -errno;
+        goto out;
+    }
+
+    setsockopt(rx->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    /* .. the kernel reports datagrams dropped on a full receive buffer */
+    setsockopt(rx->fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof(yes));
+
+    if (options->receive_buffer > 0)
+        setsockopt(rx->fd, SOL_SOCKET, SO_RCVBUF, &options->receive_buffer, sizeof(options->receive_buffer));
+
+    if (options->interface)
+    {
+        if (!(ifindex = if_nametoindex(options->interface)))
+        {
+            err = -ENODEV;
+            goto out;
+        }
+        setsockopt(rx->fd, SOL_SOCKET, SO_BINDTODEVICE, options->interface, strlen(options->interface));
+    }
+
+    if (bind(rx->fd, ai->ai_addr, ai->ai_addrlen) < 0)
+    {
+        err = -errno;
+        goto out;
+    }
+
+    if (ai->ai_family == AF_INET && IN_MULTICAST(ntohl(((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr)))
+    {
+        struct ip_mreqn mreq = {
+            .imr_multiaddr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr,
+            .imr_ifindex = ifindex,
+        };
+
+        if (setsockopt(rx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            err = -errno;
+    }
+    else if (ai->ai_family == AF_INET6 && IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr))
+    {
+        struct ipv6_mreq mreq = {
+            .ipv6mr_multiaddr = ((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr,
+            .ipv6mr_interface = ifindex,
+        };
+
+        if (setsockopt(rx->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0)
+            err = -errno;
+    }
+
+out:
+    freeaddrinfo(ai);
+    return err;
+}
+
+x2udp_receiver_t *x2udp_receiver_open(const x2udp_options_t *options)
+{
+    x2udp_receiver_t *rx;
+    unsigned int i, table_size;
+    int err;
+
+    if (!options || !options->batch_size || !options->mtu ||
+        (options->protocol != X2UDP_CAN && options->protocol != X2UDP_IIO))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!(rx = calloc(1, sizeof(*rx))))
+        return NULL;
+
+    rx->protocol = options->protocol;
+    rx->fd = -1;
+    rx->size = options->batch_size;
+    rx->mtu = options->mtu;
+    rx->stride = (options->mtu + X2UDP_BUFFER_ALIGN - 1) & ~(size_t)(X2UDP_BUFFER_ALIGN - 1);
+    rx->max_sources = options->max_sources;
+
+    /* .. the table is kept at most half full */
+    for (table_size = 2; table_size < 2 * rx->max_sources; table_size <<= 1)
+        ;
+    rx->table_mask = table_size - 1;
+
+    rx->buffers = aligned_alloc(X2UDP_BUFFER_ALIGN, rx->size * rx->stride);
+    rx->msgs = calloc(rx->size, sizeof(*rx->msgs));
+    rx->iovs = calloc(rx->size, sizeof(*rx->iovs));
+    rx->names = calloc(rx->size, sizeof(*rx->names));
+    rx->controls = calloc(rx->size, X2UDP_CONTROL_SIZE);
+    rx->sources = calloc(rx->max_sources ? rx->max_sources : 1, sizeof(*rx->sources));
+    rx->keys = calloc(rx->max_sources ? rx->max_sources : 1, sizeof(*rx->keys));
+    rx->table = malloc(table_size * sizeof(*rx->table));
+    if (!rx->buffers || !rx->msgs || !rx->iovs || !rx->names || !rx->controls ||
+        !rx->sources || !rx->keys || !rx->table)
+    {
+        err = -ENOMEM;
+        goto error;
+    }
+
+    for (i = 0; i < table_size; i++)
+        rx->table[i] = -1;
+
+    for (i = 0; i < rx->size; i++)
+    {
+        rx->iovs[i].iov_base = rx->buffers + i * rx->stride;
+        rx->iovs[i].iov_len = rx->mtu;
+        rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+        rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        rx->msgs[i].msg_hdr.msg_name = &rx->names[i];
+        rx->msgs[i].msg_hdr.msg_control = rx->controls + i * X2UDP_CONTROL_SIZE;
+    }
+
+    if ((err = receiver_socket(rx, options)) < 0)
+        goto error;
+
+    return rx;
+
+error:
+    x2udp_receiver_close(rx);
+    errno = -err;
+
+    return NULL;
+}
+
+void x2udp_receiver_close(x2udp_receiver_t *rx)
+{
+    if (!rx)
+        return;
+
+    if (rx->fd >= 0)
+        close(rx->fd);
+
+    free(rx->buffers);
+    free(rx->msgs);
+    free(rx->iovs);
+    free(rx->names);
+    free(rx->controls);
+    free(rx->sources);
+    free(rx->keys);
+    free(rx->table);
+    free(rx);
+}
+
+int x2udp_receiver_fd(const x2udp_receiver_t *rx)
+{
+    return rx->fd;
+}
+
+int x2udp_receive(x2udp_receiver_t *rx, int timeout)
+{
+    unsigned int i;
+    int n;
+
+    rx->count = rx->current = 0;
+    rx->remaining = 0;
+
+    if (timeout)
+    {
+        struct pollfd pfd = { .fd = rx->fd, .events = POLLIN };
+
+        if ((n = poll(&pfd, 1, timeout)) < 0)
+            return -errno;
+        if (!n)
+            return 0;
+    }
+
+    for (i = 0; i < rx->size; i++)
+    {
+        rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->names[i]);
+        rx->msgs[i].msg_hdr.msg_controllen = X2UDP_CONTROL_SIZE;
+        rx->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    if ((n = recvmmsg(rx->fd, rx->msgs, rx->size, MSG_DONTWAIT, NULL)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -errno;
+
+    /* .. the drop counter is cumulative, the last datagram carries the latest value */
+    if (n > 0)
+    {
+        struct msghdr *msg = &rx->msgs[n - 1].msg_hdr;
+        struct cmsghdr *cmsg;
+
+        for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+            {
+                uint32_t drops;
+
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                rx->stats.socket_drops = drops;
+            }
+        }
+    }
+
+    if (n > 0)
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rx->now = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    rx->stats.datagrams += n;
+    rx->count = n;
+
+    return n;
+}
+
+int x2udp_next_can(x2udp_receiver_t *rx, x2udp_can_frame_t *frame)
+{
+    const uint8_t *p;
+
+    if (!rx->remaining && !datagram_next(rx))
+        return 0;
+
+    *frame = rx->shared;
+    p = rx->next;
+    rx->remaining--;
+
+    switch (rx->format)
+    {
+    case RECORD_VER1:
+        frame->can_id = read32(p + offsetof(struct can_frame, can_id));
+        frame->len = p[offsetof(struct can_frame, can_dlc)];
+        frame->flags = 0;
+        frame->data = p + offsetof(struct can_frame, data);
+        frame->timestamp = 0;
+        if (frame->len > CAN_MAX_DLEN)
+            frame->len = CAN_MAX_DLEN;
+        break;
+
+    case RECORD_VER2:
+        p += offsetof(can2udp_packet_t, raw_frame);
+        frame->can_id = read32(p + offsetof(struct canfd_frame, can_id));
+        frame->len = p[offsetof(struct canfd_frame, len)];
+        frame->flags = p[offsetof(struct canfd_frame, flags)];
+        frame->data = p + offsetof(struct canfd_frame, data);
+        frame->timestamp = read64(rx->next + offsetof(can2udp_packet_t, timestamp));
+        if (frame->len > CANFD_MAX_DLEN)
+            frame->len = CANFD_MAX_DLEN;
+        break;
+
+    case RECORD_FULL:
+        frame->can_id = read32(p + offsetof(struct canfd_frame, can_id));
+        frame->len = p[offsetof(struct canfd_frame, len)];
+        frame->flags = p[offsetof(struct canfd_frame, flags)];
+        frame->data = p + offsetof(struct canfd_frame, data);
+        frame->timestamp = read64(p + offsetof(can2udp_record_t, timestamp));
+        if (frame->len > CANFD_MAX_DLEN)
+            frame->len = CANFD_MAX_DLEN;
+        rx->next += sizeof(can2udp_record_t);
+        break;
+
+    case RECORD_COMPACT:
+        frame->timestamp = read64(p + offsetof(can2udp_compact_record_t, timestamp));
+        frame->can_id = read32(p + offsetof(can2udp_compact_record_t, can_id));
+        frame->len = p[offsetof(can2udp_compact_record_t, len)];
+        frame->flags = p[offsetof(can2udp_compact_record_t, flags)];
+        frame->data = p + offsetof(can2udp_compact_record_t, data);
+        rx->next += can2udp_compact_record_size(frame->len);
+        break;
+
+    default:
+        return 0;
+    }
+
+    return 1;
+}
+
+int x2udp_next_iio(x2udp_receiver_t *rx, x2udp_iio_sample_t *sample)
+{
+    if (!rx->remaining && !datagram_next(rx))
+        return 0;
+
+    rx->remaining--;
+    sample->source = rx->shared.source;
+    sample->packet = (const iio2udp_packet_short_t *)rx->next;
+    sample->details = (const iio2udp_packet_long_t *)rx->details;
+
+    return 1;
+}
+
+void x2udp_receiver_stats(const x2udp_receiver_t *rx, x2udp_stats_t *stats)
+{
+    *stats = rx->stats;
+}
+
+unsigned int x2udp_source_count(const x2udp_receiver_t *rx)
+{
+    return rx->sources_count;
+}
+
+const x2udp_source_t *x2udp_source_get(const x2udp_receiver_t *rx, unsigned int index)
+{
+    return index < rx->sources_count ? &rx->sources[index] : NULL;
+}
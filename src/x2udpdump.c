@@ -0,0 +1,305 @@
+/*******************************************************************************
+ * x2udpdump.c
+ *
+ * Dump tool for UDP packets of can2udp and iio2udp.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+/*
+ * Includes
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "x2udp.h"
+
+/*
+ * Settings
+ */
+
+/* .. size of the stdout buffer, lines are written in large chunks */
+#define X2UDPDUMP_OUTPUT_BUFFER (1024 * 1024)
+
+/* .. wait for datagrams at most this long, in ms, to notice signals and print rates */
+#define X2UDPDUMP_POLL_INTERVAL 200
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+/*
+ * Output
+ */
+
+static const char hex[] = "0123456789ABCDEF";
+
+/* .. print the frame in candump format with the sender interface id, e.g. "(1.000000000) 0 123#DEADBEEF" */
+static void print_can(const x2udp_can_frame_t *frame)
+{
+    char line[64 + 2 * CANFD_MAX_DLEN];
+    char *p = line;
+    unsigned int i;
+
+    p += sprintf(p, "(%llu.%09llu) %u ", (unsigned long long)(frame->timestamp / 1000000000ull),
+                 (unsigned long long)(frame->timestamp % 1000000000ull), frame->interface_id);
+
+    if (frame->can_id & CAN_EFF_FLAG)
+        p += sprintf(p, "%08X", frame->can_id & CAN_EFF_MASK);
+    else
+        p += sprintf(p, "%03X", frame->can_id & CAN_SFF_MASK);
+
+    *p++ = '#';
+    if (frame->flags & CANFD_FDF)
+    {
+        *p++ = '#';
+        *p++ = hex[frame->flags & 0x0f];
+    }
+
+    if (frame->can_id & CAN_RTR_FLAG)
+        *p++ = 'R';
+    else
+        for (i = 0; i < frame->len; i++)
+        {
+            *p++ = hex[frame->data[i] >> 4];
+            *p++ = hex[frame->data[i] & 0x0f];
+        }
+
+    *p++ = '\n';
+    fwrite(line, 1, p - line, stdout);
+}
+
+static void print_iio(const x2udp_iio_sample_t *sample)
+{
+    iio2udp_packet_short_t packet;
+
+    memcpy(&packet, sample->packet, sizeof(packet));
+
+    if (sample->details)
+        printf("%u:%u %.65s/%.65s quality=%u value=%.65s\n", ntohs(packet.device_id), ntohs(packet.channel_id),
+               sample->details->device_name, sample->details->channel_name,
+               ntohs(packet.OPCQuality), sample->details->value_string);
+    else
+        printf("%u:%u quality=%u value=0x%016llx\n", ntohs(packet.device_id), ntohs(packet.channel_id),
+               ntohs(packet.OPCQuality), (unsigned long long)packet.value_u64);
+}
+
+/* .. print counters of the receiver and every sender to stderr */
+static void print_stats(const x2udp_receiver_t *rx)
+{
+    x2udp_stats_t stats;
+    unsigned int i;
+
+    x2udp_receiver_stats(rx, &stats);
+    fprintf(stderr, "datagrams %llu, invalid %llu, truncated %llu, socket drops %llu, untracked %llu\n",
+            (unsigned long long)stats.datagrams, (unsigned long long)stats.invalid,
+            (unsigned long long)stats.truncated, (unsigned long long)stats.socket_drops,
+            (unsigned long long)stats.untracked);
+
+    for (i = 0; i < x2udp_source_count(rx); i++)
+    {
+        const x2udp_source_t *source = x2udp_source_get(rx, i);
+        char address[INET6_ADDRSTRLEN] = "?";
+        unsigned int port = 0;
+
+        if (source->address.ss_family == AF_INET)
+        {
+            const struct sockaddr_in *in = (const struct sockaddr_in *)&source->address;
+
+            inet_ntop(AF_INET, &in->sin_addr, address, sizeof(address));
+            port = ntohs(in->sin_port);
+        }
+        else if (source->address.ss_family == AF_INET6)
+        {
+            const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&source->address;
+
+            inet_ntop(AF_INET6, &in6->sin6_addr, address, sizeof(address));
+            port = ntohs(in6->sin6_port);
+        }
+
+        fprintf(stderr, "  %s:%u id %u v%u: packets %llu, frames %llu, lost %llu, reordered %llu, restarts %llu, kernel drops %u\n",
+                address, port, source->id, source->version,
+                (unsigned long long)source->packets, (unsigned long long)source->frames,
+                (unsigned long long)source->lost, (unsigned long long)source->reordered,
+                (unsigned long long)source->restarts,
+                source->kernel_drops);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-i] [-q] [-a address] [-p port] [-I interface] [-b batch] [-r bytes]\n"
+            "  -i  receive iio2udp packets instead of can2udp packets\n"
+            "  -q  do not print frames, print the frame rate every second\n"
+            "  -a  local or multicast address to listen on\n"
+            "  -p  UDP port, 4858 for can2udp and 4857 for iio2udp by default\n"
+            "  -I  network interface to receive on\n"
+            "  -b  datagrams read at once\n"
+            "  -r  size of the socket receive buffer\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    x2udp_options_t options;
+    x2udp_receiver_t *rx;
+    int protocol = X2UDP_CAN, quiet = 0, port = 0;
+    const char *address = NULL, *interface = NULL;
+    unsigned int batch_size = 0;
+    int receive_buffer = 0;
+    uint64_t frames = 0, reported = 0;
+    struct timespec last;
+    int c;
+
+    while ((c = getopt(argc, argv, "iqa:p:I:b:r:h")) != -1)
+        switch (c)
+        {
+        case 'i':
+            protocol = X2UDP_IIO;
+            break;
+
+        case 'q':
+            quiet = 1;
+            break;
+
+        case 'a':
+            address = optarg;
+            break;
+
+        case 'p':
+            port = atoi(optarg);
+            break;
+
+        case 'I':
+            interface = optarg;
+            break;
+
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+
+        case 'r':
+            receive_buffer = atoi(optarg);
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            return 0;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+
+    x2udp_options_init(&options, protocol);
+    options.address = address;
+    options.interface = interface;
+    options.receive_buffer = receive_buffer;
+    if (port)
+        options.port = port;
+    if (batch_size)
+        options.batch_size = batch_size;
+
+    if (!(rx = x2udp_receiver_open(&options)))
+    {
+        fprintf(stderr, "Cannot listen on '%s' port %d: %s\n", address ? address : "any", options.port, strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    setvbuf(stdout, NULL, _IOFBF, X2UDPDUMP_OUTPUT_BUFFER);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while (!quit)
+    {
+        int n = x2udp_receive(rx, X2UDPDUMP_POLL_INTERVAL);
+
+        if (n < 0 && n != -EINTR)
+        {
+            fprintf(stderr, "Error receiving: %s\n", strerror(-n));
+            break;
+        }
+
+        if (protocol == X2UDP_CAN)
+        {
+            x2udp_can_frame_t frame;
+
+            while (x2udp_next_can(rx, &frame))
+            {
+                frames++;
+                if (!quiet)
+                    print_can(&frame);
+            }
+        }
+        else
+        {
+            x2udp_iio_sample_t sample;
+
+            while (x2udp_next_iio(rx, &sample))
+            {
+                frames++;
+                if (!quiet)
+                    print_iio(&sample);
+            }
+        }
+
+        /* .. flush the output when the socket runs dry, and print the rate in quiet mode */
+        if (n <= 0 && !quiet)
+            fflush(stdout);
+
+        if (quiet)
+        {
+            struct timespec now;
+            double elapsed;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+            if (elapsed >= 1.0)
+            {
+                fprintf(stderr, "%.0f frames/s\n", (frames - reported) / elapsed);
+                reported = frames;
+                last = now;
+            }
+        }
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "%llu frames\n", (unsigned long long)frames);
+    print_stats(rx);
+    x2udp_receiver_close(rx);
+
+    return 0;
+}
@@ -0,0 +1,843 @@
+/*******************************************************************************
+ * x2udpreplay.c
+ *
+ * Replay of can2udp capture segments onto CAN interfaces or as UDP packets.
+ *
+ * Copyright (c) 2015-2017 Cogent Embedded Inc. ALL RIGHTS RESERVED.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *******************************************************************************/
+
+/*
+ * Includes
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "can2udp.h"
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/*
+ * Settings
+ */
+
+/* .. maximal number of recorded interfaces replayed together */
+#define REPLAY_MAX_STREAMS 32
+
+/* .. messages sent by one sendmmsg() call */
+#define REPLAY_BATCH_SIZE 64
+
+/* .. default time spun before a deadline instead of sleeping, in microseconds */
+#define REPLAY_DEFAULT_SPIN 50
+
+/* .. wait before writing again when the transmit queue of a CAN interface is full */
+#define REPLAY_RETRY_NS 100000
+
+/* .. limits of options: the largest UDP payload and the longest spin, in microseconds */
+#define REPLAY_MAX_MTU 65507
+#define REPLAY_MAX_SPIN 1000000
+
+/* .. limits of the time scale and of offsets and durations in seconds, times in ns stay within 64 bits */
+#define REPLAY_MAX_SPEED 1e6
+#define REPLAY_MAX_SECONDS 1e9
+
+/*
+ * Type declarations
+ */
+
+/* .. mapped capture segment */
+typedef
+struct segment
+{
+    const uint8_t *map;
+    const can2udp_segment_header_t *header;
+} segment_t;
+
+/* .. frames of one recorded interface in order of time */
+typedef
+struct stream
+{
+    /* .. recorded interface */
+    char name[IFNAMSIZ];
+    uint16_t interface_id;
+
+    /* .. segments sorted by sequence number */
+    segment_t segments[64];
+    unsigned int count;
+
+    /* .. position of the next frame: segment, block, records left in the block */
+    unsigned int segment;
+    uint32_t block;
+    unsigned int records;
+    const uint8_t *next;
+    const uint8_t *block_end;
+
+    /* .. the next frame, valid if 'pending' is set */
+    struct canfd_frame frame;
+    uint64_t timestamp;
+    int pending;
+
+    /* .. CAN interface frames are written to */
+    struct sockaddr_can target;
+
+    /* .. UDP packet being filled for version 3 and 4 */
+    uint8_t *aggregate;
+    size_t aggregate_length;
+    uint32_t sequence;
+} stream_t;
+
+/* .. messages waiting for sendmmsg() */
+typedef
+struct output
+{
+    int fd;
+
+    /* .. send UDP packets of this version instead of CAN frames, 0 for CAN */
+    int version;
+
+    /* .. the CAN socket accepts CAN FD frames */
+    int can_fd;
+    size_t mtu;
+
+    /* .. UDP destination */
+    struct sockaddr_storage address;
+    socklen_t address_length;
+
+    struct mmsghdr msgs[REPLAY_BATCH_SIZE];
+    struct iovec iovs[REPLAY_BATCH_SIZE];
+    uint8_t *buffers;
+    unsigned int count;
+
+    /* .. frames and messages sent, messages lost on errors */
+    uint64_t frames;
+    uint64_t messages;
+    uint64_t errors;
+
+    /* .. CAN FD frames the CAN socket cannot send */
+    uint64_t skipped;
+} output_t;
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Capture segments
+ */
+
+/* .. map the segment file and add it to the stream of its interface */
+int segment_open(stream_t *streams, unsigned int *count, const char *path)
+{
+    const can2udp_segment_header_t *header;
+    struct stat st;
+    stream_t *stream;
+    unsigned int i;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    map = st.st_size >= (off_t)sizeof(*header) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map '%s'\n", path);
+        return -1;
+    }
+
+    /* .. the index lies between the header and the blocks, offsets are compared before
+     *    they are subtracted so damaged headers cannot wrap the checks around */
+    header = map;
+    if (memcmp(header->magic, CAN2UDP_SEGMENT_MAGIC, sizeof(header->magic)) ||
+        header->version != CAN2UDP_SEGMENT_VERSION || header->size > (uint64_t)st.st_size ||
+        header->block_size < sizeof(can2udp_packet_ver3_t) ||
+        header->index_offset < sizeof(*header) || header->index_offset > header->data_offset ||
+        header->data_offset > header->size ||
+        header->block_count > (header->data_offset - header->index_offset) / sizeof(uint64_t) ||
+        header->block_count > (header->size - header->data_offset) / header->block_size ||
+        header->blocks > header->block_count)
+    {
+        fprintf(stderr, "'%s' is not a capture segment\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* .. empty segments have nothing to replay */
+    if (!header->frames)
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    for (i = 0; i < *count; i++)
+        if (!strncmp(streams[i].name, header->interface_name, sizeof(header->interface_name)))
+            break;
+
+    if (i == *count)
+    {
+        if (*count == REPLAY_MAX_STREAMS)
+        {
+            fprintf(stderr, "Too many interfaces, at most %d are supported\n", REPLAY_MAX_STREAMS);
+            munmap(map, st.st_size);
+            return -1;
+        }
+
+        stream = &streams[(*count)++];
+        memset(stream, 0, sizeof(*stream));
+        memcpy(stream->name, header->interface_name, sizeof(header->interface_name));
+        stream->interface_id = header->interface_id;
+    }
+    stream = &streams[i];
+
+    if (stream->count == sizeof(stream->segments) / sizeof(stream->segments[0]))
+    {
+        fprintf(stderr, "Too many segments of '%s'\n", stream->name);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* .. hardware stamps and system time do not mix, segments of older versions do not say */
+    if (stream->count && header->clock != stream->segments[0].header->clock &&
+        header->clock != CAN2UDP_SEGMENT_CLOCK_UNKNOWN && stream->segments[0].header->clock != CAN2UDP_SEGMENT_CLOCK_UNKNOWN)
+        fprintf(stderr, "Segments of '%s' use different clocks, their frames are not replayed in real order\n", stream->name);
+
+    /* .. keep segments ordered by sequence number */
+    for (i = stream->count; i > 0 && stream->segments[i - 1].header->sequence > header->sequence; i--)
+        stream->segments[i] = stream->segments[i - 1];
+    stream->segments[i].map = map;
+    stream->segments[i].header = header;
+    stream->count++;
+
+    return 0;
+}
+
+/* .. load the next frame of the stream into 'frame', clears 'pending' at the end */
+void stream_advance(stream_t *stream)
+{
+    uint64_t timestamp;
+    size_t size;
+
+    while (!stream->records)
+    {
+        const segment_t *seg;
+        const can2udp_packet_ver3_t *block;
+
+        if (stream->segment == stream->count)
+        {
+            stream->pending = 0;
+            return;
+        }
+
+        seg = &stream->segments[stream->segment];
+        if (stream->block >= seg->header->blocks)
+        {
+            stream->segment++;
+            stream->block = 0;
+            continue;
+        }
+
+        block = can2udp_segment_block(seg->map, stream->block++);
+        if (block->version != CAN2UDP_PACKET_VERSION_3 || !(block->flags & CAN2UDP_COMPACT))
+            continue;
+
+        stream->records = block->count;
+        stream->next = (const uint8_t *)(block + 1);
+        stream->block_end = (const uint8_t *)block + seg->header->block_size;
+    }
+
+    stream->records--;
+    if (!(size = can2udp_compact_record_decode(stream->next, stream->block_end - stream->next, &stream->frame, &timestamp)))
+    {
+        /* .. a damaged block, go on with the next one */
+        stream->records = 0;
+        stream_advance(stream);
+        return;
+    }
+
+    stream->next += size;
+    stream->timestamp = timestamp;
+    stream->pending = 1;
+}
+
+/* .. position the stream at the first frame at or after 'timestamp' */
+void stream_seek(stream_t *stream, uint64_t timestamp)
+{
+    stream->segment = 0;
+    stream->block = 0;
+    stream->records = 0;
+
+    /* .. skip segments ending before the time, then blocks by the index */
+    while (stream->segment < stream->count && stream->segments[stream->segment].header->last_timestamp < timestamp)
+        stream->segment++;
+    if (stream->segment < stream->count)
+        stream->block = can2udp_segment_seek(stream->segments[stream->segment].map, timestamp);
+
+    do
+        stream_advance(stream);
+    while (stream->pending && stream->timestamp < timestamp);
+}
+
+/*
+ * Output
+ */
+
+int output_init_can(output_t *out, stream_t *streams, unsigned int count, char **map, unsigned int map_count)
+{
+    const int enable = 1;
+    unsigned int i, j;
+
+    if ((out->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0)
+    {
+        fprintf(stderr, "CAN socket error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* .. the socket only writes */
+    setsockopt(out->fd, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+    out->can_fd = setsockopt(out->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable)) == 0;
+    if (!out->can_fd)
+        fprintf(stderr, "CAN FD frames are not supported, they are not replayed\n");
+
+    /* .. frames go to the interface of the same name unless it is mapped to another one */
+    for (i = 0; i < count; i++)
+    {
+        const char *name = streams[i].name;
+
+        for (j = 0; j < map_count; j++)
+        {
+            size_t length = strcspn(map[j], "=");
+
+            if (map[j][length] == '=' && length == strlen(streams[i].name) && !strncmp(map[j], streams[i].name, length))
+                name = map[j] + length + 1;
+        }
+
+        streams[i].target.can_family = AF_CAN;
+        if (!(streams[i].target.can_ifindex = if_nametoindex(name)))
+        {
+            fprintf(stderr, "CAN interface '%s' for '%s' not found\n", name, streams[i].name);
+            return -1;
+        }
+        fprintf(stderr, "Replaying '%s' onto '%s'\n", streams[i].name, name);
+    }
+
+    for (i = 0; i < REPLAY_BATCH_SIZE; i++)
+    {
+        out->iovs[i].iov_base = out->buffers + i * out->mtu;
+        out->msgs[i].msg_hdr.msg_iov = &out->iovs[i];
+        out->msgs[i].msg_hdr.msg_iovlen = 1;
+        out->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_can);
+    }
+
+    return 0;
+}
+
+int output_init_udp(output_t *out, stream_t *streams, unsigned int count, const char *address, const char *port)
+{
+    struct addrinfo *ai;
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_NUMERICSERV,
+    };
+    const int enable = 1;
+    unsigned int i;
+    int err;
+
+    if ((err = getaddrinfo(address, port, &hints, &ai)) != 0)
+    {
+        fprintf(stderr, "Invalid address '%s': %s\n", address, gai_strerror(err));
+        return -1;
+    }
+
+    memcpy(&out->address, ai->ai_addr, ai->ai_addrlen);
+    out->address_length = ai->ai_addrlen;
+    out->fd = socket(ai->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+    freeaddrinfo(ai);
+
+    if (out->fd < 0)
+    {
+        fprintf(stderr, "UDP socket error: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(out->fd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+
+    /* .. packets of several frames are built per interface */
+    if (out->version >= CAN2UDP_PACKET_VERSION_3)
+        for (i = 0; i < count; i++)
+            if (!(streams[i].aggregate = malloc(out->mtu)))
+                return -1;
+
+    for (i = 0; i < REPLAY_BATCH_SIZE; i++)
+    {
+        out->iovs[i].iov_base = out->buffers + i * out->mtu;
+        out->msgs[i].msg_hdr.msg_iov = &out->iovs[i];
+        out->msgs[i].msg_hdr.msg_iovlen = 1;
+        out->msgs[i].msg_hdr.msg_name = &out->address;
+        out->msgs[i].msg_hdr.msg_namelen = out->address_length;
+    }
+
+    return 0;
+}
+
+/* .. send all queued messages. CAN frames are retried while the transmit queue is full */
+void output_flush(output_t *out)
+{
+    unsigned int sent = 0;
+
+    while (sent < out->count && !quit)
+    {
+        int n = sendmmsg(out->fd, out->msgs + sent, out->count - sent, 0);
+
+        if (n > 0)
+        {
+            sent += n;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        /* .. the bus is slower than the recording, wait instead of dropping */
+        if (!out->version && (errno == ENOBUFS || errno == EAGAIN))
+        {
+            struct timespec retry = { 0, REPLAY_RETRY_NS };
+            nanosleep(&retry, NULL);
+            continue;
+        }
+
+        out->errors++;
+        sent++;
+    }
+
+    /* .. messages left on quit were not sent */
+    out->messages += sent;
+    out->count = 0;
+}
+
+/* .. reserve a message of 'length' bytes */
+static inline uint8_t *output_message(output_t *out, size_t length)
+{
+    if (out->count == REPLAY_BATCH_SIZE)
+        output_flush(out);
+
+    out->iovs[out->count].iov_len = length;
+
+    return out->iovs[out->count++].iov_base;
+}
+
+/* .. queue the aggregated packet of the stream */
+void output_flush_aggregate(output_t *out, stream_t *stream)
+{
+    if (!stream->aggregate_length)
+        return;
+
+    memcpy(output_message(out, stream->aggregate_length), stream->aggregate, stream->aggregate_length);
+    stream->aggregate_length = 0;
+}
+
+/* .. queue the current frame of the stream */
+void output_frame(output_t *out, stream_t *stream)
+{
+    const struct canfd_frame *frame = &stream->frame;
+    int fd = (frame->flags & CANFD_FDF) || frame->len > CAN_MAX_DLEN;
+
+    if (!out->version && fd && !out->can_fd)
+    {
+        out->skipped++;
+        return;
+    }
+
+    out->frames++;
+
+    switch (out->version)
+    {
+    case 0:
+    {
+        /* .. CAN frames keep the flags of the bus only */
+        struct canfd_frame *raw = (struct canfd_frame *)output_message(out, fd ? CANFD_MTU : CAN_MTU);
+
+        memset(raw, 0, fd ? CANFD_MTU : CAN_MTU);
+        raw->can_id = frame->can_id;
+        raw->len = frame->len;
+        raw->flags = fd ? frame->flags & (CANFD_BRS | CANFD_ESI) : 0;
+        memcpy(raw->data, frame->data, frame->len);
+        out->msgs[out->count - 1].msg_hdr.msg_name = &stream->target;
+        break;
+    }
+
+    case CAN2UDP_PACKET_VERSION_2:
+    {
+        can2udp_packet_t packet = {
+            .version = CAN2UDP_PACKET_VERSION_2,
+            .interface_id = stream->interface_id,
+            .raw_frame = *frame,
+            .timestamp = stream->timestamp,
+        };
+
+        memcpy(output_message(out, sizeof(packet)), &packet, sizeof(packet));
+        break;
+    }
+
+    default:
+    {
+        size_t header_length = out->version == CAN2UDP_PACKET_VERSION_4 ? sizeof(can2udp_packet_ver4_t) : sizeof(can2udp_packet_ver3_t);
+        size_t size = can2udp_compact_record_size(frame->len);
+        can2udp_packet_ver4_t *header = (can2udp_packet_ver4_t *)stream->aggregate;
+
+        if (stream->aggregate_length + size > out->mtu)
+            output_flush_aggregate(out, stream);
+
+        /* .. start a packet */
+        if (!stream->aggregate_length)
+        {
+            memset(header, 0, header_length);
+            header->version = out->version;
+            header->flags = CAN2UDP_COMPACT;
+            header->interface_id = stream->interface_id;
+            if (out->version == CAN2UDP_PACKET_VERSION_4)
+                header->sequence = stream->sequence++;
+            stream->aggregate_length = header_length;
+        }
+
+        stream->aggregate_length += can2udp_compact_record_encode(stream->aggregate + stream->aggregate_length, frame, stream->timestamp);
+        header->count++;
+        break;
+    }
+    }
+}
+
+/* .. queue packets being filled and send everything */
+void output_flush_all(output_t *out, stream_t *streams, unsigned int count)
+{
+    unsigned int i;
+
+    if (out->version >= CAN2UDP_PACKET_VERSION_3)
+        for (i = 0; i < count; i++)
+            output_flush_aggregate(out, &streams[i]);
+
+    if (out->count)
+        output_flush(out);
+}
+
+/*
+ * Timing
+ */
+
+/* .. sleep until shortly before the deadline, then spin until it passes */
+void wait_until(uint64_t deadline, uint64_t spin)
+{
+    uint64_t now = now_ns();
+
+    if (deadline > now + spin)
+    {
+        struct timespec ts = {
+            .tv_sec = (deadline - spin) / 1000000000ull,
+            .tv_nsec = (deadline - spin) % 1000000000ull,
+        };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !quit)
+            ;
+    }
+
+    while (now_ns() < deadline && !quit)
+        ;
+}
+
+/* .. read a decimal option within limits. Returns 0 or -1 */
+static int parse_option(const char *arg, long min, long max, long *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtol(arg, &end, 10);
+
+    return errno || end == arg || *end || *value < min || *value > max ? -1 : 0;
+}
+
+/* .. read a decimal number option within limits. Returns 0 or -1 */
+static int parse_number(const char *arg, double min, double max, double *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtod(arg, &end);
+
+    /* .. NaN fails both comparisons */
+    return errno || end == arg || *end || !(*value >= min && *value <= max) ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] segment...\n"
+            "  -s speed      time scale, 2 plays twice as fast, 0 as fast as possible (1)\n"
+            "  -I rec=can    write frames of recorded interface 'rec' to 'can' (same name)\n"
+            "  -u address    send can2udp packets to the address instead of CAN interfaces\n"
+            "  -p port       UDP port (4858)\n"
+            "  -V version    version of UDP packets: 2, 3 or 4 (2)\n"
+            "  -m mtu        maximal size of version 3 and 4 packets (1472)\n"
+            "  -o seconds    start at this offset from the beginning of the recording\n"
+            "  -d seconds    replay this long\n"
+            "  -l loops      repeat the replay, 0 forever (1)\n"
+            "  -S usec       spin this long before every deadline instead of sleeping (%d)\n",
+            name, REPLAY_DEFAULT_SPIN);
+}
+
+int main(int argc, char **argv)
+{
+    static stream_t streams[REPLAY_MAX_STREAMS];
+    static output_t out;
+    unsigned int count = 0, i;
+    char *map[REPLAY_MAX_STREAMS];
+    unsigned int map_count = 0;
+    const char *address = NULL, *port = "4858";
+    double speed = 1.0, offset = 0, duration = 0;
+    long loops = 1, loop, value;
+    uint64_t spin = REPLAY_DEFAULT_SPIN * 1000ull;
+    uint64_t first = UINT64_MAX, late = 0, max_late = 0, backwards = 0;
+    size_t min_mtu = sizeof(can2udp_packet_ver4_t) + can2udp_compact_record_size(CANFD_MAX_DLEN);
+    int c;
+
+    /* .. every packet version and a record of the largest frame fit into a message */
+    if (min_mtu < sizeof(can2udp_packet_t))
+        min_mtu = sizeof(can2udp_packet_t);
+
+    out.version = 0;
+    out.mtu = CAN2UDP_DEFAULT_MTU;
+
+    while ((c = getopt(argc, argv, "s:I:u:p:V:m:o:d:l:S:h")) != -1)
+        switch (c)
+        {
+        case 's':
+            if (parse_number(optarg, 0, REPLAY_MAX_SPEED, &speed) < 0)
+            {
+                fprintf(stderr, "Invalid speed '%s', it must be 0 to %g\n", optarg, REPLAY_MAX_SPEED);
+                return 1;
+            }
+            break;
+
+        case 'I':
+            if (map_count < REPLAY_MAX_STREAMS)
+                map[map_count++] = optarg;
+            break;
+
+        case 'u':
+            address = optarg;
+            break;
+
+        case 'p':
+            port = optarg;
+            break;
+
+        case 'V':
+            if (parse_option(optarg, CAN2UDP_PACKET_VERSION_2, CAN2UDP_PACKET_VERSION_4, &value) < 0)
+            {
+                fprintf(stderr, "Unsupported packet version '%s'\n", optarg);
+                return 1;
+            }
+            out.version = value;
+            break;
+
+        case 'm':
+            if (parse_option(optarg, min_mtu, REPLAY_MAX_MTU, &value) < 0)
+            {
+                fprintf(stderr, "Invalid MTU '%s', it must be %zu to %d bytes\n", optarg, min_mtu, REPLAY_MAX_MTU);
+                return 1;
+            }
+            out.mtu = value;
+            break;
+
+        case 'o':
+            if (parse_number(optarg, 0, REPLAY_MAX_SECONDS, &offset) < 0)
+            {
+                fprintf(stderr, "Invalid offset '%s', it must be 0 to %g s\n", optarg, REPLAY_MAX_SECONDS);
+                return 1;
+            }
+            break;
+
+        case 'd':
+            if (parse_number(optarg, 0, REPLAY_MAX_SECONDS, &duration) < 0)
+            {
+                fprintf(stderr, "Invalid duration '%s', it must be 0 to %g s\n", optarg, REPLAY_MAX_SECONDS);
+                return 1;
+            }
+            break;
+
+        case 'l':
+            if (parse_option(optarg, 0, LONG_MAX, &loops) < 0)
+            {
+                fprintf(stderr, "Invalid number of loops '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'S':
+            if (parse_option(optarg, 0, REPLAY_MAX_SPIN, &value) < 0)
+            {
+                fprintf(stderr, "Invalid spin time '%s', it must be 0 to %d us\n", optarg, REPLAY_MAX_SPIN);
+                return 1;
+            }
+            spin = value * 1000ull;
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            return 0;
+
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+
+    if (optind == argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* .. UDP packets default to version 2, CAN output has no version */
+    if (address && !out.version)
+        out.version = CAN2UDP_PACKET_VERSION_2;
+    if (!address)
+        out.version = 0;
+
+    for (; optind < argc; optind++)
+        if (segment_open(streams, &count, argv[optind]) < 0)
+            return 1;
+
+    if (!count)
+    {
+        fprintf(stderr, "No frames to replay\n");
+        return 1;
+    }
+
+    if (!(out.buffers = malloc(REPLAY_BATCH_SIZE * out.mtu)))
+        return 1;
+
+    if ((address ? output_init_udp(&out, streams, count, address, port) :
+         output_init_can(&out, streams, count, map, map_count)) < 0)
+        return 1;
+
+    /* .. all interfaces share the time base of the earliest frame */
+    for (i = 0; i < count; i++)
+        if (streams[i].segments[0].header->first_timestamp < first)
+            first = streams[i].segments[0].header->first_timestamp;
+    first += (uint64_t)(offset * 1e9);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    for (loop = 0; (!loops || loop < loops) && !quit; loop++)
+    {
+        uint64_t start = now_ns(), previous = start;
+        uint64_t end = duration > 0 ? first + (uint64_t)(duration * 1e9) : UINT64_MAX;
+
+        for (i = 0; i < count; i++)
+            stream_seek(&streams[i], first);
+
+        while (!quit)
+        {
+            stream_t *stream = NULL;
+
+            /* .. the earliest frame of all interfaces */
+            for (i = 0; i < count; i++)
+                if (streams[i].pending && (!stream || streams[i].timestamp < stream->timestamp))
+                    stream = &streams[i];
+
+            if (!stream || stream->timestamp >= end)
+                break;
+
+            if (speed > 0)
+            {
+                uint64_t deadline = start + (uint64_t)((stream->timestamp > first ? stream->timestamp - first : 0) / speed);
+                uint64_t now = now_ns();
+
+                /* .. frames stamped before the start or the previous frame go out at once */
+                if (stream->timestamp < first || deadline < previous)
+                {
+                    if (deadline < previous)
+                        deadline = previous;
+                    backwards++;
+                }
+                previous = deadline;
+
+                /* .. send what is queued before waiting */
+                if (deadline > now)
+                {
+                    output_flush_all(&out, streams, count);
+                    wait_until(deadline, spin);
+                }
+                else if (now - deadline > max_late)
+                    max_late = now - deadline;
+
+                if (now > deadline + spin)
+                    late++;
+            }
+
+            output_frame(&out, stream);
+            stream_advance(stream);
+        }
+
+        output_flush_all(&out, streams, count);
+    }
+
+    fprintf(stderr, "%llu frames in %llu messages, %llu errors, %llu frames late by more than %llu us, at most %llu us\n",
+            (unsigned long long)out.frames, (unsigned long long)out.messages, (unsigned long long)out.errors,
+            (unsigned long long)late, (unsigned long long)(spin / 1000), (unsigned long long)(max_late / 1000));
+    if (backwards)
+        fprintf(stderr, "%llu frames stamped out of order were sent without delay\n", (unsigned long long)backwards);
+    if (out.skipped)
+        fprintf(stderr, "%llu CAN FD frames skipped\n", (unsigned long long)out.skipped);
+
+    return 0;
+}